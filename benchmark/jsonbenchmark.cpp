@@ -3,6 +3,11 @@
 #include <algorithm>
 #include <vector>
 #include <memory>
+#include <thread>
+#include <chrono>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
 
 #define ZENJSON     0
 #define RAPIDJSON   1
@@ -41,15 +46,11 @@ void benchmark(const char* filename) {
     fread(buffer.data(), length, 1, file);
     fclose(file);
     
-    auto printResult = [&](const std::string& name, clock_t elapsed) {
+    // throughput over the input for a parse, over the output for a dump
+    auto printResult = [&](const std::string& name, clock_t elapsed, size_t size) {
         double average = 1000.0 * elapsed / CLOCKS_PER_SEC / N;
-        if (name.rfind("parse") == 0) {
-            double throughput = length / (1024.0 * 1024.0) / (average * 0.001);
-            printf("%12s %24s    %0.3f ms    %3.3f MB/s\n", name.c_str(), filename, average, throughput);
-        }
-        else {
-            printf("%12s %24s    %0.3f ms\n", name.c_str(), filename, average);
-        }
+        double throughput = size / (1024.0 * 1024.0) / (average * 0.001);
+        printf("%12s %24s    %0.3f ms    %3.3f MB/s\n", name.c_str(), filename, average, throughput);
     };
 
 #if TARGET == ZENJSON
@@ -60,9 +61,9 @@ void benchmark(const char* filename) {
     clock_t start = clock();
     for (size_t i = 0; i < N; ++i) {
         memcpy(xbuf, buffer.data(), buffer.size());
-        int err = d.parse(xbuf);
+        int err = d.parse(xbuf, buffer.size());
     }
-    printResult("parse", clock() - start);
+    printResult("parse", clock() - start, length);
     // stringify
     char* outbuf = new char[1024 * 1024 * 4];
     size_t outSize = 0;
@@ -70,7 +71,17 @@ void benchmark(const char* filename) {
     for (size_t i = 0; i < N; ++i) {
         d.dump(outbuf, 1024 * 1024 * 4, &outSize);
     }
-    printResult("dump", clock() - start);
+    printResult("dump", clock() - start, outSize);
+    start = clock();
+    for (size_t i = 0; i < N; ++i) {
+        d.dump(outbuf, 1024 * 1024 * 4, &outSize, false);
+    }
+    printResult("dump compact", clock() - start, outSize);
+    start = clock();
+    for (size_t i = 0; i < N; ++i) {
+        d.dump(outbuf, 1024 * 1024 * 4, &outSize, zjson::DumpStyle::rfc8785());
+    }
+    printResult("dump canonical", clock() - start, outSize);
     delete[] xbuf;
     delete[] outbuf;
 #elif TARGET == RAPIDJSON
@@ -83,16 +94,18 @@ void benchmark(const char* filename) {
         memcpy(xbuf, buffer.data(), buffer.size());
         d.ParseInsitu(xbuf);
     }
-    printResult("parse", clock() - start);
+    printResult("parse", clock() - start, length);
     // stringify
     rapidjson::StringBuffer outbuf;
     outbuf.Reserve(1024 * 1024 * 16);
     rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(outbuf);
     start = clock();
     for (size_t i = 0; i < N; ++i) {
+        outbuf.Clear();
+        writer.Reset(outbuf);
         d.Accept(writer);
     }
-    printResult("dump", clock() - start);
+    printResult("dump", clock() - start, outbuf.GetSize());
     delete[] xbuf;
 #elif TARGET == SIMDJSON
     // parse
@@ -103,7 +116,7 @@ void benchmark(const char* filename) {
     for (size_t i = 0; i < N; ++i) {
         int err = json_parse(xbuf, pj);
     }
-    printResult("parse", clock() - start);
+    printResult("parse", clock() - start, length);
 #elif TARGET == NLOHMANN
     // parse
     std::string xbuf(buffer.begin(), buffer.end());
@@ -112,20 +125,200 @@ void benchmark(const char* filename) {
     for (size_t i = 0; i < N; ++i) {
         json = nlohmann::json::parse(xbuf);
     }
-    printResult("parse", clock() - start);
+    printResult("parse", clock() - start, length);
     // stringify
     std::string outstr;
     start = clock();
     for (size_t i = 0; i < N; ++i) {
         outstr = json.dump();
     }
-    printResult("dump", clock() - start);
+    printResult("dump", clock() - start, outstr.size());
 #endif
 }
 
+#if TARGET == ZENJSON
+void benchmarkBuilder() {
+    const size_t count = 1000000, M = 10;
+    zjson::Document d;
+    clock_t start = clock();
+    for (size_t i = 0; i < M; ++i) {
+        zjson::Builder builder(d);
+        builder.beginArray();
+        for (size_t j = 0; j < count; ++j) {
+            builder.value((int32_t)j);
+        }
+        builder.endArray();
+    }
+    double average = 1000.0 * (clock() - start) / CLOCKS_PER_SEC / M;
+    printf("%12s %24s    %0.3f ms\n", "build", "1M-element array", average);
+}
+
+// walk a modified document (every string copied into the arena), with and without split arenas
+size_t traverse(zjson::Value& value, bool find) {
+    size_t count = 1;
+    if (value.getType() == zjson::JSON_ARRAY || value.getType() == zjson::JSON_OBJECT) {
+        const char* last = nullptr;
+        for (zjson::Node* node : value) {
+            count += traverse(node->value, find);
+            if (value.getType() == zjson::JSON_OBJECT) last = node->name;
+        }
+        if (find && last) count += zjson::Json(&value).findValue(last) != nullptr;
+    }
+    return count;
+}
+
+void benchmarkTraversal(const char* filename) {
+    FILE* file = fopen(filename, "rb");
+    fseek(file, 0, SEEK_END);
+    size_t length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    std::vector<char> buffer(length + 1);
+    fread(buffer.data(), length, 1, file);
+    fclose(file);
+    buffer[length] = 0;
+    zjson::Document source;
+    source.parse(buffer.data(), length);
+    for (int split = 0; split < 2; ++split) {
+        zjson::Document d;
+        d.setSplitArenas(split != 0);
+        static_cast<zjson::Json&>(d) = source;
+        for (int find = 0; find < 2; ++find) {
+            size_t count = 0;
+            clock_t start = clock();
+            zjson::Value root = d.toValue();
+            for (size_t i = 0; i < N; ++i) {
+                count += traverse(root, find != 0);
+            }
+            double average = 1000.0 * (clock() - start) / CLOCKS_PER_SEC / N;
+            char label[64];
+            snprintf(label, sizeof(label), "%s%s", find ? "find" : "traverse", split ? " split" : "");
+            printf("%12s %24s    %0.3f ms\n", label, filename, average);
+        }
+    }
+}
+
+// dump with each number format, time and output size
+void benchmarkNumberFormats(const char* filename) {
+    FILE* file = fopen(filename, "rb");
+    fseek(file, 0, SEEK_END);
+    size_t length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    std::vector<char> buffer(length + 1);
+    fread(buffer.data(), length, 1, file);
+    fclose(file);
+    buffer[length] = 0;
+    zjson::Document d;
+    d.parse(buffer.data(), length);
+    const struct { const char* name; zjson::NumberFormat format; } formats[] = {
+        { "shortest", zjson::NumberFormat() },
+        { "fixed 6", zjson::NumberFormat(zjson::NUMBER_FIXED, 6) },
+        { "precision 6", zjson::NumberFormat(zjson::NUMBER_PRECISION, 6) },
+        { "float32", zjson::NumberFormat(zjson::NUMBER_FLOAT32) },
+    };
+    char* outbuf = new char[1024 * 1024 * 4];
+    for (const auto& f : formats) {
+        size_t outSize = 0;
+        clock_t start = clock();
+        for (size_t i = 0; i < N; ++i) {
+            d.dump(outbuf, 1024 * 1024 * 4, &outSize, false, f.format);
+        }
+        double average = 1000.0 * (clock() - start) / CLOCKS_PER_SEC / N;
+        printf("%12s %24s    %0.3f ms, %zu bytes\n", f.name, filename, average, outSize);
+    }
+    delete[] outbuf;
+}
+
+// construct, parse and destroy a small RPC message each time
+template <typename D>
+void benchmarkTinyDocument(const char* name) {
+    const char* message = "{\"jsonrpc\":\"2.0\",\"method\":\"update\",\"params\":{\"id\":12345,"
+        "\"name\":\"zenjson\",\"values\":[1,2,3,4.5],\"enabled\":true},\"id\":7}";
+    const size_t length = strlen(message), M = 1000000;
+    char xbuf[256];
+    clock_t start = clock();
+    for (size_t i = 0; i < M; ++i) {
+        D d;
+        memcpy(xbuf, message, length + 1);
+        d.parse(xbuf, length);
+    }
+    double average = 1e9 * (clock() - start) / CLOCKS_PER_SEC / M;
+    printf("%12s %24s    %0.1f ns\n", "tiny", name, average);
+}
+
+// documents of a few blocks each on many threads, with blocks from malloc or the block pool
+void benchmarkBlockPool(zjson::MemoryResource* upstream, const char* name) {
+    std::string message = "[";
+    for (int i = 0; i < 1000; ++i) message += "{\"id\":" + std::to_string(i) + ",\"name\":\"item\"},";
+    message.back() = ']';
+    const size_t M = 20000;
+    for (int threads = 1; threads <= 64; threads *= 2) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&]() {
+                std::vector<char> xbuf(message.size() + 1);
+                for (size_t i = 0; i < M / threads; ++i) {
+                    zjson::Document d(nullptr, 0, upstream);
+                    memcpy(xbuf.data(), message.c_str(), message.size() + 1);
+                    d.parse(xbuf.data());
+                }
+            });
+        }
+        for (auto& worker : workers) worker.join();
+        double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        char label[64];
+        snprintf(label, sizeof(label), "%s x%d", name, threads);
+        printf("%12s %24s    %0.3f ms\n", "threads", label, elapsed);
+    }
+}
+#endif
+
+#if TARGET == ZENJSON && defined(ZJSON_HAS_VIRTUAL_MEMORY) && !defined(_WIN32)
+// parse a generated corpus of the given size, count page faults of malloc blocks and a huge-page arena
+void benchmarkLargeDocument(size_t size) {
+    std::string corpus = "[";
+    for (int i = 0; corpus.size() < size; ++i) {
+        corpus += "{\"id\":" + std::to_string(i) + ",\"name\":\"user" + std::to_string(i) +
+            "\",\"score\":" + std::to_string(i * 0.25) + ",\"tags\":[\"a\",\"b\"],\"active\":true},";
+    }
+    corpus.back() = ']';
+    std::vector<char> xbuf(corpus.size() + 1);
+    for (int backend = 0; backend < 2; ++backend) {
+        zjson::VirtualMemoryResource vm;
+        zjson::MemoryResource* upstream = backend ? &vm : zjson::defaultResource();
+        zjson::Document d(nullptr, 0, upstream);
+        memcpy(xbuf.data(), corpus.c_str(), corpus.size() + 1);
+        struct rusage before, after;
+        getrusage(RUSAGE_SELF, &before);
+        auto start = std::chrono::steady_clock::now();
+        d.parse(xbuf.data(), corpus.size());
+        double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        getrusage(RUSAGE_SELF, &after);
+        printf("%12s %24s    %0.3f ms, %ld page faults\n", "large", backend ? "VirtualMemoryResource" : "malloc",
+            elapsed, (after.ru_minflt - before.ru_minflt) + (after.ru_majflt - before.ru_majflt));
+    }
+}
+#endif
+
 int main()
 {
     for (size_t i = 0; jsonFiles[i]; ++i) {
         benchmark(jsonFiles[i]);
     }
+#if TARGET == ZENJSON
+    benchmarkBuilder();
+    benchmarkTraversal("data/twitter.json");
+    benchmarkTraversal("data/citm_catalog.json");
+    benchmarkNumberFormats("data/canada.json");
+    benchmarkTinyDocument<zjson::Document>("Document");
+    benchmarkTinyDocument<zjson::InlineDocument<4096>>("InlineDocument<4096>");
+    benchmarkBlockPool(zjson::defaultResource(), "malloc");
+    benchmarkBlockPool(&zjson::BlockPool::instance(), "BlockPool");
+    zjson::BlockPool::Stats stats = zjson::BlockPool::instance().getStats();
+    printf("%12s %24s    cache %llu, global %llu, miss %llu\n", "pool", "hits",
+        (unsigned long long)stats.cacheHits, (unsigned long long)stats.globalHits, (unsigned long long)stats.misses);
+#if defined(ZJSON_HAS_VIRTUAL_MEMORY) && !defined(_WIN32)
+    benchmarkLargeDocument((size_t)1 << 30);
+#endif
+#endif
 }
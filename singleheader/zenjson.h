@@ -37,6 +37,26 @@
 #define ZJSON_FORCE_INLINE inline
 #endif
 
+#if !defined(ZJSON_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define ZJSON_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// exceptions may be disabled, e.g. -fno-exceptions
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+#define ZJSON_HAS_EXCEPTIONS
+#endif
+
+// aligned vector loads may read past the end of a string, but never across a page
+#if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5)
+#define ZJSON_NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#else
+#define ZJSON_NO_SANITIZE_ADDRESS
+#endif
+
 namespace zjson {
 
 enum Type {
@@ -60,20 +80,144 @@ enum Error {
     ERROR_MISMATCH_BRACKET,
     ERROR_UNEXPECTED_CHARACTER,
     ERROR_BREAKING_BAD,
-    ERROR_OUT_OF_MEMORY
+    ERROR_OUT_OF_MEMORY,
+    ERROR_IO
 };
+enum ParseFlags {
+    PARSE_DEFAULT = 0,
+    PARSE_SHAPED_OBJECTS = 1,   // objects with the same key sequence share one shape
+    PARSE_KEEP_SOURCE = 2       // keep the input to dump unmodified parts as they were
+};
+inline ParseFlags operator|(ParseFlags a, ParseFlags b) {
+    return ParseFlags((int)a | (int)b);
+}
 
 } // namespace zjson
 
 
 // #include "allocator.h"
 
+#if (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || __cplusplus >= 201703L
+#include <memory_resource>
+#define ZJSON_HAS_PMR
+#endif
+
 namespace zjson {
 
-#define ZJSON_BLOCK_SIZE    8192
+#define ZJSON_BLOCK_SIZE        8192            // size of the first block
+#define ZJSON_BLOCK_GROWTH      2.0f            // geometric growth factor of block sizes
+#define ZJSON_MAX_BLOCK_SIZE    (64 << 20)      // blocks stop growing at this size
+#define ZJSON_DOM_SIZE_RATIO    1               // estimated DOM size per byte of input
+#define ZJSON_RETAIN_HISTORY    16              // max number of resets a retention window covers
+#define ZJSON_RECYCLE_MAX_SIZE  256             // larger chunks are not recycled
+
+#ifdef ZJSON_ENABLE_STATS
+#define ZJSON_STAT(x) x
+#else
+#define ZJSON_STAT(x)
+#endif
+
+// Memory usage of a document. bytesRequested and highWater are counted only when
+// ZJSON_ENABLE_STATS is defined, the others are collected when they are asked for.
+struct MemoryStats {
+    size_t bytesRequested;  // total size of allocations since the last reset
+    size_t bytesReserved;   // capacity of the blocks in use
+    size_t blocks;          // number of the blocks in use
+    size_t tailWaste;       // bytes left at the end of the blocks in use, except the current one
+    size_t freeBytes;       // capacity of the free blocks kept for reuse
+    size_t recycledBytes;   // chunks in the recycling free lists
+    size_t highWater;       // the largest bytesReserved ever
+    size_t values[16];      // number of values of each Type
+};
+
+// How an allocator sizes its blocks. The first one is initialSize bytes, each new one
+// is growthFactor times larger than the previous, up to maxSize.
+struct BlockPolicy {
+    size_t initialSize;
+    float growthFactor;
+    size_t maxSize;
+};
+inline BlockPolicy defaultBlockPolicy() {
+    return BlockPolicy { ZJSON_BLOCK_SIZE, ZJSON_BLOCK_GROWTH, ZJSON_MAX_BLOCK_SIZE };
+}
+
+// How much memory an allocator keeps for reuse when it is reset, the rest goes back to
+// upstream. It keeps at most maxSize bytes, and if window is not 0, no more than the
+// largest usage of the last window resets, so an outlier does not stay forever.
+struct RetentionPolicy {
+    size_t maxSize;
+    uint32_t window;
+};
+inline RetentionPolicy defaultRetentionPolicy() {
+    return RetentionPolicy { SIZE_MAX, 0 };
+}
+
+// Where an allocator gets its blocks from, like std::pmr::memory_resource.
+class MemoryResource {
+public:
+    virtual ~MemoryResource() {}
+    virtual void *allocate(size_t size) = 0;
+    virtual void deallocate(void *ptr, size_t size) = 0;
+    // whether allocators keep their free blocks for reuse, or return them on reset
+    virtual bool retainsFreeBlocks() const { return true; }
+};
+
+class MallocResource final : public MemoryResource {
+public:
+    void *allocate(size_t size) override { return malloc(size); }
+    void deallocate(void *ptr, size_t) override { free(ptr); }
+};
+inline MemoryResource *defaultResource() {
+    static MallocResource s_resource;
+    return &s_resource;
+}
+
+#ifdef ZJSON_HAS_PMR
+// Adapts a std::pmr::memory_resource, e.g. a std::pmr::monotonic_buffer_resource.
+class PmrResource final : public MemoryResource {
+public:
+    explicit PmrResource(std::pmr::memory_resource *upstream) : _upstream(upstream) {}
+    void *allocate(size_t size) override {
+#ifdef ZJSON_HAS_EXCEPTIONS
+        try {
+            return _upstream->allocate(size, alignof(std::max_align_t));
+        }
+        catch (const std::bad_alloc &) {
+            return nullptr;
+        }
+#else
+        return _upstream->allocate(size, alignof(std::max_align_t));
+#endif
+    }
+    void deallocate(void *ptr, size_t size) override { _upstream->deallocate(ptr, size, alignof(std::max_align_t)); }
+private:
+    std::pmr::memory_resource *_upstream;
+};
+#endif
+
+class SourceSpans;
+
 class Allocator {
 public:
-    Allocator() : blocksHead(nullptr), freeBlocksHead(nullptr) {};
+    // blocks come from upstream, after the caller-owned buffer is used up if given.
+    // with a null upstream, allocations fail when the buffer runs out.
+    explicit Allocator(const BlockPolicy &policy = defaultBlockPolicy(), MemoryResource *upstream = defaultResource(),
+        void *buffer = nullptr, size_t bufferSize = 0)
+        : blocksHead(nullptr), freeBlocksHead(nullptr), bufferBlock(nullptr), upstream(upstream),
+        policy(policy), nextBlockSize(policy.initialSize), retention(defaultRetentionPolicy()), resets(0),
+        recycling(false), recycledMask(0), strings(nullptr), sources(nullptr)
+    {
+        assert(policy.growthFactor >= 1 && policy.initialSize <= policy.maxSize);
+        memset(recycled, 0, sizeof(recycled));
+        ZJSON_STAT(statRequested = statReserved = statHighWater = 0);
+        uintptr_t begin = ((uintptr_t)buffer + 7) & ~(uintptr_t)7;
+        uintptr_t end = (uintptr_t)buffer + bufferSize;
+        if (buffer && end > begin && end - begin > sizeof(Block)) {
+            freeBlocksHead = bufferBlock = (Block *)begin;
+            bufferBlock->next = nullptr;
+            bufferBlock->size = (end - begin) & ~(uintptr_t)7;
+        }
+    };
     Allocator(const Allocator &) = delete;
     Allocator &operator=(const Allocator &) = delete;
     ~Allocator() {
@@ -81,193 +225,1398 @@ public:
     }
     inline void *allocate(size_t size) {
         size = (size + 7) & ~7;
-        if (blocksHead && blocksHead->used + size <= ZJSON_BLOCK_SIZE) {
+        ZJSON_STAT(statRequested += size);
+        if (ZJSON_UNLIKELY(recycledMask) && size && size <= ZJSON_RECYCLE_MAX_SIZE) {
+            size_t c = size / 8 - 1;
+            if (void *p = recycled[c]) {
+                recycled[c] = *(void **)p;
+                if (!recycled[c]) recycledMask &= ~(1ULL << c);
+                return p;
+            }
+        }
+        if (ZJSON_LIKELY(blocksHead && blocksHead->used + size <= blocksHead->size)) {
             char *p = (char *)blocksHead + blocksHead->used;
             blocksHead->used += size;
             return p;
         }
-        size_t allocSize = sizeof(Block) + size;
-        Block *block = freeBlocksHead;
-        if (block && block->size >= allocSize) { // reuse free block
-            freeBlocksHead = block->next;
+        return allocateBlock(size);
+    }
+    // strings are cold bytes for traversals, with a separate allocator for them the nodes
+    // of a container are packed densely
+    void setStringAllocator(Allocator *strings) {
+        this->strings = strings;
+    }
+    inline void *allocateString(size_t size) {
+        return strings ? strings->allocate(size) : allocate(size);
+    }
+    inline bool ownsString(const void *ptr) const {
+        return strings ? strings->owns(ptr) : owns(ptr);
+    }
+    inline void recycleString(void *ptr, size_t size) {
+        if (strings)
+            strings->recycle(ptr, size);
+        else
+            recycle(ptr, size);
+    }
+    // a hint of the total size to allocate, e.g. from the input size, so the next block
+    // could hold all of it
+    inline void reserve(size_t size) {
+        size += sizeof(Block);
+        if (size > policy.maxSize) size = policy.maxSize;
+        if (size > nextBlockSize) nextBlockSize = size;
+    }
+    // the largest allocation that fits in the blocks at hand, without one from upstream
+    size_t room() const {
+        size_t largest = blocksHead ? blocksHead->size - blocksHead->used + sizeof(Block) : 0;
+        for (Block *block = freeBlocksHead; block; block = block->next) {
+            if (block->size > largest) largest = block->size;
         }
-        else { // allocate new block
-            block = (Block *)malloc(allocSize <= ZJSON_BLOCK_SIZE ? ZJSON_BLOCK_SIZE : allocSize);
-            if (!block) return nullptr;
-            block->size = allocSize;
+        return largest > sizeof(Block) ? largest - sizeof(Block) : 0;
+    }
+    // takes effect from the next reset or abandonBlocks()
+    void setBlockPolicy(const BlockPolicy &policy) {
+        assert(policy.growthFactor >= 1 && policy.initialSize <= policy.maxSize);
+        this->policy = policy;
+    }
+    // when enabled, chunks given back by recycle() are reused by allocations of the same
+    // size. the owner must not share a chunk between values then.
+    void setRecycling(bool enabled) {
+        recycling = enabled;
+        if (!enabled) clearRecycled();
+    }
+    inline bool isRecycling() const {
+        return recycling;
+    }
+    // the input of the parsed document, see source.h. it lives in the blocks, so a reset
+    // drops it.
+    inline void setSources(SourceSpans *sources) {
+        this->sources = sources;
+    }
+    inline SourceSpans *getSources() const {
+        return sources;
+    }
+    inline void recycle(void *ptr, size_t size) {
+        size = (size + 7) & ~7;
+        if (!recycling || !size || size > ZJSON_RECYCLE_MAX_SIZE || !owns(ptr)) return;
+        size_t c = size / 8 - 1;
+        *(void **)ptr = recycled[c];
+        recycled[c] = ptr;
+        recycledMask |= 1ULL << c;
+    }
+    // whether ptr is in a block in use, strings of a parsed document are in its input instead
+    bool owns(const void *ptr) const {
+        for (Block *block = blocksHead; block; block = block->next) {
+            if ((const char *)ptr >= (const char *)block + sizeof(Block) && (const char *)ptr < (const char *)block + block->used)
+                return true;
         }
-        block->used = allocSize;
-        if (allocSize <= ZJSON_BLOCK_SIZE || !blocksHead) { // push_front
-            block->next = blocksHead;
-            blocksHead = block;
+        return false;
+    }
+    // take the blocks in use away, so following allocations go to other blocks. give them
+    // back with releaseBlocks() when they are no longer referenced.
+    void *detachBlocks() {
+        Block *chain = blocksHead;
+        blocksHead = nullptr;
+        nextBlockSize = policy.initialSize; // new blocks grow from the live size, not the history
+        clearRecycled();
+        ZJSON_STAT(statReserved = 0);
+        return chain;
+    }
+    // undo detachBlocks(), the blocks allocated since are released
+    void restoreBlocks(void *chain) {
+        Block *since = blocksHead;
+        blocksHead = (Block *)chain;
+        clearRecycled();
+        ZJSON_STAT(statReserved = 0);
+        ZJSON_STAT(for (Block *block = blocksHead; block; block = block->next) statReserved += block->size);
+        releaseBlocks(since);
+    }
+    // forget all blocks without touching them, they were carved from another allocator
+    // that could have been reset since
+    void abandonBlocks() {
+        blocksHead = nullptr;
+        freeBlocksHead = bufferBlock;
+        if (bufferBlock) bufferBlock->next = nullptr;
+        nextBlockSize = policy.initialSize;
+        clearRecycled();
+        ZJSON_STAT(statReserved = 0);
+    }
+    void releaseBlocks(void *chain) {
+        Block *block = (Block *)chain;
+        while (block) {
+            Block *nextblock = block->next;
+            if (block == bufferBlock) {
+                block->next = freeBlocksHead;
+                freeBlocksHead = block;
+            }
+            else {
+                upstream->deallocate(block, block->size);
+            }
+            block = nextblock;
         }
-        else { // insert
-            block->next = blocksHead->next;
-            blocksHead->next = block;
+    }
+    // add the statistics of this allocator to stats
+    void addStats(MemoryStats &stats) const {
+        for (Block *block = blocksHead; block; block = block->next) {
+            stats.blocks++;
+            stats.bytesReserved += block->size;
+            if (block != blocksHead) stats.tailWaste += block->size - block->used;
         }
-        return (char *)block + sizeof(Block);
+        for (Block *block = freeBlocksHead; block; block = block->next) stats.freeBytes += block->size;
+        for (size_t c = 0; recycledMask && c < ZJSON_RECYCLE_MAX_SIZE / 8; c++) {
+            for (void *p = recycled[c]; p; p = *(void **)p) stats.recycledBytes += (c + 1) * 8;
+        }
+#ifdef ZJSON_ENABLE_STATS
+        stats.bytesRequested += statRequested;
+        stats.highWater += statHighWater;
+#endif
+    }
+    void setRetention(const RetentionPolicy &retention) {
+        this->retention = retention;
+        if (retention.window > ZJSON_RETAIN_HISTORY) this->retention.window = ZJSON_RETAIN_HISTORY;
+        resets = 0;
     }
     inline void reset() {
+        if (strings) strings->reset();
+        sources = nullptr;
+        nextBlockSize = policy.initialSize; // a large parse doesn't size the blocks of later ones
+        clearRecycled();
+        ZJSON_STAT(statRequested = statReserved = 0);
+        size_t usage = 0;
         if (blocksHead) {
             Block* block = blocksHead;
-            while (block && block->next) block = block->next;
+            for (; ; block = block->next) {
+                if (block != bufferBlock) usage += block->size;
+                if (!block->next) break;
+            }
             block->next = freeBlocksHead;
             freeBlocksHead = blocksHead;
             blocksHead = nullptr;
         }
+        if (bufferBlock && freeBlocksHead != bufferBlock) { // the caller-owned buffer is reused first
+            Block* block = freeBlocksHead;
+            while (block->next != bufferBlock) block = block->next;
+            block->next = bufferBlock->next;
+            bufferBlock->next = freeBlocksHead;
+            freeBlocksHead = bufferBlock;
+        }
+        if (upstream && !upstream->retainsFreeBlocks()) {
+            trim(0);
+            return;
+        }
+        size_t keep = retention.maxSize;
+        if (retention.window) {
+            history[resets++ % retention.window] = usage;
+            size_t highWater = 0;
+            for (uint32_t i = 0; i < retention.window && i < resets; i++) {
+                if (history[i] > highWater) highWater = history[i];
+            }
+            if (highWater < keep) keep = highWater;
+        }
+        trim(keep);
+    }
+    // return free blocks to upstream until at most keepSize bytes of them are left,
+    // the caller-owned buffer is always kept
+    void trim(size_t keepSize = 0) {
+        Block** link = &freeBlocksHead;
+        size_t kept = 0;
+        while (Block* block = *link) {
+            if (block == bufferBlock || kept + block->size <= keepSize) {
+                if (block != bufferBlock) kept += block->size;
+                link = &block->next;
+            }
+            else {
+                *link = block->next;
+                upstream->deallocate(block, block->size);
+            }
+        }
+    }
+    // a position in the allocator, so it could be used as a stack
+    struct Marker {
+        void *block;
+        void *next; // the block after it then
+        size_t used;
+    };
+    inline Marker mark() const {
+        return Marker { blocksHead, blocksHead ? blocksHead->next : nullptr, blocksHead ? blocksHead->used : 0 };
+    }
+    // release everything allocated after the marker, blocks are kept for reuse. new blocks
+    // go in front of the head or right after it, so they are all before the one that
+    // followed the marked block.
+    inline void rewind(Marker marker) {
+        clearRecycled();
+        Block **link = &blocksHead;
+        while (*link != marker.next) {
+            Block *block = *link;
+            if (block == marker.block) {
+                link = &block->next;
+                continue;
+            }
+            ZJSON_STAT(statReserved -= block->size);
+            *link = block->next;
+            block->next = freeBlocksHead;
+            freeBlocksHead = block;
+        }
+        if (blocksHead) blocksHead->used = marker.used;
     }
     void deallocate() {
+        clearRecycled();
+        ZJSON_STAT(statReserved = 0);
         freeBlockChain(blocksHead);
         blocksHead = nullptr;
         freeBlockChain(freeBlocksHead);
-        freeBlocksHead = nullptr;
+        freeBlocksHead = bufferBlock;
+        if (bufferBlock) bufferBlock->next = nullptr;
     }
 private:
     struct Block {
         Block *next;
         size_t used;
-        size_t size;
-    } *blocksHead, *freeBlocksHead;
+        size_t size; // capacity, including the header
+    } *blocksHead, *freeBlocksHead, *bufferBlock;
+    MemoryResource *upstream;
+    BlockPolicy policy;
+    size_t nextBlockSize;
+    RetentionPolicy retention;
+    uint32_t resets;
+    size_t history[ZJSON_RETAIN_HISTORY]; // block usage of the last resets
+    bool recycling;
+    uint32_t recycledMask; // bit c is set if recycled[c] is not empty
+    void *recycled[ZJSON_RECYCLE_MAX_SIZE / 8]; // free lists of chunks of (c + 1) * 8 bytes
+    Allocator *strings;
+    SourceSpans *sources;
+#ifdef ZJSON_ENABLE_STATS
+    size_t statRequested, statReserved, statHighWater;
+#endif
+
+    void *allocateBlock(size_t size) {
+        size_t allocSize = sizeof(Block) + size;
+        Block **bestLink = nullptr;
+        for (Block **link = &freeBlocksHead; *link; link = &(*link)->next) { // best fit in free blocks
+            if ((*link)->size >= allocSize && (!bestLink || (*link)->size < (*bestLink)->size)) {
+                bestLink = link;
+                if ((*link)->size == allocSize) break;
+            }
+        }
+        Block *block;
+        if (bestLink) { // reuse free block
+            block = *bestLink;
+            *bestLink = block->next;
+        }
+        else { // allocate new block, oversized requests get a block of their own
+            size_t blockSize = allocSize <= nextBlockSize ? nextBlockSize : allocSize;
+            block = upstream ? (Block *)upstream->allocate(blockSize) : nullptr;
+            if (!block) return nullptr;
+            block->size = blockSize;
+            if (allocSize <= nextBlockSize) {
+                nextBlockSize = (size_t)(nextBlockSize * policy.growthFactor);
+                if (nextBlockSize > policy.maxSize) nextBlockSize = policy.maxSize;
+            }
+        }
+        block->used = allocSize;
+        ZJSON_STAT(statReserved += block->size);
+        ZJSON_STAT(if (statReserved > statHighWater) statHighWater = statReserved);
+        if (!blocksHead || block->size - allocSize >= blocksHead->size - blocksHead->used) { // push_front
+            block->next = blocksHead;
+            blocksHead = block;
+        }
+        else { // insert, the head block has more room left
+            block->next = blocksHead->next;
+            blocksHead->next = block;
+        }
+        return (char *)block + sizeof(Block);
+    }
+    inline void clearRecycled() {
+        if (!recycledMask) return;
+        memset(recycled, 0, sizeof(recycled));
+        recycledMask = 0;
+    }
     inline void freeBlockChain(Block* block) {
         while (block) {
             Block* nextblock = block->next;
-            free(block);
+            if (block != bufferBlock) upstream->deallocate(block, block->size);
             block = nextblock;
         }
     }
 };
 
+#define ZJSON_STACK_SIZE 32
+// The open containers of a traversal. The first ZJSON_STACK_SIZE levels are inline, deeper
+// trees move it to twice the capacity each time, taken from an arena if given (and left
+// there until it is reset) or from the heap. T is copied with memcpy.
+template <typename T>
+class DepthStack {
+public:
+    explicit DepthStack(Allocator* arena = nullptr)
+        : _items(_inline), _capacity(ZJSON_STACK_SIZE), _arena(arena) {}
+    ~DepthStack() {
+        if (_items != _inline && !_arena) free(_items);
+    }
+    DepthStack(const DepthStack&) = delete;
+    DepthStack& operator=(const DepthStack&) = delete;
+    inline T& operator[](int i) { return _items[i]; }
+    // make room for index i, false if out of memory
+    inline bool reserve(int i) {
+        return ZJSON_LIKELY(i < _capacity) || grow(i);
+    }
+private:
+    T* _items;
+    int _capacity;
+    Allocator* _arena;
+    T _inline[ZJSON_STACK_SIZE];
+
+    bool grow(int i) {
+        int capacity = _capacity * 2;
+        while (capacity <= i) capacity *= 2;
+        size_t size = (size_t)capacity * sizeof(T);
+        T* items = (T*)(_arena ? _arena->allocate(size) : malloc(size));
+        if (!items) return false;
+        memcpy((void*)items, (const void*)_items, (size_t)_capacity * sizeof(T));
+        if (_items != _inline && !_arena) free(_items);
+        _items = items;
+        _capacity = capacity;
+        return true;
+    }
+};
+
 } // namespace zjson
 
 
-// #include "value.h"
+// #include "pool.h"
+
+#include <atomic>
 
 namespace zjson {
 
-#define JSON_VALUE_PAYLOAD_MASK 0x00007FFFFFFFFFFFULL
-#define JSON_VALUE_NAN_MASK 0x7FF8000000000000ULL
-#define JSON_VALUE_TAG_MASK 0xF
-#define JSON_VALUE_TAG_SHIFT 47
+#define ZJSON_POOL_MIN_SHIFT    12          // the smallest pooled block is 4KB
+#define ZJSON_POOL_CLASSES      9           // power of two size classes, 4KB ~ 1MB
+#define ZJSON_POOL_CACHE_SIZE   8           // blocks of each size class in a thread cache
+#define ZJSON_POOL_STATS_BATCH  256         // thread counters are published in batches
+#define ZJSON_POOL_TAG_SHIFT    48          // bits of a pointer in a tagged list head
 
-struct Node;
-struct Value {
-    friend class Json;
-    inline Value(double x) : fval(x) {
-    }
-    explicit inline Value(Type type, void *payload = nullptr) {
-        assert((uintptr_t)payload <= JSON_VALUE_PAYLOAD_MASK);
-        ival = JSON_VALUE_NAN_MASK | ((uint64_t)type << JSON_VALUE_TAG_SHIFT) | (uintptr_t)payload;
+// A process-wide pool of allocator blocks. Each thread keeps a small cache, and the
+// overflow goes to lock-free global free lists, so documents on any thread reuse the
+// blocks of each other instead of hitting malloc. Blocks larger than the biggest size
+// class are not pooled. Use it as the upstream of documents:
+//     zjson::Document doc(nullptr, 0, &zjson::BlockPool::instance());
+class BlockPool final : public MemoryResource {
+public:
+    struct Stats {
+        uint64_t cacheHits;     // served by the thread cache
+        uint64_t globalHits;    // served by the global free lists
+        uint64_t misses;        // served by malloc
+    };
+    static BlockPool &instance() {
+        static BlockPool s_pool;
+        return s_pool;
     }
-    inline Value(int32_t x) {
-        ival = JSON_VALUE_NAN_MASK | ((uint64_t)JSON_INT << JSON_VALUE_TAG_SHIFT) | (x & 0xFFFFFFFF);
+    void *allocate(size_t size) override {
+        int c = sizeClass(size);
+        ThreadCache &cache = threadCache();
+        if (c < 0) {
+            cache.count(cache.misses);
+            return malloc(size);
+        }
+        if (cache.counts[c]) {
+            cache.count(cache.cacheHits);
+            return cache.blocks[c][--cache.counts[c]];
+        }
+        if (void *block = pop(c)) {
+            cache.count(cache.globalHits);
+            return block;
+        }
+        cache.count(cache.misses);
+        return malloc(classSize(c));
     }
-    explicit inline Value(nullptr_t) {
-        ival = JSON_VALUE_NAN_MASK | ((uint64_t)JSON_NULL << JSON_VALUE_TAG_SHIFT);
+    void deallocate(void *ptr, size_t size) override {
+        int c = sizeClass(size);
+        if (c < 0) {
+            free(ptr);
+            return;
+        }
+        ThreadCache &cache = threadCache();
+        if (cache.counts[c] < ZJSON_POOL_CACHE_SIZE)
+            cache.blocks[c][cache.counts[c]++] = ptr;
+        else
+            push(c, ptr);
     }
-    explicit inline Value(bool x) {
-        ival = JSON_VALUE_NAN_MASK | ((uint64_t)(x ? JSON_TRUE : JSON_FALSE) << JSON_VALUE_TAG_SHIFT);
+    // allocators hand blocks back on reset, so idle documents hold no memory
+    bool retainsFreeBlocks() const override { return false; }
+    // approximate, thread counters are published every ZJSON_POOL_STATS_BATCH operations
+    Stats getStats() const {
+        return Stats { _cacheHits.load(std::memory_order_relaxed), _globalHits.load(std::memory_order_relaxed),
+            _misses.load(std::memory_order_relaxed) };
     }
-    inline Type getType() const {
-        return isDouble() ? JSON_NUMBER : Type((ival >> JSON_VALUE_TAG_SHIFT) & JSON_VALUE_TAG_MASK);
+    // free the blocks of global lists, only when no other thread is using the pool
+    void release() {
+        for (int c = 0; c < ZJSON_POOL_CLASSES; c++) {
+            while (void *block = pop(c)) free(block);
+        }
     }
-    inline uint64_t getPayload() const {
-        assert(!isDouble());
-        return ival & JSON_VALUE_PAYLOAD_MASK;
+private:
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+    struct ThreadCache {
+        void *blocks[ZJSON_POOL_CLASSES][ZJSON_POOL_CACHE_SIZE];
+        uint8_t counts[ZJSON_POOL_CLASSES];
+        uint32_t cacheHits, globalHits, misses, pending;
+        ThreadCache() : cacheHits(0), globalHits(0), misses(0), pending(0) {
+            memset(counts, 0, sizeof(counts));
+        }
+        ~ThreadCache() { // the thread exits, give its blocks to other threads
+            BlockPool &pool = instance();
+            for (int c = 0; c < ZJSON_POOL_CLASSES; c++) {
+                while (counts[c]) pool.push(c, blocks[c][--counts[c]]);
+            }
+            publish();
+        }
+        inline void count(uint32_t &counter) {
+            counter++;
+            if (++pending == ZJSON_POOL_STATS_BATCH) publish();
+        }
+        void publish() {
+            BlockPool &pool = instance();
+            pool._cacheHits.fetch_add(cacheHits, std::memory_order_relaxed);
+            pool._globalHits.fetch_add(globalHits, std::memory_order_relaxed);
+            pool._misses.fetch_add(misses, std::memory_order_relaxed);
+            cacheHits = globalHits = misses = pending = 0;
+        }
+    };
+    // heads are tagged pointers, the upper 16 bits count updates against ABA
+    std::atomic<uint64_t> _heads[ZJSON_POOL_CLASSES];
+    std::atomic<uint64_t> _cacheHits, _globalHits, _misses;
+
+    BlockPool() : _cacheHits(0), _globalHits(0), _misses(0) {
+        for (int c = 0; c < ZJSON_POOL_CLASSES; c++) _heads[c].store(0);
     }
-    inline double toNumber() const {
-        assert(getType() == JSON_NUMBER);
-        return fval;
+    ~BlockPool() {
+        release();
     }
-    inline int32_t toInt() const {
-        assert(getType() == JSON_INT);
-        return ival & 0xFFFFFFFF;
+    static inline ThreadCache &threadCache() {
+        static thread_local ThreadCache s_cache;
+        return s_cache;
     }
-    inline char *toString() const {
-        assert(getType() == JSON_STRING);
-        return (char *)getPayload();
+    static inline int sizeClass(size_t size) {
+        int c = 0;
+        while (((size_t)1 << (c + ZJSON_POOL_MIN_SHIFT)) < size) c++;
+        return c < ZJSON_POOL_CLASSES ? c : -1;
     }
-    inline Node *toNode() const {
-        assert(getType() == JSON_ARRAY || getType() == JSON_OBJECT);
-        return (Node *)getPayload();
+    static inline size_t classSize(int c) {
+        return (size_t)1 << (c + ZJSON_POOL_MIN_SHIFT);
     }
-private:
-    union {
-        uint64_t ival;
-        double fval;
-    };
-    inline bool isDouble() const {
-        return (int64_t)ival <= (int64_t)JSON_VALUE_NAN_MASK;
+    static inline FreeBlock *untag(uint64_t head) {
+        return (FreeBlock *)(uintptr_t)(head & ((1ULL << ZJSON_POOL_TAG_SHIFT) - 1));
     }
-    // serialization
-    template <typename T>
-    void dump(T& out, bool formatted, int indent = 0) const;
-};
-
-struct Node {
-    Value value;
-    Node *next;
-    char *name;
-};
-
-struct NodeIterator {
-    Node *p;
-    void operator++() { p = p->next; }
-    bool operator!=(const NodeIterator &x) const { return p != x.p; }
-    Node *operator*() const { return p; }
-    Node *operator->() const { return p; }
-};
-inline NodeIterator begin(Value& v) {
-    return NodeIterator { v.toNode() };
-}
-inline NodeIterator end(Value&) {
-    return NodeIterator { nullptr };
-}
-
-inline Node *insertAfter(Node *tail, Node *node) {
-    if (!tail)
-        return node->next = node;
-    node->next = tail->next;
-    tail->next = node;
-    return node;
-}
-inline Value listToValue(Type type, Node *tail) {
-    if (tail) {
-        auto head = tail->next;
-        tail->next = nullptr;
-        return Value(type, head);
+    static inline uint64_t tag(FreeBlock *block, uint64_t head) {
+        return (uintptr_t)block | (((head >> ZJSON_POOL_TAG_SHIFT) + 1) << ZJSON_POOL_TAG_SHIFT);
     }
-    return Value(type, nullptr);
-}
-
-// free as a crt-allocated value
-void freeCrtAllocatedValue(Value value) {
-    Type type = value.getType();
-    if (type == JSON_STRING) {
-        free(value.toString());
+    void push(int c, void *ptr) {
+        FreeBlock *block = (FreeBlock *)ptr;
+        uint64_t head = _heads[c].load(std::memory_order_relaxed);
+        do {
+            block->next = untag(head);
+        } while (!_heads[c].compare_exchange_weak(head, tag(block, head),
+            std::memory_order_release, std::memory_order_relaxed));
     }
-    else if (type == JSON_ARRAY || type == JSON_OBJECT) {
-        Node* node = value.toNode();
-        while (node) {
-            if (type == JSON_OBJECT) free(node->name); // free key
-            freeCrtAllocatedValue(node->value); // free value
-            void* ptr = node;
-            node = node->next;
-            free(ptr); // free node
-        }
+    void *pop(int c) {
+        uint64_t head = _heads[c].load(std::memory_order_acquire);
+        FreeBlock *block;
+        do {
+            block = untag(head);
+            if (!block) return nullptr;
+        } while (!_heads[c].compare_exchange_weak(head, tag(block->next, head),
+            std::memory_order_acquire, std::memory_order_acquire));
+        return block;
     }
-}
+};
 
 } // namespace zjson
 
 
-// #include "deserialize.h"
+// #include "vmem.h"
+
+#if defined(_WIN32)
+// no min/max macros, and no ERROR_STACK_OVERFLOW of winerror.h over zjson's own unless
+// windows.h was included before
+#ifndef NOMINMAX
+#define NOMINMAX
+#define ZJSON_DEFINED_NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#define ZJSON_DEFINED_WIN32_LEAN_AND_MEAN
+#endif
+#ifdef ERROR_STACK_OVERFLOW
+#include <windows.h>
+#else
+#include <windows.h>
+#undef ERROR_STACK_OVERFLOW
+#endif
+#ifdef ZJSON_DEFINED_NOMINMAX
+#undef NOMINMAX
+#undef ZJSON_DEFINED_NOMINMAX
+#endif
+#ifdef ZJSON_DEFINED_WIN32_LEAN_AND_MEAN
+#undef WIN32_LEAN_AND_MEAN
+#undef ZJSON_DEFINED_WIN32_LEAN_AND_MEAN
+#endif
+#define ZJSON_HAS_VIRTUAL_MEMORY
+#elif defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define ZJSON_HAS_VIRTUAL_MEMORY
+#endif
 
+#ifdef ZJSON_HAS_VIRTUAL_MEMORY
 namespace zjson {
 
-static inline double pow10(int64_t exponent) {
-    if (exponent > 308) {
-        return std::numeric_limits<double>::infinity();
-    }
+#define ZJSON_VM_RESERVE_SIZE   (64ULL << 30)   // address space reserved by default
+#define ZJSON_VM_COMMIT_SIZE    (2 << 20)       // commit granularity, a huge page
+#define ZJSON_VM_PAGE_SIZE      4096            // pages of a deallocated block are given back
+
+// Blocks from one reserved range of virtual memory, committed as it is used. On Linux
+// the range asks for transparent huge pages, so multi-GB documents take far fewer TLB
+// misses and page faults. A deallocated block gives its pages back to the system, but
+// its address space is only reused if it's the last one, so trim() and a RetentionPolicy
+// cut the memory of a document and not its reservation. Everything is released at once
+// by release() or the destructor, after the documents using it are gone:
+//     zjson::VirtualMemoryResource vm;
+//     zjson::Document doc(nullptr, 0, &vm);
+class VirtualMemoryResource final : public MemoryResource {
+public:
+    explicit VirtualMemoryResource(size_t reserveSize = ZJSON_VM_RESERVE_SIZE)
+        : _base(nullptr), _reserved(0), _begin(nullptr), _used(0), _committed(0), _capacity(0)
+    {
+        reserveSize = (reserveSize + ZJSON_VM_COMMIT_SIZE - 1) & ~(size_t)(ZJSON_VM_COMMIT_SIZE - 1);
+        size_t size = reserveSize + ZJSON_VM_COMMIT_SIZE; // room to align the beginning to a huge page
+#if defined(_WIN32)
+        _base = (char *)VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+        _base = (char *)mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (_base == (char *)MAP_FAILED) _base = nullptr;
+#endif
+        if (!_base) return;
+        _reserved = size;
+        _begin = (char *)(((uintptr_t)_base + ZJSON_VM_COMMIT_SIZE - 1) & ~(uintptr_t)(ZJSON_VM_COMMIT_SIZE - 1));
+        _capacity = reserveSize;
+#ifdef MADV_HUGEPAGE
+        madvise(_begin, _capacity, MADV_HUGEPAGE);
+#endif
+    }
+    VirtualMemoryResource(const VirtualMemoryResource &) = delete;
+    VirtualMemoryResource &operator=(const VirtualMemoryResource &) = delete;
+    ~VirtualMemoryResource() {
+        release();
+    }
+    void *allocate(size_t size) override {
+        size = (size + 15) & ~(size_t)15;
+        if (size > _capacity - _used) return nullptr;
+        if (_used + size > _committed) {
+            size_t commit = (_used + size - _committed + ZJSON_VM_COMMIT_SIZE - 1) & ~(size_t)(ZJSON_VM_COMMIT_SIZE - 1);
+            if (commit > _capacity - _committed) commit = _capacity - _committed;
+#if defined(_WIN32)
+            if (!VirtualAlloc(_begin + _committed, commit, MEM_COMMIT, PAGE_READWRITE)) return nullptr;
+#else
+            if (mprotect(_begin + _committed, commit, PROT_READ | PROT_WRITE) != 0) return nullptr;
+#endif
+            _committed += commit;
+        }
+        void *p = _begin + _used;
+        _used += size;
+        return p;
+    }
+    void deallocate(void *ptr, size_t size) override {
+        size = (size + 15) & ~(size_t)15;
+        uintptr_t begin = ((uintptr_t)ptr + ZJSON_VM_PAGE_SIZE - 1) & ~(uintptr_t)(ZJSON_VM_PAGE_SIZE - 1);
+        uintptr_t end = ((uintptr_t)ptr + size) & ~(uintptr_t)(ZJSON_VM_PAGE_SIZE - 1);
+        if (end > begin) { // the pages stay committed, they read as zeros or garbage when used again
+#if defined(_WIN32)
+            VirtualAlloc((void *)begin, end - begin, MEM_RESET, PAGE_READWRITE);
+#else
+            madvise((void *)begin, end - begin, MADV_DONTNEED);
+#endif
+        }
+        if ((char *)ptr + size == _begin + _used) _used -= size;
+    }
+    // unmap the whole range with a single call
+    void release() {
+        if (!_base) return;
+#if defined(_WIN32)
+        VirtualFree(_base, 0, MEM_RELEASE);
+#else
+        munmap(_base, _reserved);
+#endif
+        _base = _begin = nullptr;
+        _reserved = _used = _committed = _capacity = 0;
+    }
+    size_t getCommitted() const { return _committed; }
+private:
+    char *_base;
+    size_t _reserved;
+    char *_begin;
+    size_t _used, _committed, _capacity;
+};
+
+} // namespace zjson
+#endif
+
+
+// #include "slab.h"
+
+#ifndef ZJSON_NO_SLAB
+#include <mutex>
+#endif
+
+namespace zjson {
+
+#ifndef ZJSON_NO_SLAB
+
+#define ZJSON_SLAB_MAX_SIZE     256         // larger chunks go to malloc
+#define ZJSON_SLAB_SIZE         (64 << 10)  // chunks are carved from slabs of this size
+#define ZJSON_SLAB_BATCH        256         // chunks moved between a thread cache and the global lists at once
+
+// Size-class slabs for the nodes and strings of Json values without allocator. Every
+// thread allocates and frees in its own cache without locking, whole batches of chunks
+// go through the global lists when a cache runs empty or too full. Slabs are kept for
+// the lifetime of the process. Define ZJSON_NO_SLAB to use malloc instead.
+class SlabHeap {
+public:
+    static inline void *allocate(size_t size) {
+        if (size > ZJSON_SLAB_MAX_SIZE) return malloc(size);
+        size_t c = sizeClass(size);
+        ThreadCache &cache = threadCache();
+        Chunk *chunk = cache.lists[c];
+        if (ZJSON_LIKELY(chunk)) {
+            cache.lists[c] = chunk->next;
+            cache.counts[c]--;
+            return chunk;
+        }
+        return refill(cache, c);
+    }
+    // size must be the one allocated
+    static inline void deallocate(void *ptr, size_t size) {
+        if (size > ZJSON_SLAB_MAX_SIZE) {
+            free(ptr);
+            return;
+        }
+        size_t c = sizeClass(size);
+        ThreadCache &cache = threadCache();
+        Chunk *chunk = (Chunk *)ptr;
+        if (ZJSON_UNLIKELY(cache.exited)) { // freed in a thread_local destructor after the cache is gone
+            heap().pushBatch(c, chunk, chunk);
+            return;
+        }
+        chunk->next = cache.lists[c];
+        cache.lists[c] = chunk;
+        if (ZJSON_UNLIKELY(++cache.counts[c] > 2 * ZJSON_SLAB_BATCH)) overflow(cache, c);
+    }
+    class Batch;
+private:
+    static const size_t kClasses = ZJSON_SLAB_MAX_SIZE / 8;
+    struct Chunk {
+        Chunk *next;
+    };
+    // plain data, so it is still accessible while other thread_local objects are destroyed
+    struct ThreadCache {
+        Chunk *lists[kClasses];
+        uint32_t counts[kClasses];
+        char *slabCursor, *slabEnd;
+        bool registered, exited;
+    };
+    struct CacheFlusher {
+        ThreadCache *cache;
+        ~CacheFlusher() { // the thread exits, give its chunks to other threads
+            for (size_t c = 0; c < kClasses; c++) {
+                Chunk *head = cache->lists[c];
+                if (!head) continue;
+                Chunk *tail = head;
+                while (tail->next) tail = tail->next;
+                heap().pushBatch(c, head, tail);
+                cache->lists[c] = nullptr;
+                cache->counts[c] = 0;
+            }
+            cache->exited = true;
+        }
+    };
+    std::mutex _mutex;
+    Chunk *_lists[kClasses];
+
+    SlabHeap() {
+        memset(_lists, 0, sizeof(_lists));
+    }
+    static inline SlabHeap &heap() { // never destroyed, chunks could be freed during static destruction
+        static SlabHeap *s_heap = new SlabHeap();
+        return *s_heap;
+    }
+    static inline ThreadCache &threadCache() {
+        static thread_local ThreadCache s_cache;
+        if (ZJSON_UNLIKELY(!s_cache.registered)) {
+            static thread_local CacheFlusher s_flusher;
+            s_flusher.cache = &s_cache;
+            s_cache.registered = true;
+        }
+        return s_cache;
+    }
+    static inline size_t sizeClass(size_t size) {
+        return size ? (size - 1) >> 3 : 0;
+    }
+    static void *refill(ThreadCache &cache, size_t c) {
+        size_t size = (c + 1) << 3;
+        if (cache.exited) return malloc(size); // any memory of the size could be freed to the lists
+        if (size_t count = heap().popBatch(c, &cache.lists[c])) {
+            Chunk *chunk = cache.lists[c];
+            cache.lists[c] = chunk->next;
+            cache.counts[c] = (uint32_t)count - 1;
+            return chunk;
+        }
+        if ((size_t)(cache.slabEnd - cache.slabCursor) < size) { // the rest of the current slab is left
+            char *slab = (char *)malloc(ZJSON_SLAB_SIZE);
+            if (!slab) return nullptr;
+            cache.slabCursor = slab;
+            cache.slabEnd = slab + ZJSON_SLAB_SIZE;
+        }
+        void *p = cache.slabCursor;
+        cache.slabCursor += size;
+        return p;
+    }
+    static void overflow(ThreadCache &cache, size_t c) {
+        Chunk *head = cache.lists[c], *tail = head;
+        for (size_t i = 1; i < ZJSON_SLAB_BATCH; i++) tail = tail->next;
+        cache.lists[c] = tail->next;
+        cache.counts[c] -= ZJSON_SLAB_BATCH;
+        tail->next = nullptr;
+        heap().pushBatch(c, head, tail);
+    }
+    // give back a list of chunks of a class at once
+    static void deallocateList(size_t c, Chunk *head, Chunk *tail, uint32_t count) {
+        ThreadCache &cache = threadCache();
+        if (ZJSON_UNLIKELY(cache.exited)) {
+            heap().pushBatch(c, head, tail);
+            return;
+        }
+        tail->next = cache.lists[c];
+        cache.lists[c] = head;
+        cache.counts[c] += count;
+        while (ZJSON_UNLIKELY(cache.counts[c] > 2 * ZJSON_SLAB_BATCH)) overflow(cache, c);
+    }
+    void pushBatch(size_t c, Chunk *head, Chunk *tail) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        tail->next = _lists[c];
+        _lists[c] = head;
+    }
+    // take up to a batch of chunks, returns the number of them
+    size_t popBatch(size_t c, Chunk **list) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        Chunk *head = _lists[c];
+        if (!head) return 0;
+        Chunk *tail = head;
+        size_t count = 1;
+        while (count < ZJSON_SLAB_BATCH && tail->next) {
+            tail = tail->next;
+            count++;
+        }
+        _lists[c] = tail->next;
+        tail->next = nullptr;
+        *list = head;
+        return count;
+    }
+};
+
+// Chunks freed together, e.g. the nodes and strings of a subtree. They are collected in
+// a list per size class, which goes to the thread cache with one splice when it holds a
+// batch of chunks, or on release().
+class SlabHeap::Batch {
+public:
+    Batch() : _mask(0) {}
+    Batch(const Batch &) = delete;
+    Batch &operator=(const Batch &) = delete;
+    ~Batch() {
+        release();
+    }
+    inline void deallocate(void *ptr, size_t size) {
+        if (size > ZJSON_SLAB_MAX_SIZE) {
+            free(ptr);
+            return;
+        }
+        size_t c = sizeClass(size);
+        Chunk *chunk = (Chunk *)ptr;
+        if (!(_mask & (1u << c))) {
+            _mask |= 1u << c;
+            _tails[c] = chunk;
+            _heads[c] = nullptr;
+            _counts[c] = 0;
+        }
+        chunk->next = _heads[c];
+        _heads[c] = chunk;
+        if (ZJSON_UNLIKELY(++_counts[c] == ZJSON_SLAB_BATCH)) { // while the chunks are still in cache
+            deallocateList(c, _heads[c], _tails[c], _counts[c]);
+            _mask &= ~(1u << c);
+        }
+    }
+    void release() {
+        for (size_t c = 0; _mask; c++) {
+            if (!(_mask & (1u << c))) continue;
+            deallocateList(c, _heads[c], _tails[c], _counts[c]);
+            _mask &= ~(1u << c);
+        }
+    }
+private:
+    static_assert(kClasses <= 32, "a size class per bit of the mask");
+    uint32_t _mask; // bit c is set if the list of class c is not empty
+    Chunk *_heads[kClasses], *_tails[kClasses];
+    uint32_t _counts[kClasses];
+};
+
+typedef SlabHeap::Batch SlabBatch;
+inline void *slabAllocate(size_t size) { return SlabHeap::allocate(size); }
+inline void slabFree(void *ptr, size_t size) { SlabHeap::deallocate(ptr, size); }
+#else
+class SlabBatch {
+public:
+    inline void deallocate(void *ptr, size_t) { free(ptr); }
+};
+inline void *slabAllocate(size_t size) { return malloc(size); }
+inline void slabFree(void *ptr, size_t) { free(ptr); }
+#endif
+
+} // namespace zjson
+
+
+// #include "value.h"
+
+#ifdef ZJSON_COPY_ON_WRITE
+#include <atomic>
+#include <new>
+#endif
+
+namespace zjson {
+
+#define JSON_VALUE_PAYLOAD_MASK 0x00007FFFFFFFFFFFULL
+#define JSON_VALUE_NAN_MASK 0x7FF8000000000000ULL
+#define JSON_VALUE_TAG_MASK 0xF
+#define JSON_VALUE_TAG_SHIFT 47
+
+struct Node;
+struct ShapedObject;
+struct DumpStyle;
+class SourceSpans;
+struct DumpFrame;
+struct DumpBatch;
+template <typename T> struct DumpValue;
+struct Value {
+    friend class Json;
+    friend struct DumpBatch;
+    template <typename T> friend struct DumpValue;
+    inline Value(double x) : fval(x) {
+    }
+    explicit inline Value(Type type, void *payload = nullptr) {
+        assert((uintptr_t)payload <= JSON_VALUE_PAYLOAD_MASK);
+        ival = JSON_VALUE_NAN_MASK | ((uint64_t)type << JSON_VALUE_TAG_SHIFT) | (uintptr_t)payload;
+    }
+    inline Value(int32_t x) {
+        ival = JSON_VALUE_NAN_MASK | ((uint64_t)JSON_INT << JSON_VALUE_TAG_SHIFT) | (x & 0xFFFFFFFF);
+    }
+    explicit inline Value(nullptr_t) {
+        ival = JSON_VALUE_NAN_MASK | ((uint64_t)JSON_NULL << JSON_VALUE_TAG_SHIFT);
+    }
+    explicit inline Value(bool x) {
+        ival = JSON_VALUE_NAN_MASK | ((uint64_t)(x ? JSON_TRUE : JSON_FALSE) << JSON_VALUE_TAG_SHIFT);
+    }
+    // an object in shape representation, see shape.h
+    explicit inline Value(ShapedObject *object) {
+        assert((uintptr_t)object <= JSON_VALUE_PAYLOAD_MASK && !((uintptr_t)object & 1));
+        ival = JSON_VALUE_NAN_MASK | ((uint64_t)JSON_OBJECT << JSON_VALUE_TAG_SHIFT) | (uintptr_t)object | 1;
+    }
+    inline Type getType() const {
+        return isDouble() ? JSON_NUMBER : Type((ival >> JSON_VALUE_TAG_SHIFT) & JSON_VALUE_TAG_MASK);
+    }
+    inline uint64_t getPayload() const {
+        assert(!isDouble());
+        return ival & JSON_VALUE_PAYLOAD_MASK;
+    }
+    inline double toNumber() const {
+        assert(getType() == JSON_NUMBER);
+        return fval;
+    }
+    inline int32_t toInt() const {
+        assert(getType() == JSON_INT);
+        return ival & 0xFFFFFFFF;
+    }
+    inline char *toString() const {
+        assert(getType() == JSON_STRING);
+        return (char *)getPayload();
+    }
+    inline Node *toNode() const {
+        assert((getType() == JSON_ARRAY || getType() == JSON_OBJECT) && !isShaped());
+        return (Node *)getPayload();
+    }
+    inline bool isShaped() const {
+        return !isDouble() && ((ival >> JSON_VALUE_TAG_SHIFT) & JSON_VALUE_TAG_MASK) == JSON_OBJECT && (ival & 1);
+    }
+    inline ShapedObject *toShaped() const {
+        assert(isShaped());
+        return (ShapedObject *)(getPayload() & ~1ULL);
+    }
+private:
+    union {
+        uint64_t ival;
+        double fval;
+    };
+    inline bool isDouble() const {
+        return (int64_t)ival <= (int64_t)JSON_VALUE_NAN_MASK;
+    }
+    // serialization
+    template <typename T>
+    void dump(T& out, const DumpStyle& style, const SourceSpans* sources = nullptr) const;
+    template <typename T>
+    void dumpParallel(T& out, const DumpStyle& style, unsigned threads, const SourceSpans* sources = nullptr) const;
+    template <typename T, typename F>
+    void dumpWith(T& out, const F& format, int depth = 0) const;
+    template <typename T, typename F>
+    static const Value* dumpNext(T& out, const F& format, DumpFrame& frame, int indent);
+};
+
+struct Node {
+    Value value;
+    Node *next;
+    char *name;
+};
+
+struct NodeIterator {
+    Node *p;
+    void operator++() { p = p->next; }
+    bool operator!=(const NodeIterator &x) const { return p != x.p; }
+    Node *operator*() const { return p; }
+    Node *operator->() const { return p; }
+};
+inline NodeIterator begin(Value& v) {
+    return NodeIterator { v.toNode() };
+}
+inline NodeIterator end(Value&) {
+    return NodeIterator { nullptr };
+}
+
+inline Node *insertAfter(Node *tail, Node *node) {
+    if (!tail)
+        return node->next = node;
+    node->next = tail->next;
+    tail->next = node;
+    return node;
+}
+inline Value listToValue(Type type, Node *tail) {
+    if (tail) {
+        auto head = tail->next;
+        tail->next = nullptr;
+        return Value(type, head);
+    }
+    return Value(type, nullptr);
+}
+
+#ifdef ZJSON_COPY_ON_WRITE
+// In copy-on-write mode, every crt-allocated node and string carries a reference count
+// in front of it. Copies of a value share its subtrees, the count of a list is the head's.
+struct CrtHeader {
+    std::atomic<uint32_t> refs;
+    uint32_t size; // of the allocation, 0 if it doesn't fit
+};
+inline void *crtAllocate(size_t size) {
+    CrtHeader* header = (CrtHeader*)slabAllocate(sizeof(CrtHeader) + size);
+    if (!header) return nullptr;
+    new (&header->refs) std::atomic<uint32_t>(1);
+    header->size = size <= UINT32_MAX ? (uint32_t)size : 0;
+    return header + 1;
+}
+inline void crtFree(void *ptr, size_t size) {
+    slabFree((CrtHeader*)ptr - 1, sizeof(CrtHeader) + size);
+}
+inline void crtFree(SlabBatch &batch, void *ptr, size_t size) {
+    batch.deallocate((CrtHeader*)ptr - 1, sizeof(CrtHeader) + size);
+}
+// the size a string was allocated with, the header records it
+inline size_t crtStringSize(const char *str) {
+    uint32_t size = ((const CrtHeader*)str - 1)->size;
+    return size ? size : strlen(str) + 1;
+}
+inline uint32_t crtRefCount(const void *ptr) {
+    return ((const CrtHeader*)ptr - 1)->refs.load(std::memory_order_acquire);
+}
+inline void *crtRetain(void *ptr) {
+    ((CrtHeader*)ptr - 1)->refs.fetch_add(1, std::memory_order_relaxed);
+    return ptr;
+}
+// returns true if the last reference is released
+inline bool crtRelease(void *ptr) {
+    return ((CrtHeader*)ptr - 1)->refs.fetch_sub(1, std::memory_order_acq_rel) == 1;
+}
+#else
+inline void *crtAllocate(size_t size) { return slabAllocate(size); }
+inline void crtFree(void *ptr, size_t size) { slabFree(ptr, size); }
+inline void crtFree(SlabBatch &batch, void *ptr, size_t size) { batch.deallocate(ptr, size); }
+inline size_t crtStringSize(const char *str) { return strlen(str) + 1; }
+inline uint32_t crtRefCount(const void *) { return 1; }
+inline void *crtRetain(void *ptr) { return ptr; }
+inline bool crtRelease(void *) { return true; }
+#endif
+
+// bytes taken by a crt allocation of the size
+inline size_t crtFootprint(size_t size) {
+#ifdef ZJSON_COPY_ON_WRITE
+    size += sizeof(CrtHeader);
+#endif
+    return (size + 7) & ~(size_t)7;
+}
+
+// share a crt-allocated value, only meaningful in copy-on-write mode
+inline Value retainCrtAllocatedValue(Value value) {
+    Type type = value.getType();
+    if (type == JSON_STRING)
+        crtRetain(value.toString());
+    else if ((type == JSON_ARRAY || type == JSON_OBJECT) && value.toNode())
+        crtRetain(value.toNode());
+    return value;
+}
+
+// free as a crt-allocated value. Iterative without a stack: the node whose list is being
+// freed keeps the rest of its own list in next, and its value holds the type of that list
+// and the node to go back to after it. The chunks of the subtree go back to the slabs in
+// one batch per size class.
+void freeCrtAllocatedValue(Value value) {
+    Type type = value.getType();
+    if (type == JSON_STRING) {
+        if (crtRelease(value.toString())) crtFree(value.toString(), crtStringSize(value.toString()));
+        return;
+    }
+    if (type != JSON_ARRAY && type != JSON_OBJECT) return;
+    Node* node = value.toNode();
+    if (!node || !crtRelease(node)) return; // still shared
+    SlabBatch batch;
+    Node* parent = nullptr;
+    for (;;) {
+        while (node) {
+            if (type == JSON_OBJECT && crtRelease(node->name)) crtFree(batch, node->name, crtStringSize(node->name)); // free key
+            Value v = node->value;
+            Type t = v.getType();
+            if (t == JSON_STRING) {
+                if (crtRelease(v.toString())) crtFree(batch, v.toString(), crtStringSize(v.toString()));
+            }
+            else if ((t == JSON_ARRAY || t == JSON_OBJECT) && v.toNode() && crtRelease(v.toNode())) {
+                // free the child list first, then come back
+                node->value = Value(type, parent);
+                parent = node;
+                node = v.toNode();
+                type = t;
+                continue;
+            }
+            Node* next = node->next;
+            crtFree(batch, node, type == JSON_OBJECT ? sizeof(Node) : sizeof(Node) - sizeof(char*)); // free node
+            node = next;
+        }
+        if (!parent) break;
+        node = parent;
+        type = node->value.getType();
+        parent = node->value.toNode();
+        Node* next = node->next;
+        crtFree(batch, node, type == JSON_OBJECT ? sizeof(Node) : sizeof(Node) - sizeof(char*));
+        node = next;
+    }
+}
+
+} // namespace zjson
+
+
+// #include "shape.h"
+
+#include <atomic>
+
+namespace zjson {
+
+#define ZJSON_SHAPE_MAX_LENGTH  64  // larger objects are kept as node lists
+#define ZJSON_SHAPE_TABLE_SIZE  64  // initial buckets of a shape table
+#define ZJSON_SHAPE_SCRATCH_MIN 256 // smallest first block of the scratch allocator
+
+inline uint32_t hashString(const char *s) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    while (*s) hash = (hash ^ (uint8_t)*s++) * 16777619u;
+    return hash;
+}
+
+// A shape describes the member names of all objects with the same key sequence.
+// It's followed by the names, their hashes and a name-to-slot table.
+struct Shape {
+    Shape *next;        // next shape in the same bucket
+    uint64_t id;        // unique in the process, tells reallocated shapes apart
+    uint32_t hash;      // hash of the key sequence
+    uint32_t length;    // number of members
+    uint32_t slotMask;  // size of the name-to-slot table - 1
+    inline char **names() const { return (char **)(this + 1); }
+    inline uint32_t *hashes() const { return (uint32_t *)(names() + length); }
+    inline uint8_t *slots() const { return (uint8_t *)(hashes() + length); }
+    static inline size_t sizeOf(uint32_t length, uint32_t slotMask) {
+        return sizeof(Shape) + length * (sizeof(char *) + sizeof(uint32_t)) + slotMask + 1;
+    }
+    // returns the slot of the first member with the name, or -1
+    inline int find(const char *name, uint32_t hash) const {
+        const uint8_t *table = slots();
+        for (uint32_t i = hash & slotMask; table[i]; i = (i + 1) & slotMask) {
+            int slot = table[i] - 1;
+            if (hashes()[slot] == hash && strcmp(names()[slot], name) == 0) return slot;
+        }
+        return -1;
+    }
+};
+
+// An object in shape representation, only a packed array of values follows the shape.
+struct ShapedObject {
+    Shape *shape;
+    inline Value *values() { return (Value *)(this + 1); }
+    inline int find(const char *name) const { return shape->find(name, hashString(name)); }
+};
+
+// Blocks carved from another allocator, they go away with its reset
+class ArenaResource final : public MemoryResource {
+public:
+    ArenaResource() : _arena(nullptr) {}
+    inline void setArena(Allocator *arena) { _arena = arena; }
+    void *allocate(size_t size) override { return _arena ? _arena->allocate(size) : nullptr; }
+    void deallocate(void *, size_t) override {}
+private:
+    Allocator *_arena;
+};
+
+// Interns the shapes of parsed objects. The members of an open object are parsed into
+// the scratch allocator as usual, and replaced by a shaped object when it's closed.
+// The scratch blocks come from the document allocator too, so a document without
+// upstream doesn't touch the heap. The first one takes a quarter of the room the
+// document allocator has at most, a small caller buffer holds the DOM as well.
+class ShapeTable {
+public:
+    ShapeTable() : _buckets(nullptr), _mask(0), _count(0), _scratch(defaultBlockPolicy(), &_resource) {}
+    ShapeTable(const ShapeTable &) = delete;
+    ShapeTable &operator=(const ShapeTable &) = delete;
+    ~ShapeTable() {
+        _scratch.abandonBlocks();
+    }
+    // shapes live in the document allocator, reset them together
+    inline void reset(Allocator *arena = nullptr) {
+        _buckets = nullptr;
+        _mask = _count = 0;
+        BlockPolicy policy = defaultBlockPolicy();
+        size_t room = arena ? arena->room() / 4 & ~(size_t)7 : 0;
+        if (room && room < policy.initialSize) policy.initialSize = room > ZJSON_SHAPE_SCRATCH_MIN ? room : ZJSON_SHAPE_SCRATCH_MIN;
+        _scratch.setBlockPolicy(policy);
+        _scratch.abandonBlocks();
+        _resource.setArena(arena);
+    }
+    inline Allocator &scratch() { return _scratch; }
+    // convert a closed object from the scratch allocator, returns false if out of memory
+    bool shapeObject(Value *value, Allocator &allocator) {
+        Node *head = value->toNode();
+        if (!head) return true;
+        uint32_t hashes[ZJSON_SHAPE_MAX_LENGTH];
+        uint32_t length = 0, hash = 2166136261u;
+        for (Node *n = head; n; n = n->next) {
+            if (length == ZJSON_SHAPE_MAX_LENGTH) return copyObject(value, allocator);
+            hashes[length] = hashString(n->name);
+            hash = (hash ^ hashes[length++]) * 16777619u;
+        }
+        Shape *shape = intern(head, hashes, length, hash, allocator);
+        ShapedObject *object = (ShapedObject *)allocator.allocate(sizeof(ShapedObject) + length * sizeof(Value));
+        if (ZJSON_UNLIKELY(!shape || !object)) return false;
+        object->shape = shape;
+        Value *values = object->values();
+        for (Node *n = head; n; n = n->next) *values++ = n->value;
+        *value = Value(object);
+        return true;
+    }
+private:
+    Shape **_buckets;
+    uint32_t _mask;
+    uint32_t _count;
+    ArenaResource _resource;
+    Allocator _scratch;
+
+    // objects too large to share a shape are copied as node lists
+    bool copyObject(Value *value, Allocator &allocator) {
+        Node *n, *tail = nullptr;
+        for (Node *node = value->toNode(); node; node = node->next) {
+            if (ZJSON_UNLIKELY((n = (Node *)allocator.allocate(sizeof(Node))) == nullptr)) return false;
+            n->name = node->name;
+            n->value = node->value;
+            tail = insertAfter(tail, n);
+        }
+        *value = listToValue(JSON_OBJECT, tail);
+        return true;
+    }
+    Shape *intern(Node *head, const uint32_t *hashes, uint32_t length, uint32_t hash, Allocator &allocator) {
+        if (_buckets) {
+            for (Shape *shape = _buckets[hash & _mask]; shape; shape = shape->next) {
+                if (shape->hash != hash || shape->length != length) continue;
+                Node *n = head;
+                uint32_t i = 0;
+                while (i < length && shape->hashes()[i] == hashes[i] && strcmp(shape->names()[i], n->name) == 0) {
+                    i++;
+                    n = n->next;
+                }
+                if (i == length) return shape;
+            }
+        }
+        if (_count >= _mask && !grow(allocator)) return nullptr;
+        uint32_t slotMask = 1;
+        while (slotMask + 1 < length * 2) slotMask = slotMask * 2 + 1;
+        Shape *shape = (Shape *)allocator.allocate(Shape::sizeOf(length, slotMask));
+        if (ZJSON_UNLIKELY(!shape)) return nullptr;
+        static std::atomic<uint64_t> s_shapeIds(1);
+        shape->hash = hash;
+        shape->id = s_shapeIds.fetch_add(1, std::memory_order_relaxed);
+        shape->length = length;
+        shape->slotMask = slotMask;
+        uint8_t *table = shape->slots();
+        memset(table, 0, slotMask + 1);
+        Node *n = head;
+        for (uint32_t i = 0; i < length; i++, n = n->next) {
+            shape->names()[i] = n->name;
+            shape->hashes()[i] = hashes[i];
+            if (shape->find(n->name, hashes[i]) >= 0) continue; // duplicated key, the first one wins
+            uint32_t j = hashes[i] & slotMask;
+            while (table[j]) j = (j + 1) & slotMask;
+            table[j] = (uint8_t)(i + 1);
+        }
+        shape->next = _buckets[hash & _mask];
+        _buckets[hash & _mask] = shape;
+        _count++;
+        return shape;
+    }
+    bool grow(Allocator &allocator) {
+        uint32_t mask = _mask ? _mask * 2 + 1 : ZJSON_SHAPE_TABLE_SIZE - 1;
+        Shape **buckets = (Shape **)allocator.allocate((mask + 1) * sizeof(Shape *));
+        if (ZJSON_UNLIKELY(!buckets)) return false;
+        memset(buckets, 0, (mask + 1) * sizeof(Shape *));
+        for (uint32_t i = 0; _buckets && i <= _mask; i++) {
+            for (Shape *shape = _buckets[i], *next; shape; shape = next) {
+                next = shape->next;
+                shape->next = buckets[shape->hash & mask];
+                buckets[shape->hash & mask] = shape;
+            }
+        }
+        _buckets = buckets;
+        _mask = mask;
+        return true;
+    }
+};
+
+} // namespace zjson
+
+
+// #include "source.h"
+
+namespace zjson {
+
+#define ZJSON_SPAN_TABLE_SIZE  256  // initial slots of a span table
+
+// Where an array or object was in the input, found by the address of its node list or
+// shaped object. Containers modified since are dirty.
+struct SourceSpan {
+    uint64_t key;       // payload of the container, 0 for a free slot
+    size_t begin;       // offset of the bracket in the input
+    uint32_t length;    // bytes up to the closing bracket
+    uint32_t dirty;
+};
+
+// The input of a document parsed with PARSE_KEEP_SOURCE and the spans of its containers.
+// The parser terminates strings in-situ, so the input is copied once before. Everything
+// lives in the document allocator, reset them together.
+class SourceSpans {
+public:
+    SourceSpans() : _source(nullptr), _slots(nullptr), _mask(0), _count(0) {}
+    SourceSpans(const SourceSpans &) = delete;
+    SourceSpans &operator=(const SourceSpans &) = delete;
+    inline void reset() {
+        _source = nullptr;
+        _slots = nullptr;
+        _mask = _count = 0;
+    }
+    // copy the input, returns false if out of memory
+    bool keep(const char *content, size_t length, Allocator &allocator) {
+        char *source = (char *)allocator.allocate(length + 1);
+        if (ZJSON_UNLIKELY(!source)) return false;
+        memcpy(source, content, length);
+        source[length] = '\0';
+        _source = source;
+        return true;
+    }
+    // add a closed container, returns false if out of memory
+    bool add(const Value &container, size_t begin, size_t end, Allocator &allocator) {
+        uint64_t key = container.getPayload();
+        if (!key || end - begin > UINT32_MAX) return true; // empty or too long, dumped as usual
+        if (_count >= (_mask + 1) / 2 && !grow(allocator)) return false;
+        SourceSpan *span = &_slots[hashKey(key) & _mask];
+        while (span->key) span = next(span);
+        span->key = key;
+        span->begin = begin;
+        span->length = (uint32_t)(end - begin);
+        span->dirty = 0;
+        _count++;
+        return true;
+    }
+    // the original text of a container, nullptr if it's modified or wasn't parsed
+    inline const char *find(const Value &container, size_t *length) const {
+        const SourceSpan *span = lookup(container);
+        if (!span || span->dirty) return nullptr;
+        *length = span->length;
+        return _source + span->begin;
+    }
+    inline void markDirty(const Value &container) {
+        SourceSpan *span = lookup(container);
+        if (span) span->dirty = 1;
+    }
+private:
+    const char *_source;
+    SourceSpan *_slots;
+    uint32_t _mask;
+    uint32_t _count;
+
+    static inline uint32_t hashKey(uint64_t key) {
+        return (uint32_t)(((key >> 3) * 0x9E3779B97F4A7C15ULL) >> 32);
+    }
+    inline SourceSpan *next(SourceSpan *span) const {
+        return &_slots[(span - _slots + 1) & _mask];
+    }
+    SourceSpan *lookup(const Value &container) const {
+        Type type = container.getType();
+        if (!_slots || (type != JSON_ARRAY && type != JSON_OBJECT)) return nullptr;
+        uint64_t key = container.getPayload();
+        if (!key) return nullptr;
+        for (SourceSpan *span = &_slots[hashKey(key) & _mask]; span->key; span = next(span))
+            if (span->key == key) return span;
+        return nullptr;
+    }
+    bool grow(Allocator &allocator) {
+        uint32_t mask = _mask ? _mask * 2 + 1 : ZJSON_SPAN_TABLE_SIZE - 1;
+        SourceSpan *slots = (SourceSpan *)allocator.allocate((mask + 1) * sizeof(SourceSpan));
+        if (ZJSON_UNLIKELY(!slots)) return false;
+        memset(slots, 0, (mask + 1) * sizeof(SourceSpan));
+        for (uint32_t i = 0; _slots && i <= _mask; i++) {
+            if (!_slots[i].key) continue;
+            uint32_t j = hashKey(_slots[i].key) & mask;
+            while (slots[j].key) j = (j + 1) & mask;
+            slots[j] = _slots[i];
+        }
+        _slots = slots;
+        _mask = mask;
+        return true;
+    }
+};
+
+} // namespace zjson
+
+
+// #include "deserialize.h"
+
+namespace zjson {
+
+static inline double pow10(int64_t exponent) {
+    if (exponent > 308) {
+        return std::numeric_limits<double>::infinity();
+    }
     else if (exponent < -323) {
         return 0.0;
     }
@@ -378,7 +1727,6 @@ ZJSON_FORCE_INLINE bool parseStringInternal(char*& s)
     return true;
 }
 
-#define ZJSON_STACK_SIZE 32
 #define ZJSON_SKIP_WHITESPACE \
     while (matchFlag(*s, FLAG_WHITESPACE)) {                            \
         do {                                                            \
@@ -392,9 +1740,18 @@ ZJSON_FORCE_INLINE bool parseStringInternal(char*& s)
         while (*s && *s != '\n' && *s != '\r') ++s;                     \
     }
 
-int jsonParse(char *s, Value *value, Allocator &allocator) {
-    Node *tails[ZJSON_STACK_SIZE];
-    uint8_t endchars[ZJSON_STACK_SIZE];
+// an open container while parsing
+struct ParseFrame {
+    Node *tail;
+    Allocator::Marker mark; // scratch position of an open object
+    const char *begin;      // the opening bracket, for the source span
+    uint8_t endchar;
+};
+
+template <bool Shaped, bool Spans>
+int jsonParseInternal(char *s, Value *value, Allocator &allocator, ShapeTable *shapes, SourceSpans *spans) {
+    DepthStack<ParseFrame> stack(&allocator); // deep documents grow it in the arena
+    const char *start = s;
     int top = -1;
     Node *node;
 
@@ -403,8 +1760,10 @@ int jsonParse(char *s, Value *value, Allocator &allocator) {
     uint8_t ch = *s;
     if (ch == '{' || ch == '[') {
         ++top;
-        tails[top] = nullptr;
-        endchars[top] = ch + 2;
+        stack[top].tail = nullptr;
+        stack[top].endchar = ch + 2;
+        if (Shaped) stack[top].mark = shapes->scratch().mark();
+        if (Spans) stack[top].begin = s;
     }
     else {
         return ERROR_BAD_ROOT; // Root value must be an object or array
@@ -416,28 +1775,35 @@ int jsonParse(char *s, Value *value, Allocator &allocator) {
         ZJSON_SKIP_WHITESPACE;
         ch = *s;
         if (ch == ',') {
-            if (ZJSON_UNLIKELY(!tails[top]))
+            if (ZJSON_UNLIKELY(!stack[top].tail))
                 return ERROR_MISMATCH_BRACKET;
             ++s;
             ZJSON_SKIP_WHITESPACE;
             ch = *s;
         }
-        else if (ZJSON_UNLIKELY(tails[top] && (ch != endchars[top])))
+        else if (ZJSON_UNLIKELY(stack[top].tail && (ch != stack[top].endchar)))
             return ERROR_MISMATCH_BRACKET;
 
-        while (ch == endchars[top]) {
+        while (ch == stack[top].endchar) {
             ++s;
             for (;;) {
                 if (ZJSON_UNLIKELY(top == -1))
                     return ERROR_STACK_UNDERFLOW;
-                Type t = endchars[top] == '}' ? JSON_OBJECT : JSON_ARRAY;
-                Value v = listToValue(t, tails[top--]);
+                Type t = stack[top].endchar == '}' ? JSON_OBJECT : JSON_ARRAY;
+                Value v = listToValue(t, stack[top--].tail);
+                if (Shaped && t == JSON_OBJECT) {
+                    if (ZJSON_UNLIKELY(!shapes->shapeObject(&v, allocator)))
+                        return ERROR_OUT_OF_MEMORY;
+                    shapes->scratch().rewind(stack[top + 1].mark);
+                }
+                if (Spans && ZJSON_UNLIKELY(!spans->add(v, stack[top + 1].begin - start, s - start, allocator)))
+                    return ERROR_OUT_OF_MEMORY;
 
                 if (top == -1) {
                     *value = v;
                     return ERROR_NO_ERROR;
                 }
-                tails[top]->value = v;
+                stack[top].tail->value = v;
 
                 ZJSON_SKIP_WHITESPACE;
                 if (*s == ',') {
@@ -446,24 +1812,25 @@ int jsonParse(char *s, Value *value, Allocator &allocator) {
                     ch = *s;
                     break;
                 }
-                if (ZJSON_UNLIKELY(*s++ != endchars[top]))
+                if (ZJSON_UNLIKELY(*s++ != stack[top].endchar))
                     return ERROR_MISMATCH_BRACKET;
             }
         }
 
-        if (endchars[top] == ']') { // JSON_ARRAY
+        if (stack[top].endchar == ']') { // JSON_ARRAY
             if (ZJSON_UNLIKELY((node = (Node *)allocator.allocate(sizeof(Node) - sizeof(char *))) == nullptr))
                 return ERROR_OUT_OF_MEMORY;
-            tails[top] = insertAfter(tails[top], node);
+            stack[top].tail = insertAfter(stack[top].tail, node);
         }
         else { // JSON_OBJECT
-            if (ZJSON_UNLIKELY((node = (Node *)allocator.allocate(sizeof(Node))) == nullptr))
+            Allocator &nodeAllocator = Shaped ? shapes->scratch() : allocator;
+            if (ZJSON_UNLIKELY((node = (Node *)nodeAllocator.allocate(sizeof(Node))) == nullptr))
                 return ERROR_OUT_OF_MEMORY;
-            tails[top] = insertAfter(tails[top], node);
+            stack[top].tail = insertAfter(stack[top].tail, node);
 
             // parse a key
             if (ZJSON_UNLIKELY(ch != '"')) return ERROR_UNEXPECTED_CHARACTER;
-            tails[top]->name = ++s;
+            stack[top].tail->name = ++s;
             if (ZJSON_UNLIKELY(!parseStringInternal(s))) return ERROR_BAD_STRING;
 
             ZJSON_SKIP_WHITESPACE;
@@ -478,22 +1845,24 @@ int jsonParse(char *s, Value *value, Allocator &allocator) {
         case '{':
         case '[': { // start a JSON object or a JSON array
             ++s;
-            if (ZJSON_UNLIKELY(++top == ZJSON_STACK_SIZE))
-                return ERROR_STACK_OVERFLOW;
-            tails[top] = nullptr;
-            endchars[top] = ch + 2;
+            if (ZJSON_UNLIKELY(!stack.reserve(++top)))
+                return ERROR_OUT_OF_MEMORY;
+            stack[top].tail = nullptr;
+            stack[top].endchar = ch + 2;
+            if (Shaped) stack[top].mark = shapes->scratch().mark();
+            if (Spans) stack[top].begin = s - 1;
             break;
         }
         case '"': { // JSON string
             ++s;
-            tails[top]->value = Value(JSON_STRING, s);
+            stack[top].tail->value = Value(JSON_STRING, s);
             if (ZJSON_UNLIKELY(!parseStringInternal(s))) return ERROR_BAD_STRING;
             break;
         }
         case 'n': { // JSON null
             if (ZJSON_LIKELY(s[1] == 'u' && s[2] == 'l' && s[3] == 'l')) {
                 s += 4;
-                tails[top]->value = Value(JSON_NULL);
+                stack[top].tail->value = Value(JSON_NULL);
             }
             else return ERROR_BAD_IDENTIFIER;
             break;
@@ -501,7 +1870,7 @@ int jsonParse(char *s, Value *value, Allocator &allocator) {
         case 't': { // JSON true
             if (ZJSON_LIKELY(s[1] == 'r' && s[2] == 'u' && s[3] == 'e')) {
                 s += 4;
-                tails[top]->value = Value(JSON_TRUE);
+                stack[top].tail->value = Value(JSON_TRUE);
             }
             else return ERROR_BAD_IDENTIFIER;
             break;
@@ -509,7 +1878,7 @@ int jsonParse(char *s, Value *value, Allocator &allocator) {
         case 'f': { // JSON false
             if (ZJSON_LIKELY(s[1] == 'a' && s[2] == 'l' && s[3] == 's' && s[4] == 'e')) {
                 s += 5;
-                tails[top]->value = Value(JSON_FALSE);
+                stack[top].tail->value = Value(JSON_FALSE);
             }
             else return ERROR_BAD_IDENTIFIER;
             break;
@@ -546,7 +1915,7 @@ int jsonParse(char *s, Value *value, Allocator &allocator) {
 
             if (!matchFlag(ch, FLAG_NUMBER)) {
                 if (negative) n32 = -n32;
-                tails[top]->value = Value(n32);
+                stack[top].tail->value = Value(n32);
             }
             else {
                 double d = static_cast<double>(n32);
@@ -595,7 +1964,7 @@ int jsonParse(char *s, Value *value, Allocator &allocator) {
                 exponent += (negativeE ? -exp : exp);
                 if (exponent) d *= pow10(exponent);
                 if (negative) d = -d;
-                tails[top]->value = Value(d);
+                stack[top].tail->value = Value(d);
             }
             break;
         }
@@ -607,6 +1976,17 @@ int jsonParse(char *s, Value *value, Allocator &allocator) {
     return ERROR_BREAKING_BAD;
 }
 
+// parse in-situ, objects are shaped if a shape table is given, and the span of each
+// container is recorded if source spans are given
+int jsonParse(char *s, Value *value, Allocator &allocator, ShapeTable *shapes = nullptr, SourceSpans *spans = nullptr) {
+    if (spans) {
+        if (shapes) return jsonParseInternal<true, true>(s, value, allocator, shapes, spans);
+        return jsonParseInternal<false, true>(s, value, allocator, nullptr, spans);
+    }
+    if (shapes) return jsonParseInternal<true, false>(s, value, allocator, shapes, nullptr);
+    return jsonParseInternal<false, false>(s, value, allocator, nullptr, nullptr);
+}
+
 } // namespace zjson
 
 
@@ -977,109 +2357,896 @@ inline void Grisu2(double value, char* buffer, int* length, int* K) {
 	DigitGen(W, Wp, Wp.f - Wm.f, buffer, length, K);
 }
 
-inline void WriteExponent(int K, char* buffer) {
-	if (K < 0) {
-		*buffer++ = '-';
-		K = -K;
-	}
+inline void WriteExponent(int K, char* buffer) {
+	if (K < 0) {
+		*buffer++ = '-';
+		K = -K;
+	}
+
+	if (K >= 100) {
+		*buffer++ = '0' + static_cast<char>(K / 100);
+		K %= 100;
+		const char* d = GetDigitsLut() + K * 2;
+		*buffer++ = d[0];
+		*buffer++ = d[1];
+	}
+	else if (K >= 10) {
+		const char* d = GetDigitsLut() + K * 2;
+		*buffer++ = d[0];
+		*buffer++ = d[1];
+	}
+	else
+		*buffer++ = '0' + static_cast<char>(K);
+
+	*buffer = '\0';
+}
+
+inline void Prettify(char* buffer, int length, int k) {
+	const int kk = length + k;	// 10^(kk-1) <= v < 10^kk
+
+	if (length <= kk && kk <= 21) {
+		// 1234e7 -> 12340000000
+		for (int i = length; i < kk; i++)
+			buffer[i] = '0';
+		buffer[kk] = '\0';
+	}
+	else if (0 < kk && kk <= 21) {
+		// 1234e-2 -> 12.34
+		memmove(&buffer[kk + 1], &buffer[kk], length - kk);
+		buffer[kk] = '.';
+		buffer[length + 1] = '\0';
+	}
+	else if (-6 < kk && kk <= 0) {
+		// 1234e-6 -> 0.001234
+		const int offset = 2 - kk;
+		memmove(&buffer[offset], &buffer[0], length);
+		buffer[0] = '0';
+		buffer[1] = '.';
+		for (int i = 2; i < offset; i++)
+			buffer[i] = '0';
+		buffer[length + offset] = '\0';
+	}
+	else if (length == 1) {
+		// 1e30
+		buffer[1] = 'e';
+		WriteExponent(kk - 1, &buffer[2]);
+	}
+	else {
+		// 1234e30 -> 1.234e33
+		memmove(&buffer[2], &buffer[1], length - 1);
+		buffer[1] = '.';
+		buffer[length + 1] = 'e';
+		WriteExponent(kk - 1, &buffer[0 + length + 2]);
+	}
+}
+
+inline void dtoa_milo(double value, char* buffer) {
+	// Not handling NaN and inf
+	assert(!isnan(value));
+	assert(!isinf(value));
+
+	if (value == 0) {
+		buffer[0] = '0';
+        buffer[1] = '\0';
+	}
+	else {
+		if (value < 0) {
+			*buffer++ = '-';
+			value = -value;
+		}
+		int length, K;
+		Grisu2(value, buffer, &length, &K);
+		Prettify(buffer, length, K);
+	}
+}
+
+// #include "dtoa_schubfach.h"
+
+namespace zjson {
+
+// Shortest round-trip formatting of doubles, after Raffaello Giulietti's Schubfach
+// ("The Schubfach way to render doubles"). Unlike Grisu2 it always finds the shortest
+// digits and needs no fallback. The digits are laid out by Prettify, so the output
+// reads the same as dtoa_milo's. Define ZJSON_USE_DTOA_MILO to keep Grisu2.
+
+#if defined(__SIZEOF_INT128__)
+inline uint64_t umulh64(uint64_t a, uint64_t b) {
+    return (uint64_t)(((unsigned __int128)a * b) >> 64);
+}
+#elif defined(_MSC_VER) && defined(_M_X64)
+inline uint64_t umulh64(uint64_t a, uint64_t b) {
+    return __umulh(a, b);
+}
+#else
+inline uint64_t umulh64(uint64_t a, uint64_t b) {
+    const uint64_t M32 = 0xFFFFFFFF;
+    uint64_t a0 = a & M32, a1 = a >> 32, b0 = b & M32, b1 = b >> 32;
+    uint64_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+    uint64_t middle = (p00 >> 32) + (p01 & M32) + (p10 & M32);
+    return p11 + (p01 >> 32) + (p10 >> 32) + (middle >> 32);
+}
+#endif
+
+// g = floor(10^e / 2^r) + 1, r = floor(e * log2(10)) - 125, for e in [-292, 325],
+// as pairs of the upper bits and the lower 63 bits
+inline const uint64_t* schubfachPowers() {
+    static const uint64_t s_powers[] = {
+        0x7fbbd8fe5f5e6e27, 0x497a3a2704eec3df, 0x4fd5679efb9b04d8, 0x5dec645863153a6c,
+        0x63cac186ba81c60e, 0x75677d6e7bda8906, 0x7cbd71e869223792, 0x52c15cca1ad12b48,
+        0x4df6673141b562bb, 0x53b8d9fe50c2bb0d, 0x617400fd9222bb6a, 0x48a7107de4f369d0,
+        0x79d1013cf6ab6a45, 0x1ad0d49d5e304444, 0x4c22a0c61a2b226b, 0x20c284e25ade2aab,
+        0x5f2b48f7a0b5eb06, 0x08f3261af195b555, 0x76f61b3588e365c7, 0x4b2fefa1adfb22ab,
+        0x4a59d101758e1f9c, 0x5efdf5c50cbcf5ab, 0x5cf04541d2f1a783, 0x76bd73364fec3315,
+        0x742c569247ae1164, 0x746cd003e3e73fdb, 0x489bb61b6ccccadf, 0x08c402026e7087e9,
+        0x5ac2a3a247fffd96, 0x6af502830a0ca9e3, 0x71734c8ad9fffcfc, 0x45b24323cc8fd45c,
+        0x46e80fd6c83ffe1d, 0x6b8f69f65fd9e4b9, 0x58a213cc7a4ffda5, 0x26734473f7d05de8,
+        0x6eca98bf98e3fd0e, 0x50101590f5c47561, 0x453e9f77bf8e7e29, 0x120a0d7a999ac95d,
+        0x568e4755af721db3, 0x368c90d940017bb4, 0x6c31d92b1b4ea520, 0x242fb50f9001daa1,
+        0x439f27baf1112734, 0x169dd129ba0128a5, 0x5486f1a9ad557101, 0x1c454574288172ce,
+        0x69a8ae1418aacd41, 0x435696d132a1cf81, 0x42096ccc8f6ac048, 0x7a161e42bfa521b1,
+        0x528bc7ffb345705b, 0x189ba5d36f8e6a1d, 0x672eb9ffa016cc71, 0x7ec28f484b7204a4,
+        0x407d343fc40e3fc7, 0x1f39998d2f2742e7, 0x509c814fb511cfb9, 0x0707fff07af113a1,
+        0x64c3a1a3a25643a7, 0x28c9ffec99ad5889, 0x7df48a0c8aebd491, 0x12fc7fe7c018aeab,
+        0x4eb8d647d6d364da, 0x5bddcff0d80f6d2b, 0x62670bd9cc883e11, 0x32d543ed0e134875,
+        0x7b00ced03faa4d95, 0x5f8a94e851981a93, 0x4ce0814227ca707d, 0x4bb69d1132ff109c,
+        0x6018a192b1bd0c9c, 0x7ea444557fbed4c3, 0x781ec9f75e2c4fc4, 0x1e4d556adfae89f3,
+        0x4b133e3a9adbb1da, 0x52f05562cbcd1638, 0x5dd80dc941929e51, 0x27ac6abb7ec05bc6,
+        0x754e113b91f745e5, 0x5197856a5e7072b8, 0x4950cac53b3a8baf, 0x42feb3627b0647b3,
+        0x5ba4fd768a092e9b, 0x33be603b19c7d99f, 0x728e3cd42c8b7a42, 0x20adf849e039d007,
+        0x4798e6049bd72c69, 0x346cbb2e2c242205, 0x597f1f85c2ccf783, 0x6187e9f9b72d2a86,
+        0x6fdee76733803564, 0x59e9e47824f87527, 0x45eb50a08030215e, 0x78322ecb171b4939,
+        0x576624c8a03c29b6, 0x563eba7ddce21b87, 0x6d3fadfac84b3424, 0x2bce691d541aa268,
+        0x4447ccbcbd2f0096, 0x5b6101b25490a581, 0x5559bfebec7ac0bc, 0x3239421ee9b4cee1,
+        0x6ab02fe6e79970eb, 0x3ec792a6a422029a, 0x42ae1df050bfe693, 0x173cbba8269541a0,
+        0x5359a56c64efe037, 0x7d0bea92303a9208, 0x68300ec77e2bd845, 0x7c4ee536bc49368a,
+        0x411e093caedb672b, 0x5db14f4235adc217, 0x51658b8bda9240f6, 0x551da312c319329c,
+        0x65beee6ed136d134, 0x2a650bd773df7f43, 0x7f2eaa0a85848581, 0x34fe4ecd50d75f14,
+        0x4f7d2a469372d370, 0x711ef14052869b6c, 0x635c74d8384f884d, 0x0d66ad9067284247,
+        0x7c33920e46636a60, 0x30c058f480f252d9, 0x4da03b48ebfe227c, 0x1e783798d09773c8,
+        0x61084a1b26fdab1b, 0x2616457f04bd50ba, 0x794a5ca1f0bd15e2, 0x0f9bd6dec5eca4e8,
+        0x4bce79e536762dad, 0x29c1664b3bb3e711, 0x5ec2185e8413b918, 0x5431bfde0aa0e0d5,
+        0x76729e762518a75e, 0x693e2fd58d49190b, 0x4a07a309d72f689b, 0x21c6dde5784dafa7,
+        0x5c898bcc4cfb42c2, 0x0a38955ed6611b90, 0x73abeebf603a1372, 0x4cc6bab68bf96274,
+        0x484b75379c244c27, 0x4ffc34b2177bdd89, 0x5a5e5285832d5f31, 0x43fb41de9d5ad4eb,
+        0x70f5e726e3f8b6fd, 0x74fa125644b18a26, 0x4699b0784e7b725e, 0x591c4b75eaeef658,
+        0x58401c96621a4ef6, 0x2f635e5365aab3ed, 0x6e5023bbfaa0e2b3, 0x7b3c35e83f1560e9,
+        0x44f216557ca48db0, 0x3d05a1b1276d5c92, 0x562e9beadbcdb11c, 0x4c470a1d7148b3b6,
+        0x6bba42e592c11d63, 0x5f58cca4cd9ae0a3, 0x435469cf7bb8b25e, 0x2b977fe70080cc66,
+        0x542984435aa6def5, 0x767d5fe0c0a0ff80, 0x6933e554315096b3, 0x341cb7d8f0c93f5f,
+        0x41c06f549ed25e30, 0x1091f2e7967dc79c, 0x52308b29c686f5bc, 0x14b66fa17c1d3983,
+        0x66bcadf43828b32b, 0x19e40b89db2487e3, 0x4035ecb8a3196ffb, 0x002e873628f6d4ee,
+        0x504367e6cbdfcbf9, 0x603a2903b3348a2a, 0x645441e07ed7bef8, 0x1848b344a001acb4,
+        0x7d6952589e8daeb6, 0x1e5ae015c80217e1, 0x4e61d37763188d31, 0x72f8cc0d9d014eed,
+        0x61fa48553bdeb07e, 0x2fb6ff110441a2a8, 0x7a78da6a8ad65c9d, 0x7ba4bed545520b52,
+        0x4c8b888296c5f9e2, 0x5d46f7454b534713, 0x5fae6aa33c77785b, 0x3498b5169e2818d8,
+        0x779a054c0b955672, 0x21bee25c45b21f0e, 0x4ac0434f873d5607, 0x35174d79ab8f5369,
+        0x5d705423690cab89, 0x225d20d816732843, 0x74cc692c434fd66b, 0x4af4690e1c0ff253,
+        0x48ffc1bbaa11e603, 0x1ed8c1a8d189f774, 0x5b3fb22a94965f84, 0x068ef21305ec7551,
+        0x720f9eb539bbf765, 0x0832ae97c76792a5, 0x4749c33144157a9f, 0x151fad1edca0bba8,
+        0x591c33fd951ad946, 0x7a67986693c8ea91, 0x6f6340fcfa618f98, 0x59017e8038bb2536,
+        0x459e089e1c7cf9bf, 0x37a0ef102374f742, 0x57058ac5a39c382f, 0x25892ad42c523512,
+        0x6cc6ed770c83463b, 0x0eeb75893766c256, 0x43fc546a67d20be4, 0x79532975c2a03976,
+        0x54fb698501c68ede, 0x17a7f3d3334847d4, 0x6a3a43e642383295, 0x5d91f0c8001a59c8,
+        0x42646a6fe9631f9d, 0x4a7b367d0010781d, 0x52fd850be3bbe784, 0x7d1a041c40149625,
+        0x67bce64edcaae166, 0x1c6085235019bbae, 0x40d60ff149eaccdf, 0x71bc53361210154d,
+        0x510b93ed9c658017, 0x6e2b680396941aa0, 0x654e78e9037ee01d, 0x69b642047c392148,
+        0x7ea21723445e9825, 0x2423d2859b476999, 0x4f254e760abb1f17, 0x26966393810ca200,
+        0x62eea2138d69e6dd, 0x103bfc78614fca80, 0x7baa4a9870c46094, 0x344afb9679a3bd20,
+        0x4d4a6e9f467abc5c, 0x60aedd3e0c065634, 0x609d0a4718196b73, 0x78da948d8f07ebc1,
+        0x78c44cd8de1fc650, 0x771139b0f2c9e6b1, 0x4b7ab0078ad3dbf2, 0x4a6ac40e97be302f,
+        0x5e595c096d88d2ef, 0x1d0575123dadbc3a, 0x75efb30bc8eb07ab, 0x0446d256cd192b49,
+        0x49b5cfe75d92e4ca, 0x72ac4376402fbb0e, 0x5c2343e134f79dfd, 0x4f575453d03ba9d1,
+        0x732c14d98235857d, 0x032d2968c44a9445, 0x47fb8d07f161736e, 0x11fc39e17aae9cab,
+        0x59fa7049edb9d049, 0x567b4859d95a43d6, 0x70790c5c6928445c, 0x0c1a1a704fb0d4cc,
+        0x464ba7b9c1b92ab9, 0x4790508631ce84ff, 0x57de91a832277567, 0x797464a7be42263f,
+        0x6dd636123eb152c1, 0x77d17dd1add2afcf, 0x44a5e1cb672ed3b9, 0x1ae2eea30ca3ade1,
+        0x55cf5a3e40fa88a7, 0x419baa4bcfcc995a, 0x6b4330cdd1392ad1, 0x320294dec3bfbfb0,
+        0x4309fe80a2c3bac2, 0x6f419d0b3a57d7ce, 0x53cc7e20cb74a973, 0x4b12044e08edcdc2,
+        0x68bf9da8fe51d3d0, 0x3dd685618b294132, 0x4177c2899ef32462, 0x26a6135cf6f9c8bf,
+        0x51d5b32c06afed7a, 0x704f983434b83aef, 0x664b1ff7085be8d9, 0x4c637e4141e649ab,
+        0x7fdde7f4ca72e30f, 0x7f7c5dd1925fdc15, 0x4feab0f8fe87cde9, 0x7fadbaa2fb7be98d,
+        0x63e55d373e29c164, 0x3f99294bba5ae3f1, 0x7cdeb4850db431bd, 0x4f7f739ea8f19ced,
+        0x4e0b30d328909f16, 0x41afa84329970214, 0x618dfd07f2b4c6dc, 0x121b9253f3fcc299,
+        0x79f17c49ef61f893, 0x16a276e8f0fbf33f, 0x4c36edae359d3b5b, 0x7e258a51969d7808,
+        0x5f44a919c3048a32, 0x7daeece5fc44d609, 0x7715d36033c5acbf, 0x5d1aa81f7b560b8c,
+        0x4a6da41c205b8bf7, 0x6a30a913ad15c738, 0x5d090d2328726ef5, 0x64bcd358985b3905,
+        0x744b506bf28f0ab3, 0x1dec082ebe720746, 0x48af1243779966b0, 0x02b3851d3707448c,
+        0x5adad6d4557fc05c, 0x0360666484c915af, 0x71918c896adfb073, 0x04387ffda5fb5b1b,
+        0x46faf7d5e2cbce47, 0x72a34ffe87bd18f1, 0x58b9b5cb5b7ec1d9, 0x6f4c23fe29ac5f2d,
+        0x6ee8233e325e7250, 0x2b1f2cfdb41776f8, 0x45511606df7b0772, 0x1af37c1e908eaa5b,
+        0x56a55b889759c94e, 0x61b05b2634b254f2, 0x6c4eb26abd303ba2, 0x3a1c71efc1deea2e,
+        0x43b12f82b63e2545, 0x4451c735d92b525d, 0x549d7b6363cdae96, 0x756639034f7626f4,
+        0x69c4da3c3cc11a3c, 0x52bfc7442353b0b1, 0x421b0865a5f8b065, 0x73b7dc8a96144e6f,
+        0x52a1ca7f0f76dc7f, 0x30a5d3ad3b99620b, 0x674a3d1ed354939f, 0x1ccf48988a7fba8d,
+        0x408e66334414dc43, 0x42018d5f568fd498, 0x50b1ffc0151a1354, 0x3281f0b72c33c9be,
+        0x64de7fb01a609829, 0x3f226ce4f740bc2e, 0x7e161f9c20f8be33, 0x6eeb081e3510eb39,
+        0x4ecdd3c1949b76e0, 0x3552e512e12a9304, 0x628148b1f9c25498, 0x42a79e57997537c5,
+        0x7b219ade7832e9be, 0x535185ed7fd285b6, 0x4cf500cb0b1fd217, 0x1412f3b46fe39392,
+        0x603240fdcde7c69c, 0x7917b0a18bdc7876, 0x783ed13d4161b844, 0x175d9cc9eed39694,
+        0x4b2742c648dd132a, 0x4e9a81fe35443e1c, 0x5df11377db1457f5, 0x2241227dc2954da3,
+        0x756d5855d1d96df2, 0x4ad16b1d333aa10c, 0x49645735a327e4b7, 0x4ec2e2f24004a4a8,
+        0x5bbd6d030bf1dde5, 0x42739baed005cdd2, 0x72acc843ceee555e, 0x7310829a84074146,
+        0x47abfd2a6154f55b, 0x27ea51a0928488cc, 0x5996fc74f9aa32b2, 0x11e4e608b725aaff,
+        0x6ffcbb923814bf5e, 0x565e1f8ae4ef15be, 0x45fdf53b630cf79b, 0x15fad3b6cf156d97,
+        0x577d728a3bd03581, 0x7b7988a482dac8fd, 0x6d5ccf2ccac442e2, 0x3a57eacda3917b3c,
+        0x445a017bfebaa9cd, 0x4476f2c0863aed06, 0x557081dafe695440, 0x7594af70a7c9a847,
+        0x6acca251be03a951, 0x12f9db4cd1bc1258, 0x42bfe57316c249d2, 0x5bdc291003158b77,
+        0x536fdecfdc72dc47, 0x32d3335403daee55, 0x684bd683d38f9359, 0x1f88002904d1a9ea,
+        0x412f66126439bc17, 0x63b50019a3030a33, 0x517b3f96fd482b1d, 0x5ca240200bc3ccbf,
+        0x65da0f7cbc9a35e5, 0x13cad0280eb4bfef, 0x7f50935bebc0c35e, 0x38bd84321261efeb,
+        0x4f925c1973587a1b, 0x0376729f4b7d35f3, 0x6376f31fd02e98a1, 0x64540f471e5c836f,
+        0x7c54afe7c43a3eca, 0x1d691318e5f3a44b, 0x4db4edf0daa4673e, 0x3261abef8fb846af,
+        0x6122296d114d810d, 0x7efa16eb73a6585b, 0x796ab3c855a0e151, 0x3eb89ca6508fee71,
+        0x4be2b05d35848cd2, 0x773361e7f259f507, 0x5edb5c7482e5b007, 0x55003a61eef07249,
+        0x76923391a39f1c09, 0x4a4048fa6aac8edb, 0x4a1b603b06437185, 0x7e682d9c82abd949,
+        0x5ca23849c7d44de7, 0x3e023903a356cf9b, 0x73cac65c39c96161, 0x2d82c7448c2c8382,
+        0x485ebbf9a41ddcdc, 0x6c71bc8ad79bd231, 0x5a766af80d255414, 0x078e2bad8d82c6bd,
+        0x711405b6106ea919, 0x0971b698f0e3786d, 0x46ac8391ca4529af, 0x55e7121f968e2b44,
+        0x5857a4763cd6741b, 0x4b60d6a77c31b615, 0x6e6d8d93cc0c1122, 0x3e390c515b3e239a,
+        0x4504787c5f878ab5, 0x46e3a7b2d906d640, 0x5645969b77696d62, 0x789c919f8f488bd0,
+        0x6bd6fc425543c8bb, 0x56c3b607731aaec4, 0x43665da9754a5d75, 0x263a51c4a7f0ad3b,
+        0x543ff513d29cf4d2, 0x4fc8e635d1ecd88a, 0x694ff258c7443207, 0x23bb1fc346680eac,
+        0x41d1f7777c8a9f44, 0x4654f3da0c01092c, 0x524675555bad4715, 0x57ea30d08f014b76,
+        0x66d812aab29898db, 0x0de4bd04b2c19e54, 0x40470baaaf9f5f88, 0x78aef622efb902f5,
+        0x5058ce955b87376b, 0x16dab3ababa743b2, 0x646f023ab2690545, 0x7c9160969691149e,
+        0x7d8ac2c95f034697, 0x3bb5b8bc3c3559c5, 0x4e76b9bddb620c1e, 0x55519375a5a1581b,
+        0x6214682d523a8f26, 0x2aa5f8530f09ae22, 0x7a998238a6c932ef, 0x754f7667d2cc19ab,
+        0x4c9ff163683dbfd5, 0x7951aa00e3bf900b, 0x5fc7edbc424d2fcb, 0x37a614811caf740d,
+        0x77b9e92b52e07bbe, 0x258f99a163db5111, 0x4ad431bb13cc4d56, 0x7779c004de6912ab,
+        0x5d893e29d8bf60ac, 0x5558300616035755, 0x74eb8db44eef38d7, 0x6aae3c079b842d2a,
+        0x49133890b1558386, 0x72ace584c1329c3b, 0x5b5806b4ddaae468, 0x4f581ee5f17f4349,
+        0x722e086215159d82, 0x632e269f6ddf141b, 0x475cc53d4d2d8271, 0x5dfcd823a4ab6c91,
+        0x5933f68ca078e30e, 0x157c0e2c8dd647b5, 0x6f80f42fc8971bd1, 0x5adb11b7b14bd9a3,
+        0x45b0989ddd5e7163, 0x08c8eb12cecf6806, 0x571cbec554b60dbb, 0x6afb25d782834207,
+        0x6ce3ee76a9e3912a, 0x65b9ef4d63241289, 0x440e750a2a2e3aba, 0x5f9435905df68b96,
+        0x5512124cb4b9c969, 0x377942f475742e7b, 0x6a5696dfe1e83bc3, 0x655793b192d13a1a,
+        0x42761e4bed31255a, 0x2f56bc4efbc2c450, 0x5313a5dee87d6eb0, 0x7b2c6b62bab37564,
+        0x67d88f56a29cca5d, 0x19f7863b696052bd, 0x40e7599625a1fe7a, 0x203ab3e521dc33b6,
+        0x51212ffbaf0a7e18, 0x684960de6a5340a4, 0x65697bfa9acd1d9f, 0x025bb91604e810cd,
+        0x7ec3daf941806506, 0x62f2a75b86221500, 0x4f3a68dbc8f03f24, 0x1dd7a89933d54d20,
+        0x63090312bb2c4eed, 0x254d92bf80caa068, 0x7bcb43d769f762a8, 0x4ea0f76f60fd4882,
+        0x4d5f0a66a23a9da9, 0x31249aa59c9e4d51, 0x60b6cd004ac94513, 0x5d6dc14f03c5e0a5,
+        0x78e480405d7b9658, 0x54c931a2c4b758cf, 0x4b8ed0283a6d3df7, 0x34fdbf05baf29781,
+        0x5e72843249088d75, 0x223d2ec729af3d62, 0x760f253edb4ab0d2, 0x4acc7a78f41b0cba,
+        0x49c97747490eae83, 0x4ebfcc8b9890e7f4, 0x5c3bd5191b525a24, 0x426fbfae7eb521f1,
+        0x734aca5f6226f0ad, 0x530baf9a1e626a6d, 0x480ebe7b9d58566c, 0x43e74dc052fd8285,
+        0x5a126e1a84ae6c07, 0x54e1213067bce326, 0x709709a125da0709, 0x4a19697c81ac1bef,
+        0x465e6604b7a84465, 0x7e4fe1edd10b9175, 0x57f5ff85e592557f, 0x3de3da69454e75d3,
+        0x6df37f675ef6eadf, 0x2d5cd10396a21347, 0x44b82fa09b5a52cb, 0x4c5a02a23e254c0d,
+        0x55e63b88c230e77e, 0x3f70834acdae9f10, 0x6b5fca6af2bd215e, 0x0f4ca41d811a46d4,
+        0x431bde82d7b634da, 0x698fe69270b06c44, 0x53e2d6238da3c211, 0x43f3e0370cdc8755,
+        0x68db8bac710cb295, 0x74f0d844d013a92b, 0x4189374bc6a7ef9d, 0x5916872b020c49bb,
+        0x51eb851eb851eb85, 0x0f5c28f5c28f5c29, 0x6666666666666666, 0x3333333333333334,
+        0x4000000000000000, 0x0000000000000001, 0x5000000000000000, 0x0000000000000001,
+        0x6400000000000000, 0x0000000000000001, 0x7d00000000000000, 0x0000000000000001,
+        0x4e20000000000000, 0x0000000000000001, 0x61a8000000000000, 0x0000000000000001,
+        0x7a12000000000000, 0x0000000000000001, 0x4c4b400000000000, 0x0000000000000001,
+        0x5f5e100000000000, 0x0000000000000001, 0x7735940000000000, 0x0000000000000001,
+        0x4a817c8000000000, 0x0000000000000001, 0x5d21dba000000000, 0x0000000000000001,
+        0x746a528800000000, 0x0000000000000001, 0x48c2739500000000, 0x0000000000000001,
+        0x5af3107a40000000, 0x0000000000000001, 0x71afd498d0000000, 0x0000000000000001,
+        0x470de4df82000000, 0x0000000000000001, 0x58d15e1762800000, 0x0000000000000001,
+        0x6f05b59d3b200000, 0x0000000000000001, 0x4563918244f40000, 0x0000000000000001,
+        0x56bc75e2d6310000, 0x0000000000000001, 0x6c6b935b8bbd4000, 0x0000000000000001,
+        0x43c33c1937564800, 0x0000000000000001, 0x54b40b1f852bda00, 0x0000000000000001,
+        0x69e10de76676d080, 0x0000000000000001, 0x422ca8b0a00a4250, 0x0000000000000001,
+        0x52b7d2dcc80cd2e4, 0x0000000000000001, 0x6765c793fa10079d, 0x0000000000000001,
+        0x409f9cbc7c4a04c2, 0x1000000000000001, 0x50c783eb9b5c85f2, 0x5400000000000001,
+        0x64f964e68233a76f, 0x2900000000000001, 0x7e37be2022c0914b, 0x1340000000000001,
+        0x4ee2d6d415b85ace, 0x7c08000000000001, 0x629b8c891b267182, 0x5b0a000000000001,
+        0x7b426fab61f00de3, 0x31cc800000000001, 0x4d0985cb1d3608ae, 0x0f1fd00000000001,
+        0x604be73de4838ad9, 0x52e7c40000000001, 0x785ee10d5da46d90, 0x07a1b50000000001,
+        0x4b3b4ca85a86c47a, 0x04c5112000000001, 0x5e0a1fd271287598, 0x45f6556800000001,
+        0x758ca7c70d7292fe, 0x5773eac200000001, 0x4977e8dc68679bdf, 0x16a872b940000001,
+        0x5bd5e313828182d6, 0x7c528f6790000001, 0x72cb5bd86321e38c, 0x5b67334174000001,
+        0x47bf19673df52e37, 0x79208008e8800001, 0x59aedfc10d7279c5, 0x7768a00b22a00001,
+        0x701a97b150cf1837, 0x3542c80deb480001, 0x46109eced2816f22, 0x5149bd08b30d0001,
+        0x5794c6828721caeb, 0x259c2c4adfd04001, 0x6d79f82328ea3da6, 0x0f03375d97c45001,
+        0x446c3b15f9926687, 0x6962029a7edab201, 0x558749db77f70029, 0x63ba83411e915e81,
+        0x6ae91c5255f4c034, 0x1ca924116635b621, 0x42d1b1b375b8f820, 0x51e9b68adfe191d5,
+        0x53861e2053273628, 0x6664242d97d9f64a, 0x6867a5a867f103b2, 0x7ffd2d38fdd073dc,
+        0x4140c78940f6a24f, 0x6ffe3c439ea2486a, 0x5190f96b91344ae3, 0x6bfdcb54864ada84,
+        0x65f537c675815d9c, 0x66fd3e29a7dd9125, 0x7f7285b812e1b504, 0x00bc8db411d4f56e,
+        0x4fa793930bcd1122, 0x4075d8908b251965, 0x63917877cec0556b, 0x10934eb4adee5fbe,
+        0x7c75d695c2706ac5, 0x74b82261d969f7ad, 0x4dc9a61d998642bb, 0x58f3157d27e23acc,
+        0x613c0fa4ffe7d36a, 0x4f2fdadc71dac97f, 0x798b138e3fe1c845, 0x22fbd1938e517bdf,
+        0x4bf6ec38e7ed1d2b, 0x25dd62fc38f2ed6c, 0x5ef4a74721e86476, 0x0f54bbbb472fa8c6,
+        0x76b1d118ea627d93, 0x5329eaaa18fb92f8, 0x4a2f22af927d8e7c, 0x23fa32aa4f9d3bdb,
+        0x5cbaeb5b771cf21b, 0x2cf8bf54e3848ad2, 0x73e9a63254e42ea2, 0x1836ef2a1c65ad86,
+        0x487207df750e9d25, 0x2f22557a51bf8c74, 0x5a8e89d75252446e, 0x5aeaead8e62f6f91,
+        0x71322c4d26e6d58a, 0x31a5a58f1fbb4b75, 0x46bf5bb038504576, 0x3f07877973d50f29,
+        0x586f329c466456d4, 0x0ec96957d0ca52f3, 0x6e8aff4357fd6c89, 0x127bc3adc4fce7b0,
+        0x4516df8a16fe63d5, 0x5b8d5a4c9b1e10ce, 0x565c976c9cbdfccb, 0x1270b0dfc1e59502,
+        0x6bf3bd47c3ed7bfd, 0x770cdd17b25efa42, 0x4378564cda746d7e, 0x5a680a2ecf7b5c69,
+        0x54566be0111188de, 0x31020cba835a3384, 0x696c06d81555eb15, 0x7d428fe92430c065,
+        0x41e384470d55b2ed, 0x5e4999f1b69e783f, 0x525c6558d0ab1fa9, 0x15dc006e2446164f,
+        0x66f37eaf04d5e793, 0x3b530089ad579be2, 0x40582f2d6305b0bc, 0x1513e0560c56c16e,
+        0x506e3af8bbc71ceb, 0x1a58d86b8f6c71c9, 0x6489c9b6eab8e426, 0x00ef0e8673478e3b,
+        0x7dac3c24a5671d2f, 0x412ad228101971c9, 0x4e8ba596e760723d, 0x58bac3590a0fe71e,
+        0x622e8efca1388ecd, 0x0ee9742f4c93e0e6, 0x7aba32bbc986b280, 0x32a3d13b1fb8d91f,
+        0x4cb45fb55df42f90, 0x1fa662c4f3d387b3, 0x5fe177a2b5713b74, 0x278ffb7630c869a0,
+        0x77d9d58b62cd8a51, 0x3173fa53bcfa8408, 0x4ae825771dc07672, 0x6ee87c74561c9285,
+        0x5da22ed4e530940f, 0x4aa29b916ba3b726, 0x750aba8a1e7cb913, 0x3d4b4275c68ca4f0,
+        0x4926b496530df3ac, 0x164f09899c17e716, 0x5b7061bbe7d17097, 0x1be2cbec031de0dc,
+        0x724c7a2ae1c5ccbd, 0x02db7ee703e55912, 0x476fcc5acd1b9ff6, 0x11c92f50626f57ac,
+        0x594bbf71806287f3, 0x563b7b247b0b2d96, 0x6f9eaf4de07b29f0, 0x4bca59ed99cdf8fc,
+        0x45c32d90ac4cfa36, 0x2f5e78348020bb9e, 0x5733f8f4d76038c3, 0x7b361641a028ea85,
+        0x6d00f7320d3846f4, 0x7a039bd208332526, 0x44209a7f48432c59, 0x0c424163451ff738,
+        0x5528c11f1a53f76f, 0x2f52d1bc1667f506, 0x6a72f166e0e8f54b, 0x1b27862b1c01f247,
+        0x4287d6e04c91994f, 0x00f8b3daf181376d, 0x5329cc985fb5ffa2, 0x6136e0d1ade18548,
+        0x67f43fbe77a37f8b, 0x398499061959e699, 0x40f8a7d70ac62fb7, 0x13f2dfa3cfd83020,
+        0x5136d1cccd77bba4, 0x78ef978cc3ce3c28, 0x6584864000d5aa8e, 0x172b7d6ff4c1cb32,
+        0x7ee5a7d0010b1531, 0x5cf65ccbf1f23dfe, 0x4f4f88e200a6ed3f, 0x0a19f9ff773766bf,
+        0x63236b1a80d0a88e, 0x6ca0787f5505406f, 0x7bec45e12104d2b2, 0x47c8969f2a46908a,
+        0x4d73abacb4a303af, 0x4cdd5e237a6c1a57, 0x60d09697e1cbc49b, 0x4014b5ac590720ec,
+        0x7904bc3dda3eb5c2, 0x3019e3176f48e927, 0x4ba2f5a6a8673199, 0x3e102deea58d91b9,
+        0x5e8bb3105280fdff, 0x6d94396a4ef0f627, 0x762e9fd467213d7f, 0x68f947c4e2ad33b0,
+        0x49dd23e4c074c66f, 0x719bccdb0dac404e, 0x5c546cddf091f80b, 0x6e02c011d1175062,
+        0x736988156cb6760e, 0x69837016455d247a, 0x4821f50d63f209c9, 0x21f2260deb5a36cc,
+        0x5a2a7250bcee8c3b, 0x4a6eaf916630c47f, 0x70b50ee4ec2a2f4a, 0x3d0a5b75bfbcf59f,
+        0x4671294f139a5d8e, 0x4626792997d61984, 0x580d73a2d880f4f2, 0x17b01773fdcb9fe4,
+        0x6e10d08b8ea1322e, 0x5d9c1d50fd3e87dd, 0x44ca82573924bf5d, 0x1a8192529e4714eb,
+        0x55fd22ed076def34, 0x4121f6e745d8da25, 0x6b7c6ba849496b01, 0x516a74a1174f10ae,
+        0x432dc3492dcde2e1, 0x02e288e4ae916a6d, 0x53f9341b79415b99, 0x239b2b1dda35c508,
+        0x68f781225791b27f, 0x4c81f5e550c3364a, 0x419ab0b576bb0f8f, 0x5fd139af527a01ef,
+        0x52015ce2d469d373, 0x57c5881b2718826a, 0x6681b41b89844850, 0x4db6ea21f0dea304,
+        0x4011109135f2ad32, 0x30925255368b25e3, 0x501554b5836f587e, 0x7cb6e6ea842def5c,
+        0x641aa9e2e44b2e9e, 0x5be4a0a525396b32, 0x7d21545b9d5dfa46, 0x32ddc8ce6e87c5ff,
+        0x4e34d4b9425abc6b, 0x7fca9d810514dbbf, 0x61c209e792f16b86, 0x7fbd44e1465a12af,
+        0x7a328c6177adc668, 0x5fac961997f0975b, 0x4c5f97bceacc9c01, 0x3bcbddcffef65e99,
+        0x5f777dac257fc301, 0x6abed543feb3f63f, 0x77555d172edfb3c2, 0x256e8a94fe60f3cf,
+        0x4a955a2e7d4bd059, 0x3765169d1efc9861, 0x5d3ab0ba1c9ec46f, 0x653e5c4466bbbe7a,
+        0x74895ce8a3c6758b, 0x5e8df355806aae18, 0x48d5da11665c0977, 0x2b18b8157042accf,
+        0x5b0b5095bff30bd5, 0x15dee61acc535803, 0x71ce24bb2fefceca, 0x3b569fa17f682e03,
+        0x4720d6f4fdf5e13e, 0x451623c4efa11cc2, 0x58e90cb23d73598e, 0x165bacb62b8963f3,
+        0x6f234fdeccd02ff1, 0x5bf297e3b66bbcef, 0x457611eb40021df7, 0x09779eee52035616,
+        0x56d396661002a574, 0x6bd586a9e6842b9b, 0x6c887bff94034ed2, 0x06cae85460253682,
+        0x43d54d7fbc821143, 0x243ed134bc174211, 0x54caa0dfaba29594, 0x0d4e8581eb1d1295,
+        0x69fd4917968b3af9, 0x10a226e265e4573b, 0x423e4daebe1704db, 0x5a65584d7faeb685,
+        0x52cde11a6d9cc612, 0x50feae60df9a6426, 0x678159610903f797, 0x253e59f91780fd2f,
+        0x40b0d7dca5a27abe, 0x4746f83baeb09e3e, 0x50dd0dd3cf0b196e, 0x1918b64a9a5cc5cd,
+        0x65145148c2cddfc9, 0x5f5ee3dd40f3f740, 0x7e59659af38157bc, 0x17369cd49130f510,
+        0x4ef7df80d830d6d5, 0x4e822204dabe992a, 0x62b5d7610e3d0c8b, 0x0222aa86116e3f75,
+        0x7b634d3951cc4fad, 0x62ab552795c9cf52, 0x4d1e1043d31fb1cc, 0x4dab1538bd9e2193,
+        0x60659454c7e79e3f, 0x6115da86ed05a9f8, 0x787ef969f9e185cf, 0x595b5128a8471476,
+        0x4b4f5be23c2cf3a1, 0x67d912b9692c6cca, 0x5e2332dacb38308a, 0x21cf5767c37787fc,
+        0x75abff917e063cac, 0x6a432d41b45569fb, 0x498b7fbaeec3e5ec, 0x0269fc4910b5623d,
+        0x5bee5fa9aa74df67, 0x03047b5b54e2bacc, 0x72e9f79415121740, 0x63c59a322a1b697f,
+        0x47d23abc8d2b4e88, 0x3e5b805f5a5121f0, 0x59c6c96bb076222a, 0x4df2607730e56a6c,
+        0x70387bc69c93aab5, 0x216ef894fd1ec506, 0x46234d5c21dc4ab1, 0x24e55b5d1e333b24,
+        0x57ac20b32a535d5d, 0x4e1eb23465c009ed, 0x6d9728dff4e834b5, 0x01a65ec17f300c68,
+        0x447e798bf91120f1, 0x1107fb38ef7e07c1, 0x559e17eef755692d, 0x3549fa072b5d89b1,
+        0x6b059deab52ac378, 0x629c7888f634ec1e, 0x42e382b2b13aba2b, 0x3da1cb5599e11393,
+        0x539c635f5d8968b6, 0x2d0a3e2b00595877, 0x68837c3734ebc2e3, 0x784ccdb5c06fae95,
+        0x41522da2811359ce, 0x3b3000919845cd1d, 0x51a6b90b21583042, 0x09fc00b5fe574065,
+        0x6610674de9ae3c52, 0x4c7b00e37ded107e, 0x7f9481216419cb67, 0x1f99c11c5d68549d,
+        0x4fbcd0b4de901f20, 0x43c018b1ba6134e2, 0x63ac04e2163426e8, 0x54b01ede28f9821b,
+        0x7c97061a9bc130a2, 0x69dc2695b337e2a1, 0x4dde63d0a158be65, 0x6229981d9002eda5,
+        0x6155fcc4c9aeedff, 0x1ab3fe24f403a90e, 0x79ab7bf5fc1aa97f, 0x0160fdae31049351,
+        0x4c0b2d79bd90a9ef, 0x30dc9e8cdea2dc13, 0x5f0df8d82cf4d46b, 0x1d13c630164b9318,
+        0x76d1770e38320986, 0x0458b7bc1bde77dd, 0x4a42ea68e31f45f3, 0x62b772d5916b0aeb,
+        0x5cd3a5031be71770, 0x5b654f8af5c5cda5, 0x74088e43e2e0dd4c, 0x723ea36db337410e,
+        0x488558ea6dcc8a50, 0x07672624900288a9, 0x5aa6af25093face4, 0x0940efadb4032ad3,
+        0x71505aee4b8f981d, 0x0b912b992103f588, 0x46d238d4ef39bf12, 0x173abb3fb4a27975,
+        0x5886c70a2b082ed6, 0x5d096a0fa1cb17d2, 0x6ea878ccb5ca3a8c, 0x344bc4938a3dddc7,
+        0x45294b7ff19e6497, 0x60af5adc3666aa9c, 0x56739e5fee05fdbd, 0x58db319344005543,
+        0x6c1085f7e9877d2d, 0x0f11fdf815006a94, 0x438a53baf1f4ae3c, 0x196b3ebb0d20429d,
+        0x546ce8a9ae71d9cb, 0x1fc60e69d0685344, 0x698822d41a0e503e, 0x07b7920444826815,
+        0x41f515c49048f226, 0x64d2bb42aad1810d, 0x52725b35b45b2eb0, 0x3e076a135585e150,
+        0x670ef2032171fa5c, 0x4d8944982ae759a4, 0x40695741f4e73c79, 0x7075cadf1ad09807,
+        0x5083ad1272210b98, 0x2c933d96e184be08, 0x64a498570ea94e7e, 0x37b80cfc99e5ed8a,
+        0x7dcdbe6cd253a21e, 0x05a6103bc05f68ed, 0x4ea0970403744552, 0x6387ca25583ba194,
+        0x6248bcc5045156a7, 0x3c69bcaeae4a89f9, 0x7adaebf64565ac51, 0x2b842bda59dd2c77,
+        0x4cc8d379eb5f8bb2, 0x6b329b68782a3bcb, 0x5ffb085866376e9f, 0x45ff42429634cabd,
+        0x77f9ca6e7fc54a47, 0x377f12d33bc1fd6d, 0x4afc1e850fdb4e6c, 0x52af6bc405593e64,
+        0x5dbb262653d22207, 0x675b46b506af8dfd, 0x7529efafe8c6aa89, 0x61321862485b717c,
+        0x493a35cdf17c2a96, 0x0cbf4f3d6d3926ee, 0x5b88c3416ddb353b, 0x4fef230cc88770a9,
+        0x726af411c952028a, 0x43eaebcffaa94cd3, 0x4782d88b1dd34196, 0x4a72d361fca9d004,
+        0x59638eade54811fc, 0x1d0f883a7bd44405, 0x6fbc72595e9a167b, 0x24536a491ac95506,
+        0x45d5c777db204e0d, 0x06b4226db0bdd524, 0x574b3955d1e86190, 0x28612b091ced4a6d,
+        0x6d1e07ab466279f4, 0x327975cb64289d08, 0x4432c4cb0bfd8c38, 0x5f8be99f1e996225,
+        0x553f75fdcefcef46, 0x776ee406e63fbaae, 0x6a8f537d42bc2b18, 0x554a9d089fcfa95a,
+        0x4299942e49b59aef, 0x354ea22563e1c9d8, 0x533ff939dc2301ab, 0x22a24aaebcda3c4e,
+        0x680ff788532bc216, 0x0b4add5a6c10cb62, 0x4109fab533fb594d, 0x670eca58838a7f1d,
+        0x514c796280fa2fa1, 0x20d27ceea46d1ee4, 0x659f97bb2138bb89, 0x49071c2a4d88669d,
+        0x7f077da9e986ea6b, 0x7b48e334e0ea8045, 0x4f64ae8a31f45283, 0x3d0d8e010c92902b,
+        0x633dda2cbe716724, 0x2c50f1814fb73436, 0x7c0d50b7ee0dc0ed, 0x37652de1a3a50143,
+        0x4d885272f4c89894, 0x329f3cad064720ca, 0x60ea670fb1fabeb9, 0x3f470bd847d8e8fd,
+        0x792500d39e796e67, 0x6f18cece59cf233c, 0x4bb72084430be500, 0x756f8140f8217605,
+        0x5ea4e8a553cede41, 0x12cb61913629d387, 0x764e22cea8c295d1, 0x377e39f583b44868,
+        0x49f0d5c129799da2, 0x72aee4397250ad41, 0x5c6d0b3173d8050b, 0x4f5a9d47cee4d891,
+        0x73884dfdd0ce064e, 0x43314499c29e0eb6, 0x483530bea280c3f1, 0x09fecae019a2c932,
+        0x5a427cee4b20f4ed, 0x2c7e7d98200b7b7e, 0x70d31c29dde93228, 0x579e1cfe280e5a5d,
+        0x4683f19a2ab1bf59, 0x36c2d21ed908f87b, 0x5824ee00b55e2f2f, 0x647386a68f4b3699,
+        0x6e2e2980e2b5bafb, 0x5d906850331e043f, 0x44dcd9f08db194dd, 0x2a7a41321ff2c2a8,
+        0x5614106cb11dfa14, 0x5518d17ea7ef7352, 0x6b991487dd657899, 0x6a5f05de51eb5026,
+        0x433facd4ea5f6b60, 0x127b63aaf3331218, 0x540f980a24f74638, 0x171a3c95afffd69e,
+        0x69137e0cae3517c6, 0x1ce0cbbb1bffcc45, 0x41ac2ec7ece12edb, 0x720c7f54f17fdfab,
+        0x52173a79e8197a92, 0x6e8f9f2a2ddfd796, 0x669d0918621fd937, 0x4a3386f4b957cd7b,
+        0x402225af3d53e7c2, 0x5e603458f3d6e06d, 0x502aaf1b0ca8e1b3, 0x35f8416f30cc9888,
+        0x64355ae1cfd31a20, 0x237651cafcffbeaa, 0x7d42b19a43c7e0a8, 0x2c53e63dbc3fae55,
+        0x4e49af006a5cec69, 0x1bb46fe695a7ccf5, 0x61dc1ac084f42783, 0x42a18be03b11c033,
+        0x7a532170a6313164, 0x3349eed849d6303f, 0x4c73f4e667debede, 0x600e35472e25de28,
+        0x5f90f22001d66e96, 0x3811c298f9af55b1, 0x77752ea8024c0a3c, 0x0616333f381b2b1e,
+        0x4aa93d29016f8665, 0x43cde0078310faf3, 0x5d538c7341cb67fe, 0x74c1580963d539af,
+        0x74a86f90123e41fe, 0x51f1ae0bbcca881b, 0x48e945ba0b66e93f, 0x13370cc755fe9511,
+        0x5b2397288e40a38e, 0x7804cff92b7e3a55, 0x71ec7cf2b1d0cc72, 0x560603f7765dc8ea,
+        0x4733ce17af227fc7, 0x55c3c27aa9fa9d93, 0x5900c19d9aeb1fb9, 0x4b34b319547944f7,
+        0x6f40f20501a5e7a7, 0x7e01dfdfa9979635, 0x458897432107b0c8, 0x7ec12bebc9febde1,
+        0x56eabd13e9499cfb, 0x1e7176e6bc7e6d59, 0x6ca56c58e39c043a, 0x060dd4a06b9e08b0,
+        0x43e763b78e4182a4, 0x23c8a4e44342c56e, 0x54e13ca571d1e34d, 0x2cbace1d541376c9,
+        0x6a198bcece465c20, 0x57e981a4a918547b, 0x424ff76140ebf994, 0x36f1f106e9af34cd,
+        0x52e3f5399126f7f9, 0x44ae6d48a41b0201, 0x679cf287f570b5f7, 0x75da089acd21c281,
+        0x40c21794f96671ba, 0x79a84560c0351991, 0x50f29d7a37c00e29, 0x581256b8f0425ff5,
+        0x652f44d8c5b011b4, 0x0e16ec672c52f7f2, 0x7e7b160ef71c1621, 0x119ca780f767b5ee,
+        0x4f0cedc95a718dd4, 0x5b01e8b09aa0d1b5, 0x62d0293bb10df149, 0x71c262dcc1490622,
+    };
+    return s_powers;
+}
+
+// floor(q * log10(2)), floor(q * log10(2) + log10(3/4)) and floor(e * log2(10)), exact in the used ranges
+inline int schubfachLog10Pow2(int q) {
+    return (int)(((int64_t)q * 661971961083LL) >> 41);
+}
+inline int schubfachLog10ThreeQuartersPow2(int q) {
+    return (int)(((int64_t)q * 661971961083LL - 274743187321LL) >> 41);
+}
+inline int schubfachLog2Pow10(int e) {
+    return (int)(((int64_t)e * 913124641741LL) >> 38);
+}
+
+// floor(g * cp / 2^127), rounded to odd
+inline uint64_t schubfachRoundToOdd(uint64_t g1, uint64_t g0, uint64_t cp) {
+    const uint64_t MASK63 = 0x7FFFFFFFFFFFFFFFULL;
+    uint64_t x1 = umulh64(g0, cp);
+    uint64_t y0 = g1 * cp;
+    uint64_t y1 = umulh64(g1, cp);
+    uint64_t z = (y0 >> 1) + x1;
+    uint64_t vbp = y1 + (z >> 63);
+    return vbp | (((z & MASK63) + MASK63) >> 63);
+}
+
+// the shortest f * 10^e inside the rounding interval of c * 2^q, the closest one on a tie
+// of length. side is the sign of c * 2^q - f * 10^e, if asked for.
+inline void schubfachDecimal(int q, uint64_t c, uint64_t* f, int* e, int* side = nullptr) {
+    uint64_t out = c & 1;
+    uint64_t cb = c << 2;
+    uint64_t cbr = cb + 2;
+    uint64_t cbl;
+    int k;
+    if (c != (1ULL << 52) || q == -1074) {
+        cbl = cb - 2;
+        k = schubfachLog10Pow2(q);
+    }
+    else {
+        // at a power of two the lower neighbor is twice as close
+        cbl = cb - 1;
+        k = schubfachLog10ThreeQuartersPow2(q);
+    }
+    int h = q + schubfachLog2Pow10(-k) + 2;
+    const uint64_t* g = schubfachPowers() + (292 - k) * 2;
+    uint64_t vb = schubfachRoundToOdd(g[0], g[1], cb << h);
+    uint64_t vbl = schubfachRoundToOdd(g[0], g[1], cbl << h);
+    uint64_t vbr = schubfachRoundToOdd(g[0], g[1], cbr << h);
+    *e = k;
+
+    uint64_t s = vb >> 2;
+    uint64_t t = s + 1;
+    bool done = false;
+    if (s >= 10) {
+        // one digit less, if exactly one of its neighbors is inside
+        uint64_t sp10 = s / 10 * 10;
+        uint64_t tp10 = sp10 + 10;
+        bool upin = vbl + out <= sp10 << 2;
+        bool wpin = (tp10 << 2) + out <= vbr;
+        if (upin != wpin) {
+            *f = upin ? sp10 : tp10;
+            done = true;
+        }
+    }
+    if (!done) {
+        bool uin = vbl + out <= s << 2;
+        bool win = (t << 2) + out <= vbr;
+        if (uin != win) {
+            *f = uin ? s : t;
+        }
+        else {
+            // both inside, the closer one, or the even one
+            int64_t cmp = (int64_t)(vb - ((s + t) << 1));
+            *f = cmp < 0 || (cmp == 0 && (s & 1) == 0) ? s : t;
+        }
+    }
+    // vb is 4 * c * 2^q / 10^k rounded to odd, so it compares with 4 * f like the exact value
+    if (side) *side = vb > *f << 2 ? 1 : vb < *f << 2 ? -1 : 0;
+}
+
+// the same for a float32 c * 2^q, with the upper 64 bits of g
+inline void schubfachDecimal32(int q, uint32_t c, uint64_t* f, int* e) {
+    uint64_t out = c & 1;
+    uint64_t cb = (uint64_t)c << 2;
+    uint64_t cbr = cb + 2;
+    uint64_t cbl;
+    int k;
+    if (c != (1u << 23) || q == -149) {
+        cbl = cb - 2;
+        k = schubfachLog10Pow2(q);
+    }
+    else {
+        cbl = cb - 1;
+        k = schubfachLog10ThreeQuartersPow2(q);
+    }
+    int h = q + schubfachLog2Pow10(-k) + 33;
+    uint64_t g = schubfachPowers()[(292 - k) * 2] + 1;
+    // floor(g * cp / 2^95), rounded to odd
+    uint64_t x1 = umulh64(g, cb << h), xl = umulh64(g, cbl << h), xr = umulh64(g, cbr << h);
+    uint64_t vb = (x1 >> 31) | (((x1 & 0xFFFFFFFF) + 0xFFFFFFFF) >> 32);
+    uint64_t vbl = (xl >> 31) | (((xl & 0xFFFFFFFF) + 0xFFFFFFFF) >> 32);
+    uint64_t vbr = (xr >> 31) | (((xr & 0xFFFFFFFF) + 0xFFFFFFFF) >> 32);
+    *e = k;
+
+    uint64_t s = vb >> 2;
+    if (s >= 10) {
+        uint64_t sp10 = s / 10 * 10;
+        uint64_t tp10 = sp10 + 10;
+        bool upin = vbl + out <= sp10 << 2;
+        bool wpin = (tp10 << 2) + out <= vbr;
+        if (upin != wpin) {
+            *f = upin ? sp10 : tp10;
+            return;
+        }
+    }
+    uint64_t t = s + 1;
+    bool uin = vbl + out <= s << 2;
+    bool win = (t << 2) + out <= vbr;
+    if (uin != win) {
+        *f = uin ? s : t;
+        return;
+    }
+    int64_t cmp = (int64_t)(vb - ((s + t) << 1));
+    *f = cmp < 0 || (cmp == 0 && (s & 1) == 0) ? s : t;
+}
+
+inline void schubfachStripZeros(uint64_t* f, int* e) {
+    while (*f % 10 == 0) {
+        *f /= 10;
+        (*e)++;
+    }
+}
+
+// the shortest digits of a positive double, without trailing zeros
+inline void schubfachShortest(double value, uint64_t* f, int* e, int* side = nullptr) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    int bq = (int)(bits >> 52);
+    uint64_t t = bits & ((1ULL << 52) - 1);
+    if (bq != 0) {
+        int mq = 1075 - bq;
+        uint64_t c = (1ULL << 52) | t;
+        if (0 < mq && mq < 53 && (c >> mq << mq) == c) {
+            // a small integer
+            *f = c >> mq;
+            *e = 0;
+            if (side) *side = 0;
+        }
+        else {
+            schubfachDecimal(-mq, c, f, e, side);
+        }
+    }
+    else {
+        schubfachDecimal(-1074, t, f, e, side);
+    }
+    schubfachStripZeros(f, e);
+}
+
+inline int schubfachDigitCount(uint64_t f) {
+    int length = 1;
+    for (uint64_t p10 = 10; f >= p10 && length < 20; p10 *= 10) length++;
+    return length;
+}
+
+// the digits of f, returns the end
+inline char* schubfachDigits(char* buffer, uint64_t f, int length) {
+    const char* cDigitsLut = GetDigitsLut();
+    char* d = buffer + length;
+    while (f >= 100) {
+        const char* pair = cDigitsLut + (f % 100) * 2;
+        f /= 100;
+        *--d = pair[1];
+        *--d = pair[0];
+    }
+    if (f >= 10) {
+        *--d = cDigitsLut[f * 2 + 1];
+        *--d = cDigitsLut[f * 2];
+    }
+    else {
+        *--d = (char)('0' + f);
+    }
+    return buffer + length;
+}
+
+// write f * 10^e the way dtoa_milo does and return the length
+inline int schubfachWrite(char* buffer, uint64_t f, int e) {
+    int length = schubfachDigitCount(f);
+    schubfachDigits(buffer, f, length);
+    Prettify(buffer, length, e);
+
+    // the length of what Prettify wrote, rather than strlen
+    const int kk = length + e;
+    if (length <= kk && kk <= 21) return kk;
+    if (0 < kk && kk <= 21) return length + 1;
+    if (-6 < kk && kk <= 0) return length + 2 - kk;
+    int exponent = kk - 1 < 0 ? 1 - kk : kk - 1;
+    int n = (length == 1 ? 2 : length + 2) + (kk - 1 < 0);
+    return n + (exponent >= 100 ? 3 : exponent >= 10 ? 2 : 1);
+}
+
+// returns the length, buffer needs 26 bytes
+inline int dtoa_schubfach(double value, char* buffer) {
+    // Not handling NaN and inf
+    assert(!isnan(value));
+    assert(!isinf(value));
+
+    if (value == 0) {
+        buffer[0] = '0';
+        buffer[1] = '\0';
+        return 1;
+    }
+    int sign = 0;
+    if (value < 0) {
+        *buffer++ = '-';
+        value = -value;
+        sign = 1;
+    }
+    uint64_t f;
+    int e;
+    schubfachShortest(value, &f, &e);
+    return sign + schubfachWrite(buffer, f, e);
+}
+
+// Number.prototype.toString of ECMAScript, as RFC 8785 requires: the shortest digits, and
+// positive exponents with a sign, 1e+21. buffer needs 27 bytes
+inline int dtoa_ecmascript(double value, char* buffer) {
+    int length = dtoa_schubfach(value, buffer);
+    // the exponent has at most three digits and a sign
+    for (int i = length - 2; i > 0 && i >= length - 5; i--) {
+        if (buffer[i] == 'e') {
+            if (buffer[i + 1] != '-') {
+                memmove(&buffer[i + 2], &buffer[i + 1], length - i);
+                buffer[i + 1] = '+';
+                length++;
+            }
+            break;
+        }
+    }
+    return length;
+}
+
+// The shortest digits that read back to the same float32, value is rounded to float
+// first. Values beyond the range of float are written as doubles.
+inline int dtoa_float32(double value, char* buffer) {
+    assert(!isnan(value));
+    assert(!isinf(value));
+
+    double a = value < 0 ? -value : value;
+    if (a > 3.4028234663852886e38) return dtoa_schubfach(value, buffer);
+    float x = (float)a;
+    if (x == 0) {
+        buffer[0] = '0';
+        buffer[1] = '\0';
+        return 1;
+    }
+    int sign = 0;
+    if (value < 0) {
+        *buffer++ = '-';
+        sign = 1;
+    }
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    int bq = (int)(bits >> 23);
+    uint32_t t = bits & ((1u << 23) - 1);
+    uint64_t f;
+    int e;
+    if (bq != 0) {
+        int mq = 150 - bq;
+        uint32_t c = (1u << 23) | t;
+        if (0 < mq && mq < 24 && (c >> mq << mq) == c) {
+            f = c >> mq;
+            e = 0;
+        }
+        else {
+            schubfachDecimal32(-mq, c, &f, &e);
+        }
+    }
+    else {
+        schubfachDecimal32(-149, t, &f, &e);
+    }
+    schubfachStripZeros(&f, &e);
+    return sign + schubfachWrite(buffer, f, e);
+}
+
+// Rounded to the given number of decimal places (0-17), half to even, without trailing
+// zeros. value * 10^decimals is rounded as an integer, with the exact product only near
+// a tie. Values too large for that are written in the shortest form.
+inline int dtoa_fixed(double value, int decimals, char* buffer) {
+    static const double s_pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17
+    };
+    assert(!isnan(value));
+    assert(!isinf(value));
 
-	if (K >= 100) {
-		*buffer++ = '0' + static_cast<char>(K / 100);
-		K %= 100;
-		const char* d = GetDigitsLut() + K * 2;
-		*buffer++ = d[0];
-		*buffer++ = d[1];
-	}
-	else if (K >= 10) {
-		const char* d = GetDigitsLut() + K * 2;
-		*buffer++ = d[0];
-		*buffer++ = d[1];
-	}
-	else
-		*buffer++ = '0' + static_cast<char>(K);
+    if (decimals < 0) decimals = 0;
+    if (decimals > 17) decimals = 17;
+    double a = value < 0 ? -value : value;
+    double scale = s_pow10[decimals];
+    double p = a * scale;
+    if (!(p < 9007199254740992.0)) return dtoa_schubfach(value, buffer);
+    double r = floor(p);
+    double half = p - r - 0.5;
+    if (ZJSON_UNLIKELY(fabs(half) <= p * 2.220446049250313e-16)) {
+        // the product may be rounded across the tie
+        half += fma(a, scale, -p);
+    }
+    uint64_t n = (uint64_t)r;
+    if (half > 0 || (half == 0 && (n & 1))) n++;
 
-	*buffer = '\0';
+    char* out = buffer;
+    if (value < 0 && n != 0) *out++ = '-';
+    uint64_t unit = (uint64_t)scale;
+    uint64_t integer = n / unit, fraction = n % unit;
+    out = schubfachDigits(out, integer, schubfachDigitCount(integer));
+    if (fraction) {
+        int places = decimals;
+        while (fraction % 10 == 0) {
+            fraction /= 10;
+            places--;
+        }
+        *out++ = '.';
+        // zero padded
+        for (char* d = out + places; d != out;) {
+            *--d = (char)('0' + fraction % 10);
+            fraction /= 10;
+        }
+        out += places;
+    }
+    *out = '\0';
+    return (int)(out - buffer);
 }
 
-inline void Prettify(char* buffer, int length, int k) {
-	const int kk = length + k;	// 10^(kk-1) <= v < 10^kk
+// Rounded to at most the given number of significant digits (1-17), half to even. The
+// shortest digits are rounded, and the exact value decides where they are on a tie.
+inline int dtoa_precision(double value, int digits, char* buffer) {
+    assert(!isnan(value));
+    assert(!isinf(value));
 
-	if (length <= kk && kk <= 21) {
-		// 1234e7 -> 12340000000
-		for (int i = length; i < kk; i++)
-			buffer[i] = '0';
-		buffer[kk] = '\0';
-	}
-	else if (0 < kk && kk <= 21) {
-		// 1234e-2 -> 12.34
-		memmove(&buffer[kk + 1], &buffer[kk], length - kk);
-		buffer[kk] = '.';
-		buffer[length + 1] = '\0';
-	}
-	else if (-6 < kk && kk <= 0) {
-		// 1234e-6 -> 0.001234
-		const int offset = 2 - kk;
-		memmove(&buffer[offset], &buffer[0], length);
-		buffer[0] = '0';
-		buffer[1] = '.';
-		for (int i = 2; i < offset; i++)
-			buffer[i] = '0';
-		buffer[length + offset] = '\0';
-	}
-	else if (length == 1) {
-		// 1e30
-		buffer[1] = 'e';
-		WriteExponent(kk - 1, &buffer[2]);
-	}
-	else {
-		// 1234e30 -> 1.234e33
-		memmove(&buffer[2], &buffer[1], length - 1);
-		buffer[1] = '.';
-		buffer[length + 1] = 'e';
-		WriteExponent(kk - 1, &buffer[0 + length + 2]);
-	}
+    if (digits < 1) digits = 1;
+    if (value == 0 || digits >= 17) return dtoa_schubfach(value, buffer);
+    double a = value < 0 ? -value : value;
+    if (digits <= 15 && a >= 1e-6 && a < 1e15) {
+        // written without exponent, the same as rounded to decimal places
+        static const double s_pow10[] = {
+            1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+            1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+        };
+        uint64_t bits;
+        memcpy(&bits, &a, sizeof(bits));
+        int k = schubfachLog10Pow2((int)(bits >> 52) - 1023);
+        if (a >= s_pow10[k + 7]) k++;
+        if (k < digits && digits - 1 - k <= 17) return dtoa_fixed(value, digits - 1 - k, buffer);
+    }
+    int sign = 0;
+    if (value < 0) {
+        *buffer++ = '-';
+        value = -value;
+        sign = 1;
+    }
+    uint64_t f;
+    int e, side;
+    schubfachShortest(value, &f, &e, &side);
+    int drop = schubfachDigitCount(f) - digits;
+    if (drop > 0) {
+        static const uint64_t s_pow10[] = {
+            1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000,
+            10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+            1000000000000000ULL, 10000000000000000ULL
+        };
+        uint64_t p10 = s_pow10[drop];
+        uint64_t rest = f % p10, half = p10 / 2;
+        f /= p10;
+        if (rest > half || (rest == half && (side > 0 || (side == 0 && (f & 1))))) f++;
+        e += drop;
+        schubfachStripZeros(&f, &e);
+    }
+    return sign + schubfachWrite(buffer, f, e);
 }
 
-inline void dtoa_milo(double value, char* buffer) {
-	// Not handling NaN and inf
-	assert(!isnan(value));
-	assert(!isinf(value));
+} // namespace zjson
 
-	if (value == 0) {
-		buffer[0] = '0';
-        buffer[1] = '\0';
-	}
-	else {
-		if (value < 0) {
-			*buffer++ = '-';
-			value = -value;
-		}
-		int length, K;
-		Grisu2(value, buffer, &length, &K);
-		Prettify(buffer, length, K);
-	}
-}
 
 // #include "serialize.h"
 
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
+
 namespace zjson {
 
+#define ZJSON_WRITER_CAPACITY           256     // initial capacity of the string of a StringWriter
+#define ZJSON_STREAM_BUFFER_SIZE        65536   // buffer of a StreamWriter
+#define ZJSON_INDENT_BUFFER_SIZE        256     // tabs or spaces written at once
+#define ZJSON_CANONICAL_SCRATCH_SIZE    2048    // stack memory of a canonical dump, before the heap
+#define ZJSON_SHAPE_ORDER_CACHE_SIZE    64      // sorted shapes cached in a canonical dump
+#define ZJSON_PARALLEL_BATCHES          8       // per thread, a thread done early takes more of them
+
+enum NumberMode {
+    NUMBER_SHORTEST,    // the shortest digits that read back to the same double
+    NUMBER_FIXED,       // rounded to a number of decimal places
+    NUMBER_PRECISION,   // at most a number of significant digits
+    NUMBER_FLOAT32,     // the shortest digits that read back to the same float
+    NUMBER_ECMASCRIPT   // the shortest digits as ECMAScript writes them, 1e+21
+};
+// How a dump writes doubles, integers are always written in full
+struct NumberFormat {
+    NumberMode mode;
+    int digits;         // decimal places for NUMBER_FIXED, significant digits for NUMBER_PRECISION
+    NumberFormat(NumberMode mode = NUMBER_SHORTEST, int digits = 0) : mode(mode), digits(digits) {}
+};
+
+// Writers keep their state in the instance only, threads could dump at the same time
 template <typename T>
 class Writer : public T {
 public:
+    inline Writer() : T(), _error(ERROR_NO_ERROR) {}
     template <typename I>
-    inline Writer(I& init) : T(init) {}
+    inline Writer(I& init) : T(init), _error(ERROR_NO_ERROR) {}
     template <typename I, typename J>
-    inline Writer(I& init1, J& init2) : T(init1, init2) {}
+    inline Writer(I& init1, J& init2) : T(init1, init2), _error(ERROR_NO_ERROR) {}
+    inline void setNumberFormat(const NumberFormat& format) { _numbers = format; }
+    inline const NumberFormat& getNumberFormat() const { return _numbers; }
+    // a dump that couldn't go on records why and stops, the output is incomplete then.
+    // ERROR_OUT_OF_MEMORY if a deep document needed more memory, or an error of T.
+    inline void fail(int error) {
+        if (_error == ERROR_NO_ERROR) _error = error;
+    }
+    inline int getError() const { return _error != ERROR_NO_ERROR ? _error : T::getError(); }
+    // a hint of the bytes to be written next
+    inline void reserve(size_t l) { T::reserve(l); }
     inline void puts(const char* pStr, size_t l) { T::puts(pStr, l); }
     inline void putc(char c) { T::putc(c); }
     inline void writeNumber(double d) {
-        static char buffer[25];
+        if (ZJSON_UNLIKELY(_numbers.mode != NUMBER_SHORTEST)) {
+            char buffer[32];
+            int length;
+            switch (_numbers.mode) {
+            case NUMBER_FIXED: length = dtoa_fixed(d, _numbers.digits, buffer); break;
+            case NUMBER_PRECISION: length = dtoa_precision(d, _numbers.digits, buffer); break;
+            case NUMBER_ECMASCRIPT: length = dtoa_ecmascript(d, buffer); break;
+            default: length = dtoa_float32(d, buffer); break;
+            }
+            puts(buffer, length);
+            return;
+        }
+#ifdef ZJSON_USE_DTOA_MILO
+        char buffer[32];
         dtoa_milo(d, buffer);
         puts(buffer, strlen(buffer));
+#else
+        char buffer[32];
+        puts(buffer, dtoa_schubfach(d, buffer));
+#endif
     }
     inline void writeInt(int32_t n) {
-        static char buffer[10];
+        char buffer[12];
         char* end = i32toa(n, buffer);
         puts(buffer, end - buffer);
     }
@@ -1087,30 +3254,70 @@ public:
         static const char* s_to_hex = "0123456789abcdef";
         const char* s = str;
         putc('"');
-        while (*s) {
+        for (;;) {
+            const char* run = s;
+            s = skipUnescaped(s);
+            if (s != run) puts(run, s - run); // the clean run in one copy
             uint8_t c = *s++;
-            if (c >= ' ' && c != '"' && c != '\\')
-                putc(c);
+            if (!c) break;
+            char escape = escapeTable()[c];
+            if (escape != 'u') {
+                char buffer[2] = { '\\', escape };
+                puts(buffer, 2);
+            }
             else {
-                putc('\\');
-                switch (c) {
-                case '\b': putc('b'); break;
-                case '\r': putc('r'); break;
-                case '\t': putc('t'); break;
-                case '\f': putc('f'); break;
-                case '\n': putc('n'); break;
-                case '\\': putc('\\'); break;
-                case '\"': putc('\"'); break;
-                default:
-                    puts("u00", 3);
-                    putc(s_to_hex[c >> 4]);
-                    putc(s_to_hex[c & 0xF]);
-                    break;
-                }
+                char buffer[6] = { '\\', 'u', '0', '0', s_to_hex[c >> 4], s_to_hex[c & 0xF] };
+                puts(buffer, 6);
             }
         }
         putc('"');
     }
+private:
+    NumberFormat _numbers;
+    int _error;
+
+    // the character after a backslash to escape a byte, 'u' for \u00XX, 0 if not escaped
+    static const char* escapeTable() {
+        static const char s_escapes[256] = {
+            'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+            'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+            0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,
+        };
+        return s_escapes;
+    }
+    // the first byte to escape or the terminating zero
+    ZJSON_NO_SANITIZE_ADDRESS static inline const char* skipUnescaped(const char* s) {
+        const char* escapes = escapeTable();
+#ifdef ZJSON_SSE2
+        for (; (uintptr_t)s & 15; s++) {
+            if (escapes[(uint8_t)*s]) return s;
+        }
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        const __m128i control = _mm_set1_epi8(0x1F);
+        for (;; s += 16) {
+            __m128i x = _mm_load_si128((const __m128i*)s);
+            __m128i m = _mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, backslash));
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_max_epu8(x, control), control)); // x <= 0x1F, zero included
+            int mask = _mm_movemask_epi8(m);
+            if (mask) {
+#ifdef _MSC_VER
+                unsigned long offset;
+                _BitScanForward(&offset, mask);
+                return s + offset;
+#else
+                return s + __builtin_ctz(mask);
+#endif
+            }
+        }
+#else
+        while (!escapes[(uint8_t)*s]) s++;
+        return s;
+#endif
+    }
 };
 
 class BufferWriter {
@@ -1120,7 +3327,9 @@ public:
     {
     }
     inline size_t size() const { return _dst - _head; }
+    inline int getError() const { return ERROR_NO_ERROR; } // a short buffer is told by size()
     inline void reset() { _dst = _head; }
+    inline void reserve(size_t) {}
     inline void puts(const char* str, size_t l) {
         if (_dst + l <= _end)
             memcpy(_dst, str, l);
@@ -1130,18 +3339,47 @@ public:
         if (_dst < _end) *_dst = c;
         _dst++;
     }
-    inline void writeTabs(size_t n) {
-        if (_dst + n <= _end)
-            memset(_dst, '\t', n);
-        _dst += n;
-    }
 private:
     char* _dst;
     char* _head;
     char* _end;
 };
 
-#define ZJSON_WRITER_CAPACITY  256
+// Counts the bytes only, to measure the output
+class CountingWriter {
+public:
+    inline CountingWriter() : _size(0) {}
+    inline size_t size() const { return _size; }
+    inline int getError() const { return ERROR_NO_ERROR; }
+    inline void reset() { _size = 0; }
+    inline void reserve(size_t) {}
+    inline void puts(const char*, size_t l) { _size += l; }
+    inline void putc(char) { _size++; }
+private:
+    size_t _size;
+};
+
+// Counts the bytes of everything but doubles, which count as the most they could take.
+// An upper bound of the output without formatting a single double.
+class BoundingWriter : public CountingWriter {};
+
+// the most bytes a double could be written in, from its binary exponent alone. between
+// 1 and 1e21 it's the integer digits or 17 digits and a point, 25 bytes at most otherwise:
+// a sign, 17 digits, "0." and 5 zeros, or a point and an exponent of "e-" and 3 digits.
+inline int numberBound(double d, const NumberFormat& format) {
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    int e2 = (int)((bits >> 52) & 0x7FF) - 1023;
+    int integers = e2 < 0 ? 1 : schubfachLog10Pow2(e2 + 1) + 1; // |d| < 2^(e2 + 1) < 10^integers
+    if (format.mode == NUMBER_FIXED && integers + format.digits <= 15) // not in the shortest form
+        return 2 + integers + (format.digits > 0 ? format.digits : 0);
+    if (e2 >= 0 && integers <= 21) return 1 + (integers > 18 ? integers : 18);
+    return 25;
+}
+
+template <>
+inline void Writer<BoundingWriter>::writeNumber(double d) { puts(nullptr, numberBound(d, _numbers)); }
+
 class StringWriter {
 public:
     inline StringWriter(std::string& buffer)
@@ -1152,132 +3390,784 @@ public:
         _buffer.clear();
     }
     inline size_t size() const { return _buffer.size(); }
+    inline int getError() const { return ERROR_NO_ERROR; }
     inline void reset() { _buffer.clear(); }
+    inline void reserve(size_t l) { _buffer.reserve(_buffer.size() + l); }
     inline void puts(const char* str, size_t l) { _buffer.insert(_buffer.end(), str, str + l); }
     inline void putc(char c) { _buffer.push_back(c); }
-    inline void writeTabs(size_t n) { _buffer.insert(_buffer.end(), n, '\t'); }
 private:
     std::string& _buffer;
 };
 
-template <typename T>
-void Value::dump(T& out, bool formatted, int indent) const
+// Where a StreamWriter flushes to, a file descriptor, a FILE* or a callback which
+// returns false on failure.
+struct Sink {
+    typedef bool (*Callback)(void* context, const char* data, size_t size);
+    static Sink fromFd(int fd) {
+        return Sink { KIND_FD, fd, nullptr, nullptr, nullptr };
+    }
+    static Sink fromFile(FILE* file) {
+        return Sink { KIND_FILE, -1, file, nullptr, nullptr };
+    }
+    static Sink fromCallback(Callback callback, void* context = nullptr) {
+        return Sink { KIND_CALLBACK, -1, nullptr, callback, context };
+    }
+    enum Kind { KIND_FD, KIND_FILE, KIND_CALLBACK } kind;
+    int fd;
+    FILE* file;
+    Callback callback;
+    void* context;
+};
+
+// Writes through a fixed buffer to a sink, the memory used doesn't depend on the size
+// of the output. After an I/O error nothing is written anymore, see getError().
+class StreamWriter {
+public:
+    inline StreamWriter(const Sink& sink)
+        : _sink(sink), _pos(_buffer), _written(0), _error(ERROR_NO_ERROR), _errno(0) {}
+    inline size_t size() const { return _written + (_pos - _buffer); }
+    inline void reserve(size_t) {}
+    inline void puts(const char* str, size_t l) {
+        if (ZJSON_LIKELY(l <= (size_t)(_buffer + ZJSON_STREAM_BUFFER_SIZE - _pos))) {
+            memcpy(_pos, str, l);
+            _pos += l;
+        }
+        else if (l < ZJSON_STREAM_BUFFER_SIZE / 2) {
+            flush();
+            memcpy(_pos, str, l);
+            _pos += l;
+        }
+        else { // a long string goes out together with the buffer
+            write(str, l);
+        }
+    }
+    inline void putc(char c) {
+        if (ZJSON_UNLIKELY(_pos == _buffer + ZJSON_STREAM_BUFFER_SIZE)) flush();
+        *_pos++ = c;
+    }
+    // write out the buffer, returns ERROR_NO_ERROR or ERROR_IO
+    int flush() {
+        write(nullptr, 0);
+        if (_error == ERROR_NO_ERROR && _sink.kind == Sink::KIND_FILE && fflush(_sink.file) != 0)
+            fail();
+        return _error;
+    }
+    inline int getError() const { return _error; }
+    // errno of the failed call, 0 if a callback failed
+    inline int getErrno() const { return _errno; }
+private:
+    Sink _sink;
+    char* _pos;
+    size_t _written;
+    int _error, _errno;
+    char _buffer[ZJSON_STREAM_BUFFER_SIZE];
+
+    // write the buffer and then data, the buffer is empty afterwards
+    void write(const char* data, size_t size) {
+        size_t buffered = _pos - _buffer;
+        _pos = _buffer;
+        if (_error != ERROR_NO_ERROR || (!buffered && !size)) return;
+        _written += buffered + size;
+        switch (_sink.kind) {
+        case Sink::KIND_FD:
+#if defined(_WIN32)
+            if (!writeFd(_buffer, buffered) || !writeFd(data, size)) fail();
+#else
+            {
+                struct iovec iov[2] = { { _buffer, buffered }, { (void*)data, size } };
+                int count = 2, first = buffered ? 0 : 1;
+                while (first < count) {
+                    ssize_t n = ::writev(_sink.fd, iov + first, count - first);
+                    if (n < 0) {
+                        if (errno == EINTR) continue;
+                        fail();
+                        return;
+                    }
+                    while (first < count && (size_t)n >= iov[first].iov_len) n -= iov[first++].iov_len;
+                    if (first < count) {
+                        iov[first].iov_base = (char*)iov[first].iov_base + n;
+                        iov[first].iov_len -= n;
+                    }
+                }
+            }
+#endif
+            break;
+        case Sink::KIND_FILE:
+            if ((buffered && fwrite(_buffer, 1, buffered, _sink.file) != buffered) ||
+                (size && fwrite(data, 1, size, _sink.file) != size))
+                fail();
+            break;
+        case Sink::KIND_CALLBACK:
+            if ((buffered && !_sink.callback(_sink.context, _buffer, buffered)) ||
+                (size && !_sink.callback(_sink.context, data, size))) {
+                errno = 0;
+                fail();
+            }
+            break;
+        }
+    }
+#if defined(_WIN32)
+    bool writeFd(const char* data, size_t size) {
+        while (size) {
+            int n = _write(_sink.fd, data, size > 0x40000000 ? 0x40000000 : (unsigned)size);
+            if (n < 0) return false;
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+#endif
+    void fail() {
+        _error = ERROR_IO;
+        _errno = errno;
+    }
+};
+
+// The layout of a dump, compact, indented with tabs (formatted = true) or with spaces
+struct DumpStyle {
+    bool formatted;
+    int spaces;         // 0 for tabs
+    bool canonical;     // RFC 8785, compact with sorted names and ECMAScript numbers
+    bool verbatim;      // compact, unmodified containers copied from the input
+    DumpStyle(bool formatted = true) : formatted(formatted), spaces(0), canonical(false), verbatim(false) {}
+    static DumpStyle indent(int spaces) {
+        DumpStyle style(spaces > 0);
+        style.spaces = spaces;
+        return style;
+    }
+    // byte-stable output for hashing and comparing documents
+    static DumpStyle rfc8785() {
+        DumpStyle style(false);
+        style.canonical = true;
+        return style;
+    }
+    // for a document parsed with PARSE_KEEP_SOURCE, only what was modified is written anew,
+    // the rest keeps its original text and whitespace. other values are dumped compact.
+    static DumpStyle roundTrip() {
+        DumpStyle style(false);
+        style.verbatim = true;
+        return style;
+    }
+};
+
+// an open container while dumping, the next member or element to write
+struct DumpFrame {
+    const Node* node;
+    const Value* values;        // of a shaped or sorted object
+    char* const* names;
+    uint32_t remaining;
+    bool isObject;
+    Allocator::Marker mark;     // of the scratch memory of a sorted object
+};
+
+// a member or element of an object or array, in the order it is written
+struct DumpChild {
+    char* name;
+    const Value* value;
+};
+
+// Layout policies of Value::dumpWith, the compact one has no formatting branches at all
+struct CompactFormat {
+    template <typename T> inline bool copy(T&, const Value&) const { return false; }
+    inline bool sort(DumpFrame&, const Value&) const { return true; }
+    inline void release(const DumpFrame&) const {}
+    template <typename T> inline void newline(T&) const {}
+    template <typename T> inline void indent(T&, int) const {}
+    template <typename T> inline void comma(T& out) const { out.putc(','); }
+    template <typename T> inline void colon(T& out) const { out.putc(':'); }
+    template <typename T> inline void empty(T& out, char open, char close) const {
+        char buffer[2] = { open, close };
+        out.puts(buffer, 2);
+    }
+};
+
+// Indents with runs of a precomputed buffer of tabs or spaces
+class PrettyFormat {
+public:
+    static PrettyFormat tabs() { return PrettyFormat(indentBuffers().tabs, 1); }
+    static PrettyFormat spaces(int width) { return PrettyFormat(indentBuffers().spaces, width); }
+    template <typename T> inline bool copy(T&, const Value&) const { return false; }
+    inline bool sort(DumpFrame&, const Value&) const { return true; }
+    inline void release(const DumpFrame&) const {}
+    template <typename T> inline void newline(T& out) const { out.putc('\n'); }
+    template <typename T> inline void indent(T& out, int depth) const {
+        size_t n = (size_t)depth * _width;
+        for (; n > ZJSON_INDENT_BUFFER_SIZE; n -= ZJSON_INDENT_BUFFER_SIZE)
+            out.puts(_buffer, ZJSON_INDENT_BUFFER_SIZE);
+        out.puts(_buffer, n);
+    }
+    template <typename T> inline void comma(T& out) const { out.puts(", ", 2); }
+    template <typename T> inline void colon(T& out) const { out.puts(" : ", 3); }
+    template <typename T> inline void empty(T& out, char open, char close) const {
+        char buffer[3] = { open, ' ', close };
+        out.puts(buffer, 3);
+    }
+private:
+    struct IndentBuffers {
+        char tabs[ZJSON_INDENT_BUFFER_SIZE];
+        char spaces[ZJSON_INDENT_BUFFER_SIZE];
+        IndentBuffers() {
+            memset(tabs, '\t', sizeof(tabs));
+            memset(spaces, ' ', sizeof(spaces));
+        }
+    };
+    static const IndentBuffers& indentBuffers() {
+        static const IndentBuffers s_buffers;
+        return s_buffers;
+    }
+    PrettyFormat(const char* buffer, int width) : _buffer(buffer), _width(width) {}
+
+    const char* _buffer;
+    size_t _width;
+};
+
+// <0, 0 or >0 as the names compare in UTF-16 code units. UTF-8 bytes are in the order of
+// code points, which differs only between U+E000-U+FFFF (lead bytes EE-EF) and the
+// supplementary characters (lead bytes F0-F4), surrogate pairs in UTF-16.
+inline int compareUtf16(const char* a, const char* b) {
+    const uint8_t* x = (const uint8_t*)a;
+    const uint8_t* y = (const uint8_t*)b;
+    while (*x == *y && *x) {
+        x++;
+        y++;
+    }
+    if (*x >= 0xEE && *y >= 0xEE && (*x >= 0xF0) != (*y >= 0xF0))
+        return *x >= 0xF0 ? -1 : 1;
+    return (int)*x - (int)*y;
+}
+
+// RFC 8785: compact, the members of an object sorted by their names. An object is dumped
+// from sorted copies of its names and values in a scratch allocator, released when it is
+// closed, the DOM is not modified. The order of a shape is computed once per dump.
+class CanonicalFormat : public CompactFormat {
+public:
+    // the memory of a canonical dump, the first blocks are on the stack
+    class Scratch {
+    public:
+        Scratch()
+            : _members(defaultBlockPolicy(), defaultResource(), _membersBuffer, sizeof(_membersBuffer)),
+            _orders(defaultBlockPolicy(), defaultResource(), _ordersBuffer, sizeof(_ordersBuffer))
+        {
+            memset(_cache, 0, sizeof(_cache));
+        }
+    private:
+        friend class CanonicalFormat;
+        struct ShapeOrder {
+            const Shape* shape;
+            char** names;       // sorted
+            uint32_t* indices;  // of the values in the order of the names
+            bool ordered;       // the names of the shape are in order already
+        };
+        Allocator _members;     // per object
+        Allocator _orders;      // per shape, for the whole dump
+        ShapeOrder _cache[ZJSON_SHAPE_ORDER_CACHE_SIZE];
+        char _membersBuffer[ZJSON_CANONICAL_SCRATCH_SIZE];
+        char _ordersBuffer[ZJSON_CANONICAL_SCRATCH_SIZE];
+    };
+    explicit CanonicalFormat(Scratch& scratch) : _scratch(&scratch) {}
+
+    // false if out of memory
+    inline bool sort(DumpFrame& frame, const Value& object) const {
+        Allocator& members = _scratch->_members;
+        frame.mark = members.mark();
+        // an object already in order is written as it is
+        if (object.isShaped()) {
+            ShapedObject* shaped = object.toShaped();
+            const Value* source = shaped->values();
+            const Scratch::ShapeOrder* order = shapeOrder(shaped->shape, source);
+            if (ZJSON_UNLIKELY(!order)) return false;
+            if (order->ordered) return true;
+            Value* values = allocate<Value>(members, shaped->shape->length);
+            if (ZJSON_UNLIKELY(!values)) return false;
+            for (uint32_t i = 0; i < shaped->shape->length; i++) values[i] = source[order->indices[i]];
+            frame.names = order->names;
+            frame.values = values;
+            return true;
+        }
+        uint32_t length = 1;
+        bool ordered = true;
+        for (const Node* node = frame.node; node->next; node = node->next, length++) {
+            if (ordered && compareUtf16(node->name, node->next->name) > 0) ordered = false;
+        }
+        if (ordered) return true;
+        DumpChild* sorted = allocate<DumpChild>(members, length);
+        char** names = allocate<char*>(members, length);
+        Value* values = allocate<Value>(members, length);
+        if (ZJSON_UNLIKELY(!sorted || !names || !values)) return false;
+        DumpChild* m = sorted;
+        for (const Node* node = frame.node; node; node = node->next, m++) {
+            m->name = node->name;
+            m->value = &node->value;
+        }
+        std::sort(sorted, sorted + length, less);
+        for (uint32_t i = 0; i < length; i++) {
+            names[i] = sorted[i].name;
+            values[i] = *sorted[i].value;
+        }
+        frame.node = nullptr;
+        frame.names = names;
+        frame.values = values;
+        frame.remaining = length;
+        return true;
+    }
+    inline void release(const DumpFrame& frame) const {
+        if (frame.isObject) _scratch->_members.rewind(frame.mark);
+    }
+    static bool less(const DumpChild& a, const DumpChild& b) {
+        return compareUtf16(a.name, b.name) < 0;
+    }
+private:
+    template <typename U>
+    static U* allocate(Allocator& allocator, size_t count) {
+        return (U*)allocator.allocate((count ? count : 1) * sizeof(U));
+    }
+    // cached by the address of the shape, a slot taken by another shape is not replaced so
+    // the memory stays bounded by the number of shapes. nullptr if out of memory.
+    const Scratch::ShapeOrder* shapeOrder(const Shape* shape, const Value* values) const {
+        Scratch::ShapeOrder& slot = _scratch->_cache[((uintptr_t)shape >> 3) & (ZJSON_SHAPE_ORDER_CACHE_SIZE - 1)];
+        if (ZJSON_LIKELY(slot.shape == shape)) return &slot;
+        bool cached = !slot.shape;
+        Allocator& allocator = cached ? _scratch->_orders : _scratch->_members;
+        uint32_t length = shape->length;
+        DumpChild* sorted = allocate<DumpChild>(_scratch->_members, length);
+        Scratch::ShapeOrder order = { shape, allocate<char*>(allocator, length), allocate<uint32_t>(allocator, length), true };
+        if (ZJSON_UNLIKELY(!sorted || !order.names || !order.indices)) return nullptr;
+        for (uint32_t i = 0; i < length; i++) {
+            sorted[i].name = shape->names()[i];
+            sorted[i].value = values + i;
+        }
+        std::sort(sorted, sorted + length, less);
+        for (uint32_t i = 0; i < length; i++) {
+            order.names[i] = sorted[i].name;
+            order.indices[i] = (uint32_t)(sorted[i].value - values);
+            if (order.indices[i] != i) order.ordered = false;
+        }
+        if (cached) {
+            slot = order;
+            return &slot;
+        }
+        _miss = order;
+        return &_miss;
+    }
+
+    Scratch* _scratch;
+    mutable Scratch::ShapeOrder _miss;
+};
+
+// Compact, a container not modified since it was parsed is copied from the input
+class SourceFormat : public CompactFormat {
+public:
+    explicit SourceFormat(const SourceSpans& sources) : _sources(&sources) {}
+    template <typename T> inline bool copy(T& out, const Value& container) const {
+        size_t length;
+        const char* text = _sources->find(container, &length);
+        if (!text) return false;
+        out.puts(text, length);
+        return true;
+    }
+private:
+    const SourceSpans* _sources;
+};
+
+// Calls run with the layout policy of a style, sources are the spans of a document
+// parsed with PARSE_KEEP_SOURCE
+template <typename R>
+inline void withDumpFormat(const DumpStyle& style, R& run, const SourceSpans* sources = nullptr)
+{
+    if (style.verbatim && sources)
+        run(SourceFormat(*sources));
+    else if (style.canonical) {
+        CanonicalFormat::Scratch scratch;
+        run(CanonicalFormat(scratch));
+    }
+    else if (!style.formatted)
+        run(CompactFormat());
+    else if (style.spaces)
+        run(PrettyFormat::spaces(style.spaces));
+    else
+        run(PrettyFormat::tabs());
+}
+
+template <typename T>
+struct DumpValue {
+    T& out;
+    const Value* value;
+    template <typename F> void operator()(const F& format) const { value->dumpWith(out, format); }
+};
+
+template <typename T>
+void Value::dump(T& out, const DumpStyle& style, const SourceSpans* sources) const
+{
+    if (style.canonical) out.setNumberFormat(NumberFormat(NUMBER_ECMASCRIPT));
+    DumpValue<T> run = { out, this };
+    withDumpFormat(style, run, sources);
+}
+
+// A run of the children of the root in a parallel dump, written to a chunk of its own
+struct DumpBatch {
+    Writer<StringWriter>& out;
+    const DumpChild* begin;
+    const DumpChild* end;
+    bool isObject;
+    template <typename F> void operator()(const F& format) const {
+        for (const DumpChild* child = begin; child != end; child++) {
+            if (child != begin) {
+                format.comma(out);
+                format.newline(out);
+            }
+            format.indent(out, 1);
+            if (isObject) {
+                out.writeEscaped(child->name);
+                format.colon(out);
+            }
+            child->value->dumpWith(out, format, 1);
+        }
+    }
+};
+
+// The brackets of the root and what goes between its chunks, as the layout writes them
+struct DumpJoin {
+    Writer<StringWriter>& open;
+    Writer<StringWriter>& separator;
+    Writer<StringWriter>& close;
+    bool isObject;
+    template <typename F> void operator()(const F& format) const {
+        open.putc(isObject ? '{' : '[');
+        format.newline(open);
+        format.comma(separator);
+        format.newline(separator);
+        format.newline(close);
+        close.putc(isObject ? '}' : ']');
+    }
+};
+
+// The members or elements of the root are dumped in batches on threads, each into a chunk.
+// The thread that completes the next chunk in order writes it out with the completed ones
+// after it, and frees them, so only the chunks ahead of a slower one are held. out is
+// written from the dumping threads, one at a time. Other values and roots with less than
+// two children are dumped on the calling thread.
+template <typename T>
+void Value::dumpParallel(T& out, const DumpStyle& style, unsigned threads, const SourceSpans* sources) const
+{
+    if (!threads) threads = std::thread::hardware_concurrency();
+    Type type = getType();
+    std::vector<DumpChild> children;
+    size_t length;
+    if (style.verbatim && sources && sources->find(*this, &length))
+        threads = 1; // a single copy
+    if (threads > 1 && (type == JSON_ARRAY || type == JSON_OBJECT)) {
+        if (isShaped()) {
+            ShapedObject* object = toShaped();
+            children.resize(object->shape->length);
+            for (uint32_t i = 0; i < object->shape->length; i++) {
+                children[i].name = object->shape->names()[i];
+                children[i].value = &object->values()[i];
+            }
+        }
+        else {
+            for (const Node* node = toNode(); node; node = node->next) {
+                DumpChild child = { node->name, &node->value };
+                children.push_back(child);
+            }
+        }
+    }
+    if (children.size() < 2) {
+        dump(out, style, sources);
+        return;
+    }
+    bool isObject = type == JSON_OBJECT;
+    if (style.canonical) {
+        out.setNumberFormat(NumberFormat(NUMBER_ECMASCRIPT));
+        if (isObject) std::sort(children.begin(), children.end(), CanonicalFormat::less);
+    }
+
+    std::string open, separator, close;
+    Writer<StringWriter> openWriter(open), separatorWriter(separator), closeWriter(close);
+    DumpJoin join = { openWriter, separatorWriter, closeWriter, isObject };
+    withDumpFormat(style, join, sources);
+    out.puts(open.data(), open.size());
+
+    size_t count = children.size();
+    size_t batches = (std::min)(count, (size_t)threads * ZJSON_PARALLEL_BATCHES);
+    std::vector<std::string> chunks(batches);
+    std::vector<char> done(batches, 0);
+    size_t written = 0; // chunks written to out, guarded by the lock with done
+    std::mutex lock;
+    std::atomic<size_t> next(0);
+    std::atomic<int> failure(ERROR_NO_ERROR);
+    NumberFormat numbers = out.getNumberFormat();
+    auto dumpBatches = [&]() {
+        for (size_t b = next++; b < batches; b = next++) {
+            Writer<StringWriter> writer(chunks[b]);
+            writer.setNumberFormat(numbers);
+            DumpBatch run = { writer, &children[count * b / batches], &children[0] + count * (b + 1) / batches, isObject };
+            withDumpFormat(style, run, sources);
+            if (ZJSON_UNLIKELY(writer.getError() != ERROR_NO_ERROR)) {
+                failure = writer.getError();
+                next = batches; // the chunks after it are not written
+                return;
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            done[b] = 1;
+            for (; written < batches && done[written]; written++) {
+                if (written) out.puts(separator.data(), separator.size());
+                out.puts(chunks[written].data(), chunks[written].size());
+                std::string().swap(chunks[written]);
+            }
+        }
+    };
+#ifdef ZJSON_HAS_EXCEPTIONS
+    std::vector<std::exception_ptr> errors(threads);
+    auto work = [&](unsigned worker) {
+        try {
+            dumpBatches();
+        }
+        catch (...) {
+            errors[worker] = std::current_exception();
+            next = batches;
+        }
+    };
+    std::vector<std::thread> workers;
+    try {
+        for (unsigned i = 1; i < threads; i++) workers.push_back(std::thread(work, i));
+    }
+    catch (const std::system_error&) {
+        // fewer threads, the calling one takes the rest
+    }
+    work(0);
+    for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+    for (size_t i = 0; i < errors.size(); i++) {
+        if (errors[i]) std::rethrow_exception(errors[i]);
+    }
+#else
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; i++) workers.push_back(std::thread(dumpBatches));
+    dumpBatches();
+    for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+#endif
+    if (ZJSON_UNLIKELY(failure != ERROR_NO_ERROR)) {
+        out.fail(failure);
+        return;
+    }
+    out.puts(close.data(), close.size());
+}
+
+// Iterative, the open containers are on an explicit stack. depth is the indentation of
+// the value, for the children of a parallel dump.
+template <typename T, typename F>
+void Value::dumpWith(T& out, const F& format, int depth) const
 {
-    switch (getType()) {
-    case JSON_NUMBER:
-        out.writeNumber(toNumber());
-        break;
-    case JSON_INT:
-        out.writeInt(toInt());
-        break;
-    case JSON_STRING:
-        out.writeEscaped(toString());
-        break;
-    case JSON_ARRAY:
-        if (!toNode()) {
-            static const char* s_empty_array[4] = { "[]", "[ ]" };
-            out.puts(s_empty_array[formatted], 2 + formatted);
+    DepthStack<DumpFrame> stack;
+    int top = -1;
+    const Value* value = this;
+    for (;;) {
+        Type type = value->getType();
+        switch (type) {
+        case JSON_NUMBER:
+            out.writeNumber(value->toNumber());
+            break;
+        case JSON_INT:
+            out.writeInt(value->toInt());
             break;
+        case JSON_STRING:
+            out.writeEscaped(value->toString());
+            break;
+        case JSON_ARRAY:
+        case JSON_OBJECT: {
+            bool isObject = type == JSON_OBJECT;
+            if (format.copy(out, *value)) break;
+            if (!value->isShaped() && !value->toNode()) {
+                if (isObject) format.empty(out, '{', '}');
+                else format.empty(out, '[', ']');
+                break;
+            }
+            if (ZJSON_UNLIKELY(!stack.reserve(++top))) {
+                out.fail(ERROR_OUT_OF_MEMORY);
+                return;
+            }
+            DumpFrame& frame = stack[top];
+            if (value->isShaped()) {
+                ShapedObject* object = value->toShaped();
+                frame.node = nullptr;
+                frame.values = object->values();
+                frame.names = object->shape->names();
+                frame.remaining = object->shape->length;
+            }
+            else {
+                frame.node = value->toNode();
+                frame.values = nullptr;
+            }
+            frame.isObject = isObject;
+            if (isObject && ZJSON_UNLIKELY(!format.sort(frame, *value))) {
+                out.fail(ERROR_OUT_OF_MEMORY);
+                return;
+            }
+            out.putc(isObject ? '{' : '[');
+            format.newline(out);
+            value = dumpNext(out, format, frame, depth + top + 1);
+            continue;
         }
-        out.putc('[');
-        if (formatted) out.putc('\n');
-        indent++;
-        for (Node* n = toNode(); n; n = n->next) {
-            if (formatted) out.writeTabs(indent);
-            n->value.dump(out, formatted, indent);
-            if (n->next) {
-                out.putc(',');
-                if (formatted) out.putc(' ');
-            }
-            if (formatted) out.putc('\n');
-        }
-        indent--;
-        if (formatted) out.writeTabs(indent);
-        out.putc(']');
-        break;
-    case JSON_OBJECT:
-        if (!toNode()) {
-            static const char* s_empty_array[4] = { "{}", "{ }" };
-            out.puts(s_empty_array[formatted], 2 + formatted);
+        case JSON_TRUE:
+            out.puts("true", 4);
             break;
+        case JSON_FALSE:
+            out.puts("false", 5);
+            break;
+        case JSON_NULL:
+            out.puts("null", 4);
+            break;
+        }
+        // the value is written, go on with the next one or close the containers
+        for (;;) {
+            if (top == -1) return;
+            DumpFrame& frame = stack[top];
+            if (frame.values ? frame.remaining != 0 : frame.node != nullptr) {
+                format.comma(out);
+                format.newline(out);
+                value = dumpNext(out, format, frame, depth + top + 1);
+                break;
+            }
+            format.newline(out);
+            format.indent(out, depth + top);
+            out.putc(frame.isObject ? '}' : ']');
+            format.release(frame);
+            top--;
         }
-        out.putc('{');
-        if (formatted) out.putc('\n');
-        indent++;
-        for (Node* n = toNode(); n; n = n->next) {
-            if (formatted) out.writeTabs(indent);
-            out.writeEscaped(n->name);
-            if (formatted)
-                out.puts(" : ", 3);
-            else
-                out.putc(':');
-            n->value.dump(out, formatted, indent);
-            if (n->next) {
-                out.putc(',');
-                if (formatted) out.putc(' ');
-            }
-            if (formatted) out.putc('\n');
-        }
-        indent--;
-        if (formatted) out.writeTabs(indent);
-        out.putc('}');
-        break;
-    case JSON_TRUE:
-        out.puts("true", 4);
-        break;
-    case JSON_FALSE:
-        out.puts("false", 5);
-        break;
-    case JSON_NULL:
-        out.puts("null", 4);
-        break;
     }
 }
 
+// write the indentation and name of the next member or element and return it
+template <typename T, typename F>
+const Value* Value::dumpNext(T& out, const F& format, DumpFrame& frame, int indent)
+{
+    format.indent(out, indent);
+    const Value* value;
+    if (frame.values) {
+        out.writeEscaped(*frame.names++);
+        format.colon(out);
+        value = frame.values++;
+        frame.remaining--;
+        return value;
+    }
+    if (frame.isObject) {
+        out.writeEscaped(frame.node->name);
+        format.colon(out);
+    }
+    value = &frame.node->value;
+    frame.node = frame.node->next;
+    return value;
+}
+
 } // namespace zjson
 
 
 // #include "wrapper.h"
 
+#include <atomic>
 #include <initializer_list>
+#include <memory>
 #include <type_traits>
 
 namespace zjson {
 
+class Json;
+
+// An element of a JSON literal (initializer list). It only records what to build,
+// the outermost Json allocates the whole tree in one pass with its own allocator.
+class JsonLiteral {
+public:
+    friend class Json;
+    JsonLiteral(Value value)
+        : _kind(KIND_VALUE), _value(value), _key(value.getType() == JSON_STRING ? value.toString() : nullptr) {}
+    JsonLiteral(bool value) : _kind(KIND_VALUE), _value(value), _key(nullptr) {}
+    JsonLiteral(nullptr_t) : _kind(KIND_VALUE), _value(JSON_NULL), _key(nullptr) {}
+    JsonLiteral(double value) : _kind(KIND_VALUE), _value(value), _key(nullptr) {}
+    JsonLiteral(int32_t value) : _kind(KIND_VALUE), _value(value), _key(nullptr) {}
+    JsonLiteral(const char* str) : _kind(KIND_STRING), _value(JSON_NULL), _key(str) {}
+    inline JsonLiteral(const Json& json);
+    // a temporary Json is moved into the literal tree instead of being copied
+    inline JsonLiteral(Json&& json);
+    JsonLiteral(std::initializer_list<JsonLiteral> list)
+        : _kind(KIND_LIST), _value(JSON_NULL), _key(nullptr), _list(list), _isObject(isObject(list)) {}
+private:
+    enum Kind {
+        KIND_VALUE,
+        KIND_STRING,
+        KIND_JSON,
+        KIND_MOVABLE_JSON,
+        KIND_LIST
+    } _kind;
+    Value _value;
+    const char* _key; // not null if the literal is a string, so it could be a member name
+    const Json* _json = nullptr;
+    std::initializer_list<JsonLiteral> _list;
+    bool _isObject = false;
+    // a list of [string, value] pairs makes an object, checked once per nested literal
+    static bool isObject(std::initializer_list<JsonLiteral> list) {
+        for (auto& literal : list) {
+            if (literal._kind != KIND_LIST || literal._list.size() != 2 || !literal._list.begin()->_key)
+                return false;
+        }
+        return true;
+    }
+};
+
+// A precompiled member name with a lookup cache. It remembers the shape and slot where
+// it was found last, so reading the same members from same-shaped objects costs a single
+// compare. The cache is one atomic word, a Key could be shared by threads. Only shaped
+// objects (PARSE_SHAPED_OBJECTS) are sped up, a node list is scanned as for a name.
+class Key {
+public:
+    friend class Json;
+    static constexpr uint64_t ID_MASK = (1ull << 57) - 1;  // bits of the shape id in the cache
+    static constexpr uint64_t SLOT_MASK = 127;              // and of the slot + 1
+    static_assert(ZJSON_SHAPE_MAX_LENGTH < SLOT_MASK, "slots of a shape must fit in the cache");
+    explicit Key(const char* name) : _name(name), _hash(hashString(name)), _cache(0) {}
+    Key(const Key& o) : _name(o._name), _hash(o._hash), _cache(o._cache.load(std::memory_order_relaxed)) {}
+    inline const char* getName() const { return _name; }
+    inline uint32_t getHash() const { return _hash; }
+private:
+    const char* _name;
+    uint32_t _hash;
+    mutable std::atomic<uint64_t> _cache; // the id of the last found shape and the slot + 1, 0 for none
+};
+
 // A wrapper class holds a Value or a Value view, with or without allocator.
 class Json {
 public:
     friend struct Value;
+    friend NodeIterator begin(Json& json);
     explicit Json(Value* value, Allocator* allocator = nullptr)
         : _value(value), _allocator(allocator)
     {
         _isValueView = _value != nullptr;
         if (!_isValueView) _value = new Value(JSON_NULL);
     }
-    // copy constructor
-    Json(const Json& o) : _allocator(o._allocator), _isValueView(o._isValueView)
+    // copy constructor, the root of a document is copied like an owned value
+    Json(const Json& o)
+        : _allocator(o._allocator), _isValueView(o._isValueView && !o._isDocument), _inCrtTree(o._inCrtTree)
     {
         if (_isValueView)
             _value = o._value;
-        else {
-            if (_allocator) { // has allocator
-                _value = new Value(o.toValue());
-            }
-            else { // no allocator + not a view, deep copy
-                _value = new Value(clone(o.toValue()));
-            }
-        }
+        else
+            _value = new Value(copy(o));
     }
-    // move constructor
+    // move constructor, the root of a document stays in it
     Json(Json&& o) noexcept
-        : _value(o._value), _allocator(o._allocator), _isValueView(o._isValueView)
+        : _value(o._value), _allocator(o._allocator), _isValueView(o._isValueView), _inCrtTree(o._inCrtTree)
     {
+        if (o._isDocument) {
+            _isValueView = false;
+            _value = new Value(copy(o));
+            return;
+        }
         o._value = nullptr;
         o._isValueView = false;
     }
     // constructors
+    // with a recycling allocator the value is copied, so it's recycled with this Json
     Json(Value value, Allocator* allocator = nullptr) : _allocator(allocator), _isValueView(false) {
-        _value = new Value(value);
+        _value = new Value(allocator && allocator->isRecycling() ? clone(value) : value);
     }
     Json(bool value, Allocator* allocator = nullptr) : _allocator(allocator), _isValueView(false) {
         _value = new Value(value);
@@ -1296,38 +4186,10 @@ public:
     {
         _value = new Value(JSON_STRING, clone(str));
     }
-    Json(std::initializer_list<Json> init, Allocator* allocator = nullptr)
+    Json(std::initializer_list<JsonLiteral> init, Allocator* allocator = nullptr)
         : _allocator(allocator), _isValueView(false)
     {
-        bool isMatchObject = true;
-        for (auto& json : init) {
-            if (json.getType() != JSON_ARRAY || json.getLength() != 2 ||
-                json.getElement(0)->value.getType() != JSON_STRING) {
-                isMatchObject = false;
-                break;
-            }
-        }
-        if (isMatchObject) {
-            Node *node, *tail = nullptr;
-            for (auto& json : init) {
-                node = (Node*)allocate(sizeof(Node));
-                char* name = json.getElement(0)->value.toString();
-                node->name = clone(name);
-                node->value = clone(json.getElement(1)->value);
-                tail = insertAfter(tail, node);
-            }
-            _value = new Value(listToValue(JSON_OBJECT, tail));
-        }
-        else {
-            Node *node, *tail = nullptr;
-            bool first = true;
-            for (auto& json : init) {
-                node = (Node*)allocate(sizeof(Node) - sizeof(char*));
-                node->value = clone(json.toValue());
-                tail = insertAfter(tail, node);
-            }
-            _value = new Value(listToValue(JSON_ARRAY, tail));
-        }
+        _value = new Value(build(init, JsonLiteral::isObject(init)));
     }
     // destructor
     virtual ~Json() {
@@ -1393,22 +4255,19 @@ public:
 
     // setters
     inline void set(Value value) {
-        destruct();
-        *_value = clone(value);
+        replace(clone(value));
     }
     inline void set(const char* value) {
         assert(value);
-        destruct();
-        *_value = Value(JSON_STRING, clone(value));
+        replace(Value(JSON_STRING, clone(value)));
     }
     inline Json& operator=(const Json& json) {
-        if (_allocator && _allocator == json._allocator) {
+        if (_allocator && _allocator == json._allocator && !_allocator->isRecycling()) {
             *_value = json.toValue();
         }
         else {
-            destruct();
-            *_value = clone(json.toValue());
-        }        
+            replace(share(json));
+        }
         return *this;
     }
     template<typename T = char>
@@ -1420,6 +4279,7 @@ public:
     // Array/Object generic functions
     inline uint32_t getLength() const {
         assert(getType() == JSON_ARRAY || getType() == JSON_OBJECT);
+        if (_value->isShaped()) return _value->toShaped()->shape->length;
         Node* n = _value->toNode();
         uint32_t l = 0;
         while (n) {
@@ -1431,8 +4291,22 @@ public:
     inline bool remove(Node* node) {
         assert(getType() == JSON_ARRAY || getType() == JSON_OBJECT);
         assert(node);
+        unshape();
         Node* n = _value->toNode();
+        uint32_t index = 0;
+        while (n && n != node) {
+            index++;
+            n = n->next;
+        }
+        if (!n) return false;
+        makeUnique(); // the node may move to a copied list
+        n = _value->toNode();
         Node* prev = nullptr;
+        for (uint32_t i = 0; i < index; i++) {
+            prev = n;
+            n = n->next;
+        }
+        node = n;
         while (n) {
             if (n == node) {
                 if (prev)
@@ -1443,6 +4317,10 @@ public:
                     node->next = nullptr;
                     freeCrtAllocatedValue(Value(getType(), node));
                 }
+                else if (_allocator->isRecycling()) {
+                    node->next = nullptr;
+                    recycle(Value(getType(), node));
+                }
                 return true;
             }
             prev = n;
@@ -1451,18 +4329,15 @@ public:
         return false;
     }
     // Array functions
+    // the node could be modified, so a document parsed with PARSE_KEEP_SOURCE marks the array
     inline Node* getElement(uint32_t index) const {
         assert(getType() == JSON_ARRAY);
-        Node* n = _value->toNode();
-        uint32_t i = 0;
-        while (n) {
-            if (index == i++) break;
-            n = n->next;
-        }
-        return n;
+        touchSource(*_value);
+        return elementAt(index);
     }
     inline Node* pushBack(Value val) {
         assert(getType() == JSON_ARRAY || (getType() == JSON_OBJECT && getLength() == 0));
+        makeUnique();
         Node* n = (Node*)allocate(sizeof(Node) - sizeof(char*));
         n->value = clone(val);
         Node* tail = _value->toNode();
@@ -1479,6 +4354,7 @@ public:
     inline Node* insertAt(uint32_t index, Value val) {
         assert(getType() == JSON_ARRAY || (getType() == JSON_OBJECT && getLength() == 0 && index == 0));
         assert(index <= getLength());
+        makeUnique();
         Node* n = (Node*)allocate(sizeof(Node) - sizeof(char*));
         n->value = clone(val);
         Node* tail = _value->toNode();
@@ -1500,19 +4376,37 @@ public:
             n->next = nullptr;
             *_value = Value(JSON_ARRAY, n);
         }
+        return n;
     }
     // Object functions
-    inline Node* findMember(const char* name) const {
+    // the first member with the name, a shaped object is converted to a node list
+    inline Node* findMember(const char* name) {
         assert(getType() == JSON_OBJECT);
-        Node* n = _value->toNode();
-        while (n) {
-            if (strcmp(n->name, name) == 0) break;
-            n = n->next;
-        }
-        return n;
+        touchSource(*_value); // the node could be modified
+        unshape(); // nodes are needed
+        return findNode(name);
+    }
+    // the value of the first member with the name, shaped objects are kept. the value could
+    // be modified, so a document parsed with PARSE_KEEP_SOURCE marks the object, the const
+    // overloads only read.
+    inline Value* findValue(const char* name) {
+        touchSource(*_value);
+        return lookupValue(name);
+    }
+    inline const Value* findValue(const char* name) const {
+        return lookupValue(name);
+    }
+    inline Value* findValue(const Key& key) {
+        touchSource(*_value);
+        return lookupValue(key);
+    }
+    inline const Value* findValue(const Key& key) const {
+        return lookupValue(key);
     }
     inline Node* addMember(const char* name, Value val) {
         assert(getType() == JSON_OBJECT);
+        unshape();
+        makeUnique();
         Node* n = (Node*)allocate(sizeof(Node));
         n->name = clone(name);
         n->value = clone(val);
@@ -1527,122 +4421,886 @@ public:
         }
         return n;
     }
-    // subscript
+    // subscript, a missing member or element is added. the containers on the way are taken
+    // as modified, a document parsed with PARSE_KEEP_SOURCE writes them anew. to read only,
+    // subscript a const Json.
     inline Json operator[](uint32_t index) {
+        makeUnique();
         if (getType() == JSON_ARRAY) {
             uint32_t length = getLength();
             if (index < length) {
-                Node* n = getElement(index);
-                return Json(&n->value, _allocator);
+                Node* n = elementAt(index);
+                return view(&n->value);
             }
             else if (index == length) { // if index == length, push back
                 Node* n = pushBack(Value(JSON_NULL));
-                return Json(&n->value, _allocator);
+                return view(&n->value);
             }
         }
         else if (index == 0 && getType() == JSON_OBJECT && getLength() == 0) {
             Node* n = pushBack(Value(JSON_NULL));
-            return Json(&n->value, _allocator);
+            return view(&n->value);
         }
         return Json(nullptr);
     }
     template<typename T = char> // to prevent zero's ambiguous
     inline Json operator[](const T* name) {
         if (getType() == JSON_OBJECT) {
-            Node* n = findMember(name);
-            if (!n) {
-                n = addMember(name, Value(JSON_NULL));
+            makeUnique();
+            Value* v = lookupValue(name);
+            if (!v) {
+                v = &addMember(name, Value(JSON_NULL))->value;
+            }
+            return view(v);
+        }
+        return Json(nullptr);
+    }
+    inline Json operator[](const Key& key) {
+        if (getType() == JSON_OBJECT) {
+            makeUnique();
+            Value* v = lookupValue(key);
+            if (!v) {
+                v = &addMember(key._name, Value(JSON_NULL))->value;
             }
-            return Json(&n->value, _allocator); // RVO
+            return view(v);
         }
         return Json(nullptr);
     }
-    // dump
-    bool dump(char* buffer, size_t bufferSize, size_t* pSize = nullptr, bool formatted = true) {
+    // read-only subscripts, a missing member or element reads as null. nothing is added or
+    // copied, and a document parsed with PARSE_KEEP_SOURCE keeps the text of what is read.
+    inline const Json operator[](uint32_t index) const {
+        Node* n = getType() == JSON_ARRAY ? elementAt(index) : nullptr;
+        return n ? view(&n->value) : Json(nullptr);
+    }
+    template<typename T = char>
+    inline const Json operator[](const T* name) const {
+        Value* v = getType() == JSON_OBJECT ? lookupValue(name) : nullptr;
+        return v ? view(v) : Json(nullptr);
+    }
+    inline const Json operator[](const Key& key) const {
+        Value* v = getType() == JSON_OBJECT ? lookupValue(key) : nullptr;
+        return v ? view(v) : Json(nullptr);
+    }
+    // convert a shaped object to a node list, for the node based interface
+    inline void unshape() {
+        if (!_value->isShaped()) return;
+        assert(_allocator); // shaped objects only live in a document
+        touchSource(*_value);
+        ShapedObject* object = _value->toShaped();
+        bool recycling = _allocator->isRecycling();
+        Node *n, *tail = nullptr;
+        for (uint32_t i = 0; i < object->shape->length; i++) {
+            n = (Node*)allocate(sizeof(Node));
+            n->name = recycling ? clone(object->shape->names()[i]) : object->shape->names()[i]; // names belong to the shape
+            n->value = object->values()[i];
+            tail = insertAfter(tail, n);
+        }
+        *_value = listToValue(JSON_OBJECT, tail);
+        if (recycling) _allocator->recycle(object, sizeof(ShapedObject) + object->shape->length * sizeof(Value));
+    }
+    // bytes allocated for this value and its subtree. strings in the input of a parsed
+    // document are not counted, shared subtrees are counted in full.
+    size_t footprint() const {
+        return footprint(*_value);
+    }
+    // dump, style sets the layout and numbers how doubles are written. a document too deep
+    // for the memory left fails, false or an empty string.
+    bool dump(char* buffer, size_t bufferSize, size_t* pSize = nullptr, const DumpStyle& style = true,
+        const NumberFormat& numbers = NumberFormat()) {
         Writer<BufferWriter> writer(buffer, bufferSize);
-        _value->dump(writer, formatted);
+        writer.setNumberFormat(numbers);
+        _value->dump(writer, style, sources());
         writer.putc('\0');
         if (pSize) *pSize = writer.size();
-        return writer.size() <= bufferSize;
+        return writer.size() <= bufferSize && writer.getError() == ERROR_NO_ERROR;
     }
-    std::string dump(bool formatted = true) {
+    std::string dump(const DumpStyle& style = true, const NumberFormat& numbers = NumberFormat()) {
         std::string buffer;
         Writer<StringWriter> writer(buffer);
-        _value->dump(writer, formatted);
+        writer.setNumberFormat(numbers);
+        _value->dump(writer, style, sources());
+        if (ZJSON_UNLIKELY(writer.getError() != ERROR_NO_ERROR)) buffer.clear();
         return buffer;
     }
+    // dump with at most one allocation. a first pass counts everything but the doubles,
+    // which take the most their exponent allows (numberBound), and out is sized to that.
+    // the bound is a few bytes a double over the dump, and out keeps it as its capacity.
+    // resize fills the bytes with zeros, a memset of the bound, still cheaper than growing
+    // the string. returns ERROR_NO_ERROR or ERROR_OUT_OF_MEMORY, out is empty then.
+    int dump(std::string& out, const DumpStyle& style = true, const NumberFormat& numbers = NumberFormat()) {
+        Writer<BoundingWriter> bound;
+        bound.setNumberFormat(numbers);
+        _value->dump(bound, style, sources());
+        if (ZJSON_UNLIKELY(bound.getError() != ERROR_NO_ERROR)) {
+            out.clear();
+            return bound.getError();
+        }
+        size_t size = bound.size();
+        out.resize(size);
+        char* buffer = &out[0];
+        Writer<BufferWriter> writer(buffer, size);
+        writer.setNumberFormat(numbers);
+        _value->dump(writer, style, sources());
+        out.resize(writer.getError() == ERROR_NO_ERROR ? writer.size() : 0);
+        return writer.getError();
+    }
+    // the exact size of the dump, without a terminating zero, 0 if out of memory. it is no
+    // cheap pre-pass: every double is formatted to count it, about the cost of the dump.
+    size_t measure(const DumpStyle& style = true, const NumberFormat& numbers = NumberFormat()) const {
+        Writer<CountingWriter> counter;
+        counter.setNumberFormat(numbers);
+        _value->dump(counter, style, sources());
+        return counter.getError() == ERROR_NO_ERROR ? counter.size() : 0;
+    }
+    // stream to a file descriptor, FILE* or callback through a fixed buffer,
+    // returns ERROR_NO_ERROR, ERROR_IO or ERROR_OUT_OF_MEMORY
+    int dump(const Sink& sink, const DumpStyle& style = true, const NumberFormat& numbers = NumberFormat()) {
+        std::unique_ptr<Writer<StreamWriter>> writer(new Writer<StreamWriter>(sink));
+        writer->setNumberFormat(numbers);
+        _value->dump(*writer, style, sources());
+        writer->flush();
+        return writer->getError();
+    }
+    // dump the members or elements of the root on threads, 0 for one per core, it pays off
+    // for documents of tens of MB. a root with less than two children is dumped on this thread.
+    // returns the error of the dump, out is empty after ERROR_OUT_OF_MEMORY.
+    int dumpParallel(std::string& out, unsigned threads = 0, const DumpStyle& style = true,
+        const NumberFormat& numbers = NumberFormat()) {
+        Writer<StringWriter> writer(out);
+        writer.setNumberFormat(numbers);
+        _value->dumpParallel(writer, style, threads, sources());
+        if (ZJSON_UNLIKELY(writer.getError() != ERROR_NO_ERROR)) out.clear();
+        return writer.getError();
+    }
+    int dumpParallel(const Sink& sink, unsigned threads = 0, const DumpStyle& style = true,
+        const NumberFormat& numbers = NumberFormat()) {
+        std::unique_ptr<Writer<StreamWriter>> writer(new Writer<StreamWriter>(sink));
+        writer->setNumberFormat(numbers);
+        _value->dumpParallel(*writer, style, threads, sources());
+        writer->flush();
+        return writer->getError();
+    }
 protected:
+    inline Node* findNode(const char* name) const {
+        Node* n = _value->toNode();
+        while (n) {
+            if (strcmp(n->name, name) == 0) break;
+            n = n->next;
+        }
+        return n;
+    }
+    inline Node* elementAt(uint32_t index) const {
+        Node* n = _value->toNode();
+        uint32_t i = 0;
+        while (n) {
+            if (index == i++) break;
+            n = n->next;
+        }
+        return n;
+    }
+    inline Value* lookupValue(const char* name) const {
+        assert(getType() == JSON_OBJECT);
+        if (_value->isShaped()) {
+            ShapedObject* object = _value->toShaped();
+            int slot = object->find(name);
+            return slot >= 0 ? &object->values()[slot] : nullptr;
+        }
+        Node* n = findNode(name);
+        return n ? &n->value : nullptr;
+    }
+    inline Value* lookupValue(const Key& key) const {
+        assert(getType() == JSON_OBJECT);
+        if (_value->isShaped()) {
+            ShapedObject* object = _value->toShaped();
+            const Shape* shape = object->shape;
+            // ids are unique in the process, a shape reallocated at the same address has a new
+            // one. the id takes 57 bits of the cache and the slot + 1 the other 7, the slot is
+            // checked against the shape still, in case the id ever wrapped.
+            uint64_t cache = key._cache.load(std::memory_order_relaxed);
+            uint32_t cached = (uint32_t)(cache & Key::SLOT_MASK) - 1;
+            if ((cache >> 7) == (shape->id & Key::ID_MASK) && cached < shape->length && shape->hashes()[cached] == key._hash)
+                return &object->values()[cached];
+            int slot = shape->find(key._name, key._hash);
+            if (slot < 0) return nullptr;
+            key._cache.store((shape->id & Key::ID_MASK) << 7 | (uint64_t)(slot + 1), std::memory_order_relaxed);
+            return &object->values()[slot];
+        }
+        // a node list is scanned, a cached position could skip an earlier duplicated name
+        Node* n = findNode(key._name);
+        return n ? &n->value : nullptr;
+    }
     // allocate with or without allocator
     inline void *allocate(size_t size) {
         if (_allocator) return _allocator->allocate(size);
-        return malloc(size);
+        return crtAllocate(size);
+    }
+    inline void *allocateString(size_t size) {
+        if (_allocator) return _allocator->allocateString(size);
+        return crtAllocate(size);
+    }
+    // the value of an owning copy
+    inline Value copy(const Json& o) {
+        if (_allocator) // has allocator, recycled values can't be shared
+            return _allocator->isRecycling() ? clone(o.toValue()) : o.toValue();
+        return share(o); // no allocator, deep copy or share in copy-on-write mode
+    }
+    // copy the value of another Json, without allocators both share it in copy-on-write mode
+    inline Value share(const Json& json) {
+#ifdef ZJSON_COPY_ON_WRITE
+        if (!_allocator && !json._allocator)
+            return retainCrtAllocatedValue(json.toValue());
+#endif
+        return clone(json.toValue());
+    }
+    // the input text of a parsed container no longer matches it, see PARSE_KEEP_SOURCE.
+    // like copy-on-write, a container is marked when it's navigated for a mutation.
+    inline void touchSource(const Value& value) const {
+        if (ZJSON_UNLIKELY(_allocator && _allocator->getSources())) _allocator->getSources()->markDirty(value);
+    }
+    inline const SourceSpans* sources() const {
+        return _allocator ? _allocator->getSources() : nullptr;
+    }
+    // the values are crt-allocated: an owning Json without allocator, or a view into one.
+    // a view made from a Value* of the caller is not known to be.
+    inline bool isCrtTree() const {
+        return !_allocator && (!_isValueView || _inCrtTree);
+    }
+    inline Json view(Value* value) const {
+        Json json(value, _allocator);
+        json._inCrtTree = isCrtTree();
+        return json;
+    }
+    // copy the node list if it is shared, so a mutation only copies the path to it
+    inline void makeUnique() {
+        touchSource(*_value);
+#ifdef ZJSON_COPY_ON_WRITE
+        Type type = getType();
+        if (!isCrtTree() || (type != JSON_ARRAY && type != JSON_OBJECT)) return;
+        Node* head = _value->toNode();
+        if (!head || crtRefCount(head) == 1) return;
+        Node *n, *tail = nullptr;
+        for (Node* node = head; node; node = node->next) {
+            if (type == JSON_OBJECT) {
+                n = (Node*)allocate(sizeof(Node));
+                n->name = (char*)crtRetain(node->name);
+            }
+            else { // JSON_ARRAY
+                n = (Node*)allocate(sizeof(Node) - sizeof(char*));
+            }
+            n->value = retainCrtAllocatedValue(node->value);
+            tail = insertAfter(tail, n);
+        }
+        *_value = listToValue(type, tail);
+        freeCrtAllocatedValue(Value(type, head)); // drop a reference of the shared list
+#endif
     }
     // deep copying
     inline char* clone(const char* str) {
         size_t l = strlen(str) + 1;
-        char* rstr = (char*)allocate(l);
+        char* rstr = (char*)allocateString(l);
+        if (ZJSON_UNLIKELY(!rstr)) return nullptr;
         memcpy(rstr, str, l);
         return rstr;
     }
-    Node* clone(const Node* node, Type nodeType) {
-        assert(node);
-        Node* n;
-        if (nodeType == JSON_OBJECT) {
-            n = (Node*)allocate(sizeof(Node));
-            n->name = clone(node->name);
+    // an open container while cloning, the next source member or element and the copied list
+    struct CloneFrame {
+        const Node* node;
+        const Value* values;    // of a shaped object
+        char* const* names;
+        uint32_t remaining;
+        Type type;
+        Node* tail;
+    };
+    // iterative, the open containers are on an explicit stack. out of memory, what was
+    // copied is freed and null is returned.
+    Value clone(const Value value) {
+        Type type = value.getType();
+        if (type == JSON_STRING) {
+            char* str = clone(value.toString());
+            return str ? Value(JSON_STRING, str) : Value(JSON_NULL);
         }
-        else { // JSON_ARRAY
-            n = (Node*)allocate(sizeof(Node) - sizeof(char*));
+        if ((type != JSON_ARRAY && type != JSON_OBJECT) || (!value.isShaped() && !value.toNode()))
+            return value;
+        DepthStack<CloneFrame> stack;
+        int top = 0;
+        cloneEnter(stack[0], value);
+        for (;;) {
+            CloneFrame& frame = stack[top];
+            const char* name = nullptr;
+            const Value* source = nullptr;
+            if (frame.values) {
+                if (frame.remaining) {
+                    name = *frame.names++;
+                    source = frame.values++;
+                    frame.remaining--;
+                }
+            }
+            else if (frame.node) {
+                if (frame.type == JSON_OBJECT) name = frame.node->name;
+                source = &frame.node->value;
+                frame.node = frame.node->next;
+            }
+            if (!source) { // the container is complete
+                Value list = listToValue(frame.type, frame.tail);
+                if (top == 0) return list;
+                stack[--top].tail->value = list;
+                continue;
+            }
+            Node* n;
+            if (frame.type == JSON_OBJECT) {
+                char* copied = clone(name);
+                n = copied ? (Node*)allocate(sizeof(Node)) : nullptr;
+                if (ZJSON_UNLIKELY(!n)) {
+                    if (copied) drop(Value(JSON_STRING, copied));
+                    return cloneFailed(stack, top);
+                }
+                n->name = copied;
+            }
+            else { // JSON_ARRAY
+                n = (Node*)allocate(sizeof(Node) - sizeof(char*));
+                if (ZJSON_UNLIKELY(!n)) return cloneFailed(stack, top);
+            }
+            n->value = Value(JSON_NULL);
+            frame.tail = insertAfter(frame.tail, n);
+            Type t = source->getType();
+            if ((t == JSON_ARRAY || t == JSON_OBJECT) && (source->isShaped() || source->toNode())) {
+                if (ZJSON_UNLIKELY(!stack.reserve(top + 1))) return cloneFailed(stack, top);
+                cloneEnter(stack[++top], *source);
+            }
+            else if (t == JSON_STRING) {
+                char* str = clone(source->toString());
+                if (ZJSON_UNLIKELY(!str)) return cloneFailed(stack, top);
+                n->value = Value(JSON_STRING, str);
+            }
+            else {
+                n->value = *source;
+            }
         }
-        n->value = clone(node->value);
-        return n;
     }
-    Value clone(const Value value) {
+    // close the open containers of a failed clone and free them
+    Value cloneFailed(DepthStack<CloneFrame>& stack, int top) {
+        for (; top > 0; top--) stack[top - 1].tail->value = listToValue(stack[top].type, stack[top].tail);
+        drop(listToValue(stack[0].type, stack[0].tail));
+        return Value(JSON_NULL);
+    }
+    static void cloneEnter(CloneFrame& frame, const Value& value) {
+        if (value.isShaped()) {
+            ShapedObject* object = value.toShaped();
+            frame.node = nullptr;
+            frame.values = object->values();
+            frame.names = object->shape->names();
+            frame.remaining = object->shape->length;
+        }
+        else {
+            frame.node = value.toNode();
+            frame.values = nullptr;
+        }
+        frame.type = value.getType();
+        frame.tail = nullptr;
+    }
+    // build a literal directly, every node and string is allocated once
+    Value build(const JsonLiteral& literal) {
+        switch (literal._kind) {
+        case JsonLiteral::KIND_STRING:
+            return Value(JSON_STRING, clone(literal._key));
+        case JsonLiteral::KIND_JSON:
+        case JsonLiteral::KIND_MOVABLE_JSON: {
+            Json& json = const_cast<Json&>(*literal._json);
+            if (_allocator && _allocator == json._allocator && !_allocator->isRecycling()) // shares the same allocator
+                return json.toValue();
+            if (literal._kind == JsonLiteral::KIND_MOVABLE_JSON && !_allocator &&
+                !json._allocator && !json._isValueView && json._value) { // steals the temporary
+                Value value = *json._value;
+                *json._value = Value(JSON_NULL);
+                return value;
+            }
+            return share(json);
+        }
+        case JsonLiteral::KIND_LIST:
+            return build(literal._list, literal._isObject);
+        default:
+            return clone(literal._value);
+        }
+    }
+    Value build(std::initializer_list<JsonLiteral> init, bool isObject) {
+        Node *node, *tail = nullptr;
+        for (auto& literal : init) {
+            if (isObject) {
+                node = (Node*)allocate(sizeof(Node));
+                node->name = clone(literal._list.begin()->_key);
+                node->value = build(literal._list.begin()[1]);
+            }
+            else {
+                node = (Node*)allocate(sizeof(Node) - sizeof(char*));
+                node->value = build(literal);
+            }
+            tail = insertAfter(tail, node);
+        }
+        return listToValue(isObject ? JSON_OBJECT : JSON_ARRAY, tail);
+    }
+    // memory accounting
+    inline size_t chunkFootprint(size_t size) const {
+        return _allocator ? (size + 7) & ~(size_t)7 : crtFootprint(size);
+    }
+    size_t footprint(const Value& value) const {
+        size_t size = 0;
+        walk(value, [&](const Value& v) { size += ownFootprint(v); }, [](const Value&) {});
+        return size;
+    }
+    // the chunks of a value itself, those of a container without its children
+    size_t ownFootprint(const Value& value) const {
         Type type = value.getType();
         if (type == JSON_STRING) {
-            return Value(JSON_STRING, clone(value.toString()));
+            const char* str = value.toString();
+            return !_allocator || _allocator->ownsString(str) ? chunkFootprint(strlen(str) + 1) : 0;
+        }
+        else if (value.isShaped()) { // the names belong to the shape
+            ShapedObject* object = value.toShaped();
+            return chunkFootprint(sizeof(ShapedObject) + object->shape->length * sizeof(Value));
         }
         else if (type == JSON_ARRAY || type == JSON_OBJECT) {
-            Node *n, *tail = nullptr;
-            for (Node *node = value.toNode(); node; node = node->next) {
-                n = clone(node, type);
-                tail = insertAfter(tail, n);
+            size_t size = 0;
+            for (Node* node = value.toNode(); node; node = node->next) {
+                if (type == JSON_OBJECT) {
+                    size += chunkFootprint(sizeof(Node)) + ownFootprint(Value(JSON_STRING, node->name));
+                }
+                else {
+                    size += chunkFootprint(sizeof(Node) - sizeof(char*));
+                }
+            }
+            return size;
+        }
+        return 0;
+    }
+    // an open container of a walk, the next member or element
+    struct WalkFrame {
+        const Value* container;
+        const Node* node;
+        const Value* values;    // of a shaped object
+        uint32_t remaining;
+    };
+    // visit a value and all below it without recursion, enter(value) for each value before
+    // the children of a container and leave(container) after them. a container deeper than
+    // the stack could grow to is left without its children, false then.
+    template <typename Enter, typename Leave>
+    static bool walk(const Value& root, Enter enter, Leave leave) {
+        DepthStack<WalkFrame> stack;
+        int top = -1;
+        bool complete = true;
+        const Value* value = &root;
+        for (;;) {
+            enter(*value);
+            Type type = value->getType();
+            if (type == JSON_ARRAY || type == JSON_OBJECT) {
+                if (ZJSON_LIKELY(stack.reserve(++top))) {
+                    WalkFrame& frame = stack[top];
+                    frame.container = value;
+                    frame.node = value->isShaped() ? nullptr : value->toNode();
+                    frame.values = value->isShaped() ? value->toShaped()->values() : nullptr;
+                    frame.remaining = value->isShaped() ? value->toShaped()->shape->length : 0;
+                }
+                else {
+                    top--;
+                    complete = false;
+                    leave(*value);
+                }
+            }
+            // the next value, the node is passed before its value could be left
+            for (;;) {
+                if (top == -1) return complete;
+                WalkFrame& frame = stack[top];
+                if (frame.values && frame.remaining) {
+                    value = frame.values++;
+                    frame.remaining--;
+                    break;
+                }
+                if (frame.node) {
+                    value = &frame.node->value;
+                    frame.node = frame.node->next;
+                    break;
+                }
+                leave(*frame.container);
+                top--;
             }
-            return listToValue(type, tail);
         }
-        return value;
     }
     // destruction
     void destruct() {
-        if (_value && !_isValueView && !_allocator) {
-            freeCrtAllocatedValue(*_value);
+        if (_value && !_isValueView) {
+            if (!_allocator)
+                freeCrtAllocatedValue(*_value);
+            else if (_allocator->isRecycling())
+                recycle(*_value);
         }
     }
+    // free a value allocated by this Json and referenced nowhere else
+    void drop(Value value) {
+        if (!_allocator)
+            freeCrtAllocatedValue(value);
+        else if (_allocator->isRecycling())
+            recycle(value);
+    }
+    // give the chunks of a dropped value back to the allocator, a container's after its
+    // children. out of memory for the walk, the chunks below stay until the allocator is reset.
+    void recycle(Value value) {
+        walk(value, [&](const Value& v) {
+            touchSource(v); // its chunks may hold another container later
+            if (v.getType() == JSON_STRING)
+                _allocator->recycleString(v.toString(), strlen(v.toString()) + 1);
+        }, [&](const Value& container) {
+            if (container.isShaped()) {
+                ShapedObject* object = container.toShaped();
+                _allocator->recycle(object, sizeof(ShapedObject) + object->shape->length * sizeof(Value));
+                return;
+            }
+            Type type = container.getType();
+            Node* node = container.toNode();
+            while (node) {
+                Node* next = node->next;
+                if (type == JSON_OBJECT) {
+                    _allocator->recycleString(node->name, strlen(node->name) + 1);
+                    _allocator->recycle(node, sizeof(Node));
+                }
+                else {
+                    _allocator->recycle(node, sizeof(Node) - sizeof(char*));
+                }
+                node = next;
+            }
+        });
+    }
+    inline void replace(Value value) {
+        Value old = *_value;
+        *_value = value;
+#ifdef ZJSON_COPY_ON_WRITE
+        if (isCrtTree()) // a view of a shared tree releases the overwritten value too
+            freeCrtAllocatedValue(old);
+#else
+        if (!_isValueView && !_allocator)
+            freeCrtAllocatedValue(old);
+#endif
+        if (_allocator && _allocator->isRecycling())
+            recycle(old);
+    }
 protected:
 	Value* _value;
 	Allocator* _allocator;
 	bool _isValueView;
+	bool _inCrtTree = false; // a view returned by operator[] of a crt-allocated tree
+	bool _isDocument = false; // the root of a Document, a view of it but copied as a value
 };
 
+inline JsonLiteral::JsonLiteral(const Json& json)
+    : _kind(KIND_JSON), _value(JSON_NULL), _key(json.getString()), _json(&json) {}
+inline JsonLiteral::JsonLiteral(Json&& json)
+    : _kind(KIND_MOVABLE_JSON), _value(JSON_NULL), _key(json.getString()), _json(&json) {}
+
 inline NodeIterator begin(Json& json) {
+    json.touchSource(json.toValue()); // the nodes could be modified
+    if (json.isObject()) json.unshape();
     return NodeIterator { json.toValue().toNode() };
 }
 inline NodeIterator end(Json&) {
     return NodeIterator { nullptr };
 }
 
+// Iterates a const Json without converting a shaped object, its members are read into
+// a node held by the iterator
+struct ConstNodeIterator {
+    const Node* p;
+    const Value* values;    // of a shaped object
+    char* const* names;
+    uint32_t remaining;
+    Node member;
+    void load() {
+        if (!remaining) return;
+        member.value = *values;
+        member.name = *names;
+    }
+    void operator++() {
+        if (values) {
+            values++;
+            names++;
+            remaining--;
+            load();
+        }
+        else {
+            p = p->next;
+        }
+    }
+    bool operator!=(const ConstNodeIterator &x) const { return p != x.p || remaining != x.remaining; }
+    const Node *operator*() const { return values ? &member : p; }
+    const Node *operator->() const { return **this; }
+};
+inline ConstNodeIterator begin(const Json& json) {
+    Value value = json.toValue();
+    if (value.isShaped()) {
+        ShapedObject* object = value.toShaped();
+        ConstNodeIterator it = { nullptr, object->values(), object->shape->names(), object->shape->length,
+            { Value(JSON_NULL), nullptr, nullptr } };
+        it.load();
+        return it;
+    }
+    return ConstNodeIterator { value.toNode(), nullptr, nullptr, 0, { Value(JSON_NULL), nullptr, nullptr } };
+}
+inline ConstNodeIterator end(const Json&) {
+    return ConstNodeIterator { nullptr, nullptr, nullptr, 0, { Value(JSON_NULL), nullptr, nullptr } };
+}
+
 // A document for parsing JSON text as DOM.
-class Document final : public Json {
+class Document : public Json {
 public:
-    Document() : Json(nullptr) {
-        _allocator = new Allocator();
+    friend class Builder;
+    explicit Document(const BlockPolicy& policy = defaultBlockPolicy())
+        : Json(&_root, &_arena), _root(JSON_NULL), _arena(policy), _strings(policy)
+    {
+        _isDocument = true;
+    }
+    // parse into a caller-owned buffer first, then blocks from upstream.
+    // with a null upstream, parse returns ERROR_OUT_OF_MEMORY when the buffer runs out.
+    Document(void* buffer, size_t bufferSize, MemoryResource* upstream = defaultResource(),
+        const BlockPolicy& policy = defaultBlockPolicy())
+        : Json(&_root, &_arena), _root(JSON_NULL), _arena(policy, upstream, buffer, bufferSize),
+        _strings(policy, upstream)
+    {
+        _isDocument = true;
     }
-    ~Document() {
-        delete _allocator;
+    Document(const Document&) = delete;
+    Document& operator=(const Document&) = delete;
+    // the length is measured for the size hint, a scan much cheaper than the parse
+    int parse(char* content, ParseFlags flags = PARSE_DEFAULT) {
+        return parse(content, strlen(content), flags);
     }
-    int parse(char* content) {
+    // the DOM size is roughly proportional to the input, so the length of content
+    // sizes the first block of allocator
+    // with PARSE_KEEP_SOURCE, the input is copied before the in-situ parse, and a dump
+    // with DumpStyle::roundTrip() copies the arrays and objects not modified through Json
+    // from it as they were.
+    int parse(char* content, size_t length, ParseFlags flags = PARSE_DEFAULT) {
         _allocator->reset();
-        return jsonParse(content, _value, *_allocator);
+        *_value = Value(JSON_NULL); // the old tree went with the reset, a failed parse leaves null
+        if (length) _allocator->reserve(length * ZJSON_DOM_SIZE_RATIO);
+        if (flags & PARSE_SHAPED_OBJECTS) _shapes.reset(_allocator);
+        SourceSpans* sources = nullptr;
+        if (flags & PARSE_KEEP_SOURCE) {
+            _sources.reset();
+            if (!_sources.keep(content, length ? length : strlen(content), *_allocator))
+                return ERROR_OUT_OF_MEMORY;
+            sources = &_sources;
+        }
+        int error = jsonParse(content, _value, *_allocator, flags & PARSE_SHAPED_OBJECTS ? &_shapes : nullptr, sources);
+        if (error == ERROR_NO_ERROR) _allocator->setSources(sources);
+        return error;
+    }
+    // how much memory is kept for the next parse, see RetentionPolicy
+    void setRetention(const RetentionPolicy& retention) {
+        _arena.setRetention(retention);
+        _strings.setRetention(retention);
+    }
+    // return unused blocks to upstream, keeping at most keepSize bytes of them
+    void trim(size_t keepSize = 0) {
+        _arena.trim(keepSize);
+        _strings.trim(keepSize);
+    }
+    // keep copied strings and keys in an arena of their own, apart from the nodes, so
+    // traversals don't pull string bytes into cache. strings of a parsed document stay
+    // in its input either way.
+    void setSplitArenas(bool enabled) {
+        _arena.setStringAllocator(enabled ? &_strings : nullptr);
+    }
+    // reuse the memory of removed and overwritten values for later modifications, so a
+    // long-lived document doesn't grow. values are copied instead of shared then, enable
+    // it before parsing.
+    void setRecycling(bool enabled) {
+        _arena.setRecycling(enabled);
+        _strings.setRecycling(enabled);
+    }
+    // memory used by the document, and its values counted by type
+    MemoryStats memoryStats() const {
+        MemoryStats stats;
+        memset(&stats, 0, sizeof(stats));
+        _arena.addStats(stats);
+        _strings.addStats(stats);
+        countValues(_root, stats);
+        return stats;
+    }
+    // copy the live tree into fresh blocks and release the old ones, shaped objects
+    // become node lists. Json views into the document are invalidated. if the copy
+    // runs out of memory, the document is kept as it was and ERROR_OUT_OF_MEMORY returned.
+    int compact() {
+        void* blocks = _arena.detachBlocks();
+        void* stringBlocks = _strings.detachBlocks();
+        Value root = clone(_root);
+        if (ZJSON_UNLIKELY(root.getType() == JSON_NULL && _root.getType() != JSON_NULL)) {
+            _arena.restoreBlocks(blocks);
+            _strings.restoreBlocks(stringBlocks);
+            return ERROR_OUT_OF_MEMORY;
+        }
+        _shapes.reset();
+        _sources.reset();
+        _arena.setSources(nullptr);
+        _arena.releaseBlocks(blocks);
+        _strings.releaseBlocks(stringBlocks);
+        _root = root;
+        return ERROR_NO_ERROR;
+    }
+private:
+    static void countValues(const Value& value, MemoryStats& stats) {
+        walk(value, [&](const Value& v) { stats.values[v.getType()]++; }, [](const Value&) {});
+    }
+    // the root value and the allocator are held inline, no heap allocation until parsing
+    Value _root;
+    Allocator _arena;
+    Allocator _strings; // used when the arenas are split
+    ShapeTable _shapes;
+    SourceSpans _sources;
+};
+
+template <size_t Size>
+struct InlineStorage {
+    alignas(8) char _storage[Size];
+};
+
+// A document with an inline first block of InlineSize bytes, so small documents
+// are constructed, parsed and destroyed without any heap operation.
+template <size_t InlineSize>
+class InlineDocument final : private InlineStorage<InlineSize>, public Document {
+public:
+    explicit InlineDocument(MemoryResource* upstream = defaultResource(),
+        const BlockPolicy& policy = defaultBlockPolicy())
+        : Document(this->_storage, InlineSize, upstream, policy) {}
+};
+
+// A builder writes a DOM straight into a document's allocator.
+// Every append is O(1), it keeps the tail of each open container on a stack.
+class Builder {
+public:
+    explicit Builder(Document& document)
+        : _root(document._value), _allocator(*document._allocator), _stack(&_allocator), _top(-1),
+        _hasKey(false), _hasRoot(false), _error(ERROR_NO_ERROR)
+    {
+        _allocator.reset();
+        *_root = Value(JSON_NULL);
+    }
+    Builder(const Builder&) = delete;
+    Builder& operator=(const Builder&) = delete;
+
+    int getError() const { return _error; }
+    // true when the root value is completely built
+    bool isComplete() const { return _hasRoot && _top == -1; }
+
+    bool beginObject() { return begin(true); }
+    bool beginArray() { return begin(false); }
+    bool endObject() { return end(true); }
+    bool endArray() { return end(false); }
+    // if copy is false, name must be null-terminated at name[length] and outlive the document
+    bool key(const char* name, size_t length, bool copy = true) {
+        if (ZJSON_UNLIKELY(_top == -1 || !_stack[_top].isObject || _hasKey))
+            return fail(ERROR_UNEXPECTED_CHARACTER);
+        Node* node = (Node*)_allocator.allocate(sizeof(Node));
+        char* str = copy ? clone(name, length) : const_cast<char*>(name);
+        if (ZJSON_UNLIKELY(!node || !str))
+            return fail(ERROR_OUT_OF_MEMORY);
+        assert(str[length] == '\0');
+        node->name = str;
+        node->value = Value(JSON_NULL);
+        _stack[_top].tail = insertAfter(_stack[_top].tail, node);
+        _hasKey = true;
+        return true;
+    }
+    bool key(const char* name) { return key(name, strlen(name)); }
+    bool value(Value v) {
+        assert(v.getType() != JSON_ARRAY && v.getType() != JSON_OBJECT);
+        Value* slot = nextSlot();
+        if (ZJSON_UNLIKELY(!slot)) return false;
+        *slot = v;
+        return true;
+    }
+    bool value(double d) { return value(Value(d)); }
+    bool value(int32_t n) { return value(Value(n)); }
+    bool value(bool b) { return value(Value(b)); }
+    bool value(nullptr_t) { return value(Value(JSON_NULL)); }
+    // if copy is false, str must be null-terminated at str[length] and outlive the document
+    bool value(const char* str, size_t length, bool copy = true) {
+        char* s = copy ? clone(str, length) : const_cast<char*>(str);
+        if (ZJSON_UNLIKELY(!s)) return fail(ERROR_OUT_OF_MEMORY);
+        assert(s[length] == '\0');
+        return value(Value(JSON_STRING, s));
+    }
+    bool value(const char* str) { return value(str, strlen(str)); }
+private:
+    Value* _root;
+    Allocator& _allocator;
+    struct Frame {
+        Node* tail;
+        Value* slot;
+        bool isObject;
+    };
+    DepthStack<Frame> _stack; // grows in the document for deep trees
+    int _top;
+    bool _hasKey;
+    bool _hasRoot;
+    int _error;
+
+    inline bool fail(int error) {
+        if (!_error) _error = error;
+        return false;
+    }
+    inline char* clone(const char* str, size_t length) {
+        char* s = (char*)_allocator.allocateString(length + 1);
+        if (s) {
+            memcpy(s, str, length);
+            s[length] = '\0';
+        }
+        return s;
+    }
+    // where the next value goes: the root, the pending member or a new element
+    inline Value* nextSlot() {
+        if (ZJSON_UNLIKELY(_error)) return nullptr;
+        if (_top == -1) {
+            if (ZJSON_UNLIKELY(_hasRoot)) {
+                fail(ERROR_BAD_ROOT);
+                return nullptr;
+            }
+            _hasRoot = true;
+            return _root;
+        }
+        if (_stack[_top].isObject) {
+            if (ZJSON_UNLIKELY(!_hasKey)) {
+                fail(ERROR_UNEXPECTED_CHARACTER);
+                return nullptr;
+            }
+            _hasKey = false;
+            return &_stack[_top].tail->value;
+        }
+        Node* node = (Node*)_allocator.allocate(sizeof(Node) - sizeof(char*));
+        if (ZJSON_UNLIKELY(!node)) {
+            fail(ERROR_OUT_OF_MEMORY);
+            return nullptr;
+        }
+        node->value = Value(JSON_NULL);
+        _stack[_top].tail = insertAfter(_stack[_top].tail, node);
+        return &node->value;
+    }
+    bool begin(bool isObject) {
+        Value* slot = nextSlot();
+        if (ZJSON_UNLIKELY(!slot)) return false;
+        if (ZJSON_UNLIKELY(!_stack.reserve(_top + 1)))
+            return fail(ERROR_OUT_OF_MEMORY);
+        ++_top;
+        _stack[_top].tail = nullptr;
+        _stack[_top].slot = slot;
+        _stack[_top].isObject = isObject;
+        return true;
+    }
+    bool end(bool isObject) {
+        if (ZJSON_UNLIKELY(_error)) return false;
+        if (ZJSON_UNLIKELY(_top == -1))
+            return fail(ERROR_STACK_UNDERFLOW);
+        if (ZJSON_UNLIKELY(_stack[_top].isObject != isObject || _hasKey))
+            return fail(ERROR_MISMATCH_BRACKET);
+        *_stack[_top].slot = listToValue(isObject ? JSON_OBJECT : JSON_ARRAY, _stack[_top].tail);
+        --_top;
+        return true;
     }
 };
 
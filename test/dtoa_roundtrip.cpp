@@ -0,0 +1,124 @@
+// Round trip of the double formatting, with random bit patterns and with doubles read
+// from random decimals. Every output must read back to the same double with strtod and
+// parse as a number. Schubfach must also be the shortest, Grisu2 (ZJSON_USE_DTOA_MILO)
+// isn't always. The parser isn't correctly rounded, strtod is the reference.
+#include <cstdio>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <cfloat>
+#include <limits>
+#include <string>
+#include <random>
+#include "zenjson.h"
+
+static size_t s_checked = 0, s_failed = 0;
+
+static void fail(double d, const std::string& text, const char* reason) {
+    if (++s_failed <= 20) {
+        char expected[32];
+        snprintf(expected, sizeof(expected), "%.17g", d);
+        printf("FAILED %s: %s written as %s\n", reason, expected, text.c_str());
+    }
+}
+
+#ifndef ZJSON_USE_DTOA_MILO
+// the fewest significant digits that read back to d. at a power of two the interval
+// isn't centered, the nearest digits may be outside and their neighbor inside.
+static int shortestDigits(double d) {
+    char buffer[40];
+    if (d == 0) return 1;
+    for (int precision = 1; precision < 17; precision++) {
+        snprintf(buffer, sizeof(buffer), "%.*e", precision - 1, fabs(d));
+        char* exponent = strchr(buffer, 'e');
+        std::string digits(buffer, exponent);
+        digits.erase(std::remove(digits.begin(), digits.end(), '.'), digits.end());
+        long long nearest = strtoll(digits.c_str(), nullptr, 10);
+        for (long long m = nearest - 1; m <= nearest + 1; m++) {
+            char candidate[48];
+            snprintf(candidate, sizeof(candidate), "%llde%d", m, atoi(exponent + 1) - (precision - 1));
+            if (m > 0 && strtod(candidate, nullptr) == fabs(d)) return precision;
+        }
+    }
+    return 17;
+}
+
+static int significantDigits(const std::string& text) {
+    int digits = 0, zeros = 0;
+    bool leading = true;
+    for (char c : text) {
+        if (c == 'e' || c == 'E') break;
+        if (c < '0' || c > '9') continue;
+        if (c == '0') {
+            if (!leading) zeros++;
+            continue;
+        }
+        leading = false;
+        digits += zeros + 1;
+        zeros = 0;
+    }
+    return digits ? digits : 1;
+}
+#endif
+
+static void check(double d) {
+    std::string text;
+    zjson::Writer<zjson::StringWriter> writer(text);
+    writer.writeNumber(d);
+    s_checked++;
+    if (strtod(text.c_str(), nullptr) != d) { // -0 is written as 0
+        fail(d, text, "round trip");
+        return;
+    }
+#ifndef ZJSON_USE_DTOA_MILO
+    if (significantDigits(text) != shortestDigits(d)) {
+        fail(d, text, "not the shortest");
+        return;
+    }
+#endif
+    std::string json = "[" + text + "]";
+    zjson::Document doc;
+    zjson::Node* element;
+    if (doc.parse(&json[0], json.size()) != zjson::ERROR_NO_ERROR || !(element = doc.toValue().toNode()) ||
+        (element->value.getType() != zjson::JSON_NUMBER && element->value.getType() != zjson::JSON_INT)) {
+        fail(d, text, "parse");
+    }
+}
+
+int main(int argc, char* argv[]) {
+    size_t count = argc > 1 ? strtoul(argv[1], nullptr, 10) : 200000;
+    std::mt19937_64 random(20261018);
+
+    const double edges[] = {
+        0.0, -0.0, 1.0, -1.0, 0.1, 0.3, 1e23, 9007199254740993.0, 5e-324, -5e-324,
+        DBL_MIN, DBL_MAX, -DBL_MAX, DBL_EPSILON, 2.2250738585072009e-308, 1e21, 1e-7, 123456789012345680.0
+    };
+    for (double d : edges) check(d);
+    for (int e = -1074; e <= 1023; e++) check(ldexp(1.0, e));
+    for (int e = -323; e <= 308; e++) check(strtod(("1e" + std::to_string(e)).c_str(), nullptr));
+
+    // random bit patterns, all exponents equally likely
+    for (size_t i = 0; i < count; i++) {
+        uint64_t bits = random();
+        double d;
+        memcpy(&d, &bits, sizeof(d));
+        if (std::isfinite(d)) check(d);
+    }
+
+    // doubles read from random decimals of 1 to 17 digits, the way they come in JSON
+    for (size_t i = 0; i < count; i++) {
+        int digits = 1 + (int)(random() % 17);
+        char buffer[48];
+        char* p = buffer;
+        if (random() & 1) *p++ = '-';
+        *p++ = (char)('1' + random() % 9);
+        *p++ = '.';
+        for (int j = 1; j < digits; j++) *p++ = (char)('0' + random() % 10);
+        snprintf(p, buffer + sizeof(buffer) - p, "e%d", (int)(random() % 600) - 300);
+        check(strtod(buffer, nullptr));
+    }
+
+    printf("%zu checked, %zu failed\n", s_checked, s_failed);
+    return s_failed ? 1 : 0;
+}
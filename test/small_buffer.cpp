@@ -0,0 +1,59 @@
+// Parsing into a small caller buffer. Without upstream every parse must fit in the buffer,
+// with PARSE_SHAPED_OBJECTS as well, and an InlineDocument must not touch its upstream
+// for a small input.
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include "zenjson.h"
+
+static int s_failed = 0;
+
+static void expect(bool condition, const char* what) {
+    if (!condition) {
+        printf("FAILED %s\n", what);
+        s_failed++;
+    }
+}
+
+class CountingResource final : public zjson::MemoryResource {
+public:
+    size_t allocations = 0;
+    void* allocate(size_t size) override {
+        allocations++;
+        return malloc(size);
+    }
+    void deallocate(void* ptr, size_t) override { free(ptr); }
+};
+
+static int parse(zjson::Document& doc, const char* text, zjson::ParseFlags flags) {
+    static char input[1024];
+    strcpy(input, text);
+    return doc.parse(input, strlen(input), flags);
+}
+
+int main() {
+    const char* small = "[{\"a\":1},{\"a\":2}]";
+    const char* medium = "{\"users\":[{\"id\":1,\"name\":\"a\",\"tags\":[{\"k\":\"x\"},{\"k\":\"y\"}]},"
+        "{\"id\":2,\"name\":\"b\",\"tags\":[]},{\"id\":3,\"name\":\"c\",\"tags\":[{\"k\":\"z\"}]}]}";
+
+    for (size_t size : { 2048, 4096 }) {
+        std::string buffer(size, '\0');
+        zjson::Document doc(&buffer[0], size, nullptr);
+        for (zjson::ParseFlags flags : { zjson::PARSE_DEFAULT, zjson::PARSE_SHAPED_OBJECTS }) {
+            for (int round = 0; round < 3; round++) { // the buffer is reused by each parse
+                expect(parse(doc, small, flags) == zjson::ERROR_NO_ERROR && doc.dump(false) == small,
+                    "small input in a buffer");
+                expect(parse(doc, medium, flags) == zjson::ERROR_NO_ERROR &&
+                    doc["users"][2]["tags"][0]["k"].dump(false) == "\"z\"", "medium input in a buffer");
+            }
+        }
+    }
+
+    CountingResource upstream;
+    zjson::InlineDocument<4096> doc(&upstream);
+    expect(parse(doc, medium, zjson::PARSE_SHAPED_OBJECTS) == zjson::ERROR_NO_ERROR, "inline document");
+    expect(upstream.allocations == 0, "inline document without upstream allocations");
+
+    printf("%d failed\n", s_failed);
+    return s_failed ? 1 : 0;
+}
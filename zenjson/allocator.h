@@ -1,9 +1,124 @@
+#if (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || __cplusplus >= 201703L
+#include <memory_resource>
+#define ZJSON_HAS_PMR
+#endif
+
 namespace zjson {
 
-#define ZJSON_BLOCK_SIZE    8192
+#define ZJSON_BLOCK_SIZE        8192            // size of the first block
+#define ZJSON_BLOCK_GROWTH      2.0f            // geometric growth factor of block sizes
+#define ZJSON_MAX_BLOCK_SIZE    (64 << 20)      // blocks stop growing at this size
+#define ZJSON_DOM_SIZE_RATIO    1               // estimated DOM size per byte of input
+#define ZJSON_RETAIN_HISTORY    16              // max number of resets a retention window covers
+#define ZJSON_RECYCLE_MAX_SIZE  256             // larger chunks are not recycled
+
+#ifdef ZJSON_ENABLE_STATS
+#define ZJSON_STAT(x) x
+#else
+#define ZJSON_STAT(x)
+#endif
+
+// Memory usage of a document. bytesRequested and highWater are counted only when
+// ZJSON_ENABLE_STATS is defined, the others are collected when they are asked for.
+struct MemoryStats {
+    size_t bytesRequested;  // total size of allocations since the last reset
+    size_t bytesReserved;   // capacity of the blocks in use
+    size_t blocks;          // number of the blocks in use
+    size_t tailWaste;       // bytes left at the end of the blocks in use, except the current one
+    size_t freeBytes;       // capacity of the free blocks kept for reuse
+    size_t recycledBytes;   // chunks in the recycling free lists
+    size_t highWater;       // the largest bytesReserved ever
+    size_t values[16];      // number of values of each Type
+};
+
+// How an allocator sizes its blocks. The first one is initialSize bytes, each new one
+// is growthFactor times larger than the previous, up to maxSize.
+struct BlockPolicy {
+    size_t initialSize;
+    float growthFactor;
+    size_t maxSize;
+};
+inline BlockPolicy defaultBlockPolicy() {
+    return BlockPolicy { ZJSON_BLOCK_SIZE, ZJSON_BLOCK_GROWTH, ZJSON_MAX_BLOCK_SIZE };
+}
+
+// How much memory an allocator keeps for reuse when it is reset, the rest goes back to
+// upstream. It keeps at most maxSize bytes, and if window is not 0, no more than the
+// largest usage of the last window resets, so an outlier does not stay forever.
+struct RetentionPolicy {
+    size_t maxSize;
+    uint32_t window;
+};
+inline RetentionPolicy defaultRetentionPolicy() {
+    return RetentionPolicy { SIZE_MAX, 0 };
+}
+
+// Where an allocator gets its blocks from, like std::pmr::memory_resource.
+class MemoryResource {
+public:
+    virtual ~MemoryResource() {}
+    virtual void *allocate(size_t size) = 0;
+    virtual void deallocate(void *ptr, size_t size) = 0;
+    // whether allocators keep their free blocks for reuse, or return them on reset
+    virtual bool retainsFreeBlocks() const { return true; }
+};
+
+class MallocResource final : public MemoryResource {
+public:
+    void *allocate(size_t size) override { return malloc(size); }
+    void deallocate(void *ptr, size_t) override { free(ptr); }
+};
+inline MemoryResource *defaultResource() {
+    static MallocResource s_resource;
+    return &s_resource;
+}
+
+#ifdef ZJSON_HAS_PMR
+// Adapts a std::pmr::memory_resource, e.g. a std::pmr::monotonic_buffer_resource.
+class PmrResource final : public MemoryResource {
+public:
+    explicit PmrResource(std::pmr::memory_resource *upstream) : _upstream(upstream) {}
+    void *allocate(size_t size) override {
+#ifdef ZJSON_HAS_EXCEPTIONS
+        try {
+            return _upstream->allocate(size, alignof(std::max_align_t));
+        }
+        catch (const std::bad_alloc &) {
+            return nullptr;
+        }
+#else
+        return _upstream->allocate(size, alignof(std::max_align_t));
+#endif
+    }
+    void deallocate(void *ptr, size_t size) override { _upstream->deallocate(ptr, size, alignof(std::max_align_t)); }
+private:
+    std::pmr::memory_resource *_upstream;
+};
+#endif
+
+class SourceSpans;
+
 class Allocator {
 public:
-    Allocator() : blocksHead(nullptr), freeBlocksHead(nullptr) {};
+    // blocks come from upstream, after the caller-owned buffer is used up if given.
+    // with a null upstream, allocations fail when the buffer runs out.
+    explicit Allocator(const BlockPolicy &policy = defaultBlockPolicy(), MemoryResource *upstream = defaultResource(),
+        void *buffer = nullptr, size_t bufferSize = 0)
+        : blocksHead(nullptr), freeBlocksHead(nullptr), bufferBlock(nullptr), upstream(upstream),
+        policy(policy), nextBlockSize(policy.initialSize), retention(defaultRetentionPolicy()), resets(0),
+        recycling(false), recycledMask(0), strings(nullptr), sources(nullptr)
+    {
+        assert(policy.growthFactor >= 1 && policy.initialSize <= policy.maxSize);
+        memset(recycled, 0, sizeof(recycled));
+        ZJSON_STAT(statRequested = statReserved = statHighWater = 0);
+        uintptr_t begin = ((uintptr_t)buffer + 7) & ~(uintptr_t)7;
+        uintptr_t end = (uintptr_t)buffer + bufferSize;
+        if (buffer && end > begin && end - begin > sizeof(Block)) {
+            freeBlocksHead = bufferBlock = (Block *)begin;
+            bufferBlock->next = nullptr;
+            bufferBlock->size = (end - begin) & ~(uintptr_t)7;
+        }
+    };
     Allocator(const Allocator &) = delete;
     Allocator &operator=(const Allocator &) = delete;
     ~Allocator() {
@@ -11,60 +126,357 @@ public:
     }
     inline void *allocate(size_t size) {
         size = (size + 7) & ~7;
-        if (blocksHead && blocksHead->used + size <= ZJSON_BLOCK_SIZE) {
+        ZJSON_STAT(statRequested += size);
+        if (ZJSON_UNLIKELY(recycledMask) && size && size <= ZJSON_RECYCLE_MAX_SIZE) {
+            size_t c = size / 8 - 1;
+            if (void *p = recycled[c]) {
+                recycled[c] = *(void **)p;
+                if (!recycled[c]) recycledMask &= ~(1ULL << c);
+                return p;
+            }
+        }
+        if (ZJSON_LIKELY(blocksHead && blocksHead->used + size <= blocksHead->size)) {
             char *p = (char *)blocksHead + blocksHead->used;
             blocksHead->used += size;
             return p;
         }
-        size_t allocSize = sizeof(Block) + size;
-        Block *block = freeBlocksHead;
-        if (block && block->size >= allocSize) { // reuse free block
-            freeBlocksHead = block->next;
+        return allocateBlock(size);
+    }
+    // strings are cold bytes for traversals, with a separate allocator for them the nodes
+    // of a container are packed densely
+    void setStringAllocator(Allocator *strings) {
+        this->strings = strings;
+    }
+    inline void *allocateString(size_t size) {
+        return strings ? strings->allocate(size) : allocate(size);
+    }
+    inline bool ownsString(const void *ptr) const {
+        return strings ? strings->owns(ptr) : owns(ptr);
+    }
+    inline void recycleString(void *ptr, size_t size) {
+        if (strings)
+            strings->recycle(ptr, size);
+        else
+            recycle(ptr, size);
+    }
+    // a hint of the total size to allocate, e.g. from the input size, so the next block
+    // could hold all of it
+    inline void reserve(size_t size) {
+        size += sizeof(Block);
+        if (size > policy.maxSize) size = policy.maxSize;
+        if (size > nextBlockSize) nextBlockSize = size;
+    }
+    // the largest allocation that fits in the blocks at hand, without one from upstream
+    size_t room() const {
+        size_t largest = blocksHead ? blocksHead->size - blocksHead->used + sizeof(Block) : 0;
+        for (Block *block = freeBlocksHead; block; block = block->next) {
+            if (block->size > largest) largest = block->size;
         }
-        else { // allocate new block
-            block = (Block *)malloc(allocSize <= ZJSON_BLOCK_SIZE ? ZJSON_BLOCK_SIZE : allocSize);
-            if (!block) return nullptr;
-            block->size = allocSize;
+        return largest > sizeof(Block) ? largest - sizeof(Block) : 0;
+    }
+    // takes effect from the next reset or abandonBlocks()
+    void setBlockPolicy(const BlockPolicy &policy) {
+        assert(policy.growthFactor >= 1 && policy.initialSize <= policy.maxSize);
+        this->policy = policy;
+    }
+    // when enabled, chunks given back by recycle() are reused by allocations of the same
+    // size. the owner must not share a chunk between values then.
+    void setRecycling(bool enabled) {
+        recycling = enabled;
+        if (!enabled) clearRecycled();
+    }
+    inline bool isRecycling() const {
+        return recycling;
+    }
+    // the input of the parsed document, see source.h. it lives in the blocks, so a reset
+    // drops it.
+    inline void setSources(SourceSpans *sources) {
+        this->sources = sources;
+    }
+    inline SourceSpans *getSources() const {
+        return sources;
+    }
+    inline void recycle(void *ptr, size_t size) {
+        size = (size + 7) & ~7;
+        if (!recycling || !size || size > ZJSON_RECYCLE_MAX_SIZE || !owns(ptr)) return;
+        size_t c = size / 8 - 1;
+        *(void **)ptr = recycled[c];
+        recycled[c] = ptr;
+        recycledMask |= 1ULL << c;
+    }
+    // whether ptr is in a block in use, strings of a parsed document are in its input instead
+    bool owns(const void *ptr) const {
+        for (Block *block = blocksHead; block; block = block->next) {
+            if ((const char *)ptr >= (const char *)block + sizeof(Block) && (const char *)ptr < (const char *)block + block->used)
+                return true;
         }
-        block->used = allocSize;
-        if (allocSize <= ZJSON_BLOCK_SIZE || !blocksHead) { // push_front
-            block->next = blocksHead;
-            blocksHead = block;
+        return false;
+    }
+    // take the blocks in use away, so following allocations go to other blocks. give them
+    // back with releaseBlocks() when they are no longer referenced.
+    void *detachBlocks() {
+        Block *chain = blocksHead;
+        blocksHead = nullptr;
+        nextBlockSize = policy.initialSize; // new blocks grow from the live size, not the history
+        clearRecycled();
+        ZJSON_STAT(statReserved = 0);
+        return chain;
+    }
+    // undo detachBlocks(), the blocks allocated since are released
+    void restoreBlocks(void *chain) {
+        Block *since = blocksHead;
+        blocksHead = (Block *)chain;
+        clearRecycled();
+        ZJSON_STAT(statReserved = 0);
+        ZJSON_STAT(for (Block *block = blocksHead; block; block = block->next) statReserved += block->size);
+        releaseBlocks(since);
+    }
+    // forget all blocks without touching them, they were carved from another allocator
+    // that could have been reset since
+    void abandonBlocks() {
+        blocksHead = nullptr;
+        freeBlocksHead = bufferBlock;
+        if (bufferBlock) bufferBlock->next = nullptr;
+        nextBlockSize = policy.initialSize;
+        clearRecycled();
+        ZJSON_STAT(statReserved = 0);
+    }
+    void releaseBlocks(void *chain) {
+        Block *block = (Block *)chain;
+        while (block) {
+            Block *nextblock = block->next;
+            if (block == bufferBlock) {
+                block->next = freeBlocksHead;
+                freeBlocksHead = block;
+            }
+            else {
+                upstream->deallocate(block, block->size);
+            }
+            block = nextblock;
         }
-        else { // insert
-            block->next = blocksHead->next;
-            blocksHead->next = block;
+    }
+    // add the statistics of this allocator to stats
+    void addStats(MemoryStats &stats) const {
+        for (Block *block = blocksHead; block; block = block->next) {
+            stats.blocks++;
+            stats.bytesReserved += block->size;
+            if (block != blocksHead) stats.tailWaste += block->size - block->used;
         }
-        return (char *)block + sizeof(Block);
+        for (Block *block = freeBlocksHead; block; block = block->next) stats.freeBytes += block->size;
+        for (size_t c = 0; recycledMask && c < ZJSON_RECYCLE_MAX_SIZE / 8; c++) {
+            for (void *p = recycled[c]; p; p = *(void **)p) stats.recycledBytes += (c + 1) * 8;
+        }
+#ifdef ZJSON_ENABLE_STATS
+        stats.bytesRequested += statRequested;
+        stats.highWater += statHighWater;
+#endif
+    }
+    void setRetention(const RetentionPolicy &retention) {
+        this->retention = retention;
+        if (retention.window > ZJSON_RETAIN_HISTORY) this->retention.window = ZJSON_RETAIN_HISTORY;
+        resets = 0;
     }
     inline void reset() {
+        if (strings) strings->reset();
+        sources = nullptr;
+        nextBlockSize = policy.initialSize; // a large parse doesn't size the blocks of later ones
+        clearRecycled();
+        ZJSON_STAT(statRequested = statReserved = 0);
+        size_t usage = 0;
         if (blocksHead) {
             Block* block = blocksHead;
-            while (block && block->next) block = block->next;
+            for (; ; block = block->next) {
+                if (block != bufferBlock) usage += block->size;
+                if (!block->next) break;
+            }
             block->next = freeBlocksHead;
             freeBlocksHead = blocksHead;
             blocksHead = nullptr;
         }
+        if (bufferBlock && freeBlocksHead != bufferBlock) { // the caller-owned buffer is reused first
+            Block* block = freeBlocksHead;
+            while (block->next != bufferBlock) block = block->next;
+            block->next = bufferBlock->next;
+            bufferBlock->next = freeBlocksHead;
+            freeBlocksHead = bufferBlock;
+        }
+        if (upstream && !upstream->retainsFreeBlocks()) {
+            trim(0);
+            return;
+        }
+        size_t keep = retention.maxSize;
+        if (retention.window) {
+            history[resets++ % retention.window] = usage;
+            size_t highWater = 0;
+            for (uint32_t i = 0; i < retention.window && i < resets; i++) {
+                if (history[i] > highWater) highWater = history[i];
+            }
+            if (highWater < keep) keep = highWater;
+        }
+        trim(keep);
+    }
+    // return free blocks to upstream until at most keepSize bytes of them are left,
+    // the caller-owned buffer is always kept
+    void trim(size_t keepSize = 0) {
+        Block** link = &freeBlocksHead;
+        size_t kept = 0;
+        while (Block* block = *link) {
+            if (block == bufferBlock || kept + block->size <= keepSize) {
+                if (block != bufferBlock) kept += block->size;
+                link = &block->next;
+            }
+            else {
+                *link = block->next;
+                upstream->deallocate(block, block->size);
+            }
+        }
+    }
+    // a position in the allocator, so it could be used as a stack
+    struct Marker {
+        void *block;
+        void *next; // the block after it then
+        size_t used;
+    };
+    inline Marker mark() const {
+        return Marker { blocksHead, blocksHead ? blocksHead->next : nullptr, blocksHead ? blocksHead->used : 0 };
+    }
+    // release everything allocated after the marker, blocks are kept for reuse. new blocks
+    // go in front of the head or right after it, so they are all before the one that
+    // followed the marked block.
+    inline void rewind(Marker marker) {
+        clearRecycled();
+        Block **link = &blocksHead;
+        while (*link != marker.next) {
+            Block *block = *link;
+            if (block == marker.block) {
+                link = &block->next;
+                continue;
+            }
+            ZJSON_STAT(statReserved -= block->size);
+            *link = block->next;
+            block->next = freeBlocksHead;
+            freeBlocksHead = block;
+        }
+        if (blocksHead) blocksHead->used = marker.used;
     }
     void deallocate() {
+        clearRecycled();
+        ZJSON_STAT(statReserved = 0);
         freeBlockChain(blocksHead);
         blocksHead = nullptr;
         freeBlockChain(freeBlocksHead);
-        freeBlocksHead = nullptr;
+        freeBlocksHead = bufferBlock;
+        if (bufferBlock) bufferBlock->next = nullptr;
     }
 private:
     struct Block {
         Block *next;
         size_t used;
-        size_t size;
-    } *blocksHead, *freeBlocksHead;
+        size_t size; // capacity, including the header
+    } *blocksHead, *freeBlocksHead, *bufferBlock;
+    MemoryResource *upstream;
+    BlockPolicy policy;
+    size_t nextBlockSize;
+    RetentionPolicy retention;
+    uint32_t resets;
+    size_t history[ZJSON_RETAIN_HISTORY]; // block usage of the last resets
+    bool recycling;
+    uint32_t recycledMask; // bit c is set if recycled[c] is not empty
+    void *recycled[ZJSON_RECYCLE_MAX_SIZE / 8]; // free lists of chunks of (c + 1) * 8 bytes
+    Allocator *strings;
+    SourceSpans *sources;
+#ifdef ZJSON_ENABLE_STATS
+    size_t statRequested, statReserved, statHighWater;
+#endif
+
+    void *allocateBlock(size_t size) {
+        size_t allocSize = sizeof(Block) + size;
+        Block **bestLink = nullptr;
+        for (Block **link = &freeBlocksHead; *link; link = &(*link)->next) { // best fit in free blocks
+            if ((*link)->size >= allocSize && (!bestLink || (*link)->size < (*bestLink)->size)) {
+                bestLink = link;
+                if ((*link)->size == allocSize) break;
+            }
+        }
+        Block *block;
+        if (bestLink) { // reuse free block
+            block = *bestLink;
+            *bestLink = block->next;
+        }
+        else { // allocate new block, oversized requests get a block of their own
+            size_t blockSize = allocSize <= nextBlockSize ? nextBlockSize : allocSize;
+            block = upstream ? (Block *)upstream->allocate(blockSize) : nullptr;
+            if (!block) return nullptr;
+            block->size = blockSize;
+            if (allocSize <= nextBlockSize) {
+                nextBlockSize = (size_t)(nextBlockSize * policy.growthFactor);
+                if (nextBlockSize > policy.maxSize) nextBlockSize = policy.maxSize;
+            }
+        }
+        block->used = allocSize;
+        ZJSON_STAT(statReserved += block->size);
+        ZJSON_STAT(if (statReserved > statHighWater) statHighWater = statReserved);
+        if (!blocksHead || block->size - allocSize >= blocksHead->size - blocksHead->used) { // push_front
+            block->next = blocksHead;
+            blocksHead = block;
+        }
+        else { // insert, the head block has more room left
+            block->next = blocksHead->next;
+            blocksHead->next = block;
+        }
+        return (char *)block + sizeof(Block);
+    }
+    inline void clearRecycled() {
+        if (!recycledMask) return;
+        memset(recycled, 0, sizeof(recycled));
+        recycledMask = 0;
+    }
     inline void freeBlockChain(Block* block) {
         while (block) {
             Block* nextblock = block->next;
-            free(block);
+            if (block != bufferBlock) upstream->deallocate(block, block->size);
             block = nextblock;
         }
     }
 };
 
+#define ZJSON_STACK_SIZE 32
+// The open containers of a traversal. The first ZJSON_STACK_SIZE levels are inline, deeper
+// trees move it to twice the capacity each time, taken from an arena if given (and left
+// there until it is reset) or from the heap. T is copied with memcpy.
+template <typename T>
+class DepthStack {
+public:
+    explicit DepthStack(Allocator* arena = nullptr)
+        : _items(_inline), _capacity(ZJSON_STACK_SIZE), _arena(arena) {}
+    ~DepthStack() {
+        if (_items != _inline && !_arena) free(_items);
+    }
+    DepthStack(const DepthStack&) = delete;
+    DepthStack& operator=(const DepthStack&) = delete;
+    inline T& operator[](int i) { return _items[i]; }
+    // make room for index i, false if out of memory
+    inline bool reserve(int i) {
+        return ZJSON_LIKELY(i < _capacity) || grow(i);
+    }
+private:
+    T* _items;
+    int _capacity;
+    Allocator* _arena;
+    T _inline[ZJSON_STACK_SIZE];
+
+    bool grow(int i) {
+        int capacity = _capacity * 2;
+        while (capacity <= i) capacity *= 2;
+        size_t size = (size_t)capacity * sizeof(T);
+        T* items = (T*)(_arena ? _arena->allocate(size) : malloc(size));
+        if (!items) return false;
+        memcpy((void*)items, (const void*)_items, (size_t)_capacity * sizeof(T));
+        if (_items != _inline && !_arena) free(_items);
+        _items = items;
+        _capacity = capacity;
+        return true;
+    }
+};
+
 } // namespace zjson
@@ -18,6 +18,26 @@
 #define ZJSON_FORCE_INLINE inline
 #endif
 
+#if !defined(ZJSON_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define ZJSON_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// exceptions may be disabled, e.g. -fno-exceptions
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+#define ZJSON_HAS_EXCEPTIONS
+#endif
+
+// aligned vector loads may read past the end of a string, but never across a page
+#if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5)
+#define ZJSON_NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#else
+#define ZJSON_NO_SANITIZE_ADDRESS
+#endif
+
 namespace zjson {
 
 enum Type {
@@ -41,7 +61,16 @@ enum Error {
     ERROR_MISMATCH_BRACKET,
     ERROR_UNEXPECTED_CHARACTER,
     ERROR_BREAKING_BAD,
-    ERROR_OUT_OF_MEMORY
+    ERROR_OUT_OF_MEMORY,
+    ERROR_IO
+};
+enum ParseFlags {
+    PARSE_DEFAULT = 0,
+    PARSE_SHAPED_OBJECTS = 1,   // objects with the same key sequence share one shape
+    PARSE_KEEP_SOURCE = 2       // keep the input to dump unmodified parts as they were
 };
+inline ParseFlags operator|(ParseFlags a, ParseFlags b) {
+    return ParseFlags((int)a | (int)b);
+}
 
 } // namespace zjson
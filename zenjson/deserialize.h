@@ -114,7 +114,6 @@ ZJSON_FORCE_INLINE bool parseStringInternal(char*& s)
     return true;
 }
 
-#define ZJSON_STACK_SIZE 32
 #define ZJSON_SKIP_WHITESPACE \
     while (matchFlag(*s, FLAG_WHITESPACE)) {                            \
         do {                                                            \
@@ -128,9 +127,18 @@ ZJSON_FORCE_INLINE bool parseStringInternal(char*& s)
         while (*s && *s != '\n' && *s != '\r') ++s;                     \
     }
 
-int jsonParse(char *s, Value *value, Allocator &allocator) {
-    Node *tails[ZJSON_STACK_SIZE];
-    uint8_t endchars[ZJSON_STACK_SIZE];
+// an open container while parsing
+struct ParseFrame {
+    Node *tail;
+    Allocator::Marker mark; // scratch position of an open object
+    const char *begin;      // the opening bracket, for the source span
+    uint8_t endchar;
+};
+
+template <bool Shaped, bool Spans>
+int jsonParseInternal(char *s, Value *value, Allocator &allocator, ShapeTable *shapes, SourceSpans *spans) {
+    DepthStack<ParseFrame> stack(&allocator); // deep documents grow it in the arena
+    const char *start = s;
     int top = -1;
     Node *node;
 
@@ -139,8 +147,10 @@ int jsonParse(char *s, Value *value, Allocator &allocator) {
     uint8_t ch = *s;
     if (ch == '{' || ch == '[') {
         ++top;
-        tails[top] = nullptr;
-        endchars[top] = ch + 2;
+        stack[top].tail = nullptr;
+        stack[top].endchar = ch + 2;
+        if (Shaped) stack[top].mark = shapes->scratch().mark();
+        if (Spans) stack[top].begin = s;
     }
     else {
         return ERROR_BAD_ROOT; // Root value must be an object or array
@@ -152,28 +162,35 @@ int jsonParse(char *s, Value *value, Allocator &allocator) {
         ZJSON_SKIP_WHITESPACE;
         ch = *s;
         if (ch == ',') {
-            if (ZJSON_UNLIKELY(!tails[top]))
+            if (ZJSON_UNLIKELY(!stack[top].tail))
                 return ERROR_MISMATCH_BRACKET;
             ++s;
             ZJSON_SKIP_WHITESPACE;
             ch = *s;
         }
-        else if (ZJSON_UNLIKELY(tails[top] && (ch != endchars[top])))
+        else if (ZJSON_UNLIKELY(stack[top].tail && (ch != stack[top].endchar)))
             return ERROR_MISMATCH_BRACKET;
 
-        while (ch == endchars[top]) {
+        while (ch == stack[top].endchar) {
             ++s;
             for (;;) {
                 if (ZJSON_UNLIKELY(top == -1))
                     return ERROR_STACK_UNDERFLOW;
-                Type t = endchars[top] == '}' ? JSON_OBJECT : JSON_ARRAY;
-                Value v = listToValue(t, tails[top--]);
+                Type t = stack[top].endchar == '}' ? JSON_OBJECT : JSON_ARRAY;
+                Value v = listToValue(t, stack[top--].tail);
+                if (Shaped && t == JSON_OBJECT) {
+                    if (ZJSON_UNLIKELY(!shapes->shapeObject(&v, allocator)))
+                        return ERROR_OUT_OF_MEMORY;
+                    shapes->scratch().rewind(stack[top + 1].mark);
+                }
+                if (Spans && ZJSON_UNLIKELY(!spans->add(v, stack[top + 1].begin - start, s - start, allocator)))
+                    return ERROR_OUT_OF_MEMORY;
 
                 if (top == -1) {
                     *value = v;
                     return ERROR_NO_ERROR;
                 }
-                tails[top]->value = v;
+                stack[top].tail->value = v;
 
                 ZJSON_SKIP_WHITESPACE;
                 if (*s == ',') {
@@ -182,24 +199,25 @@ int jsonParse(char *s, Value *value, Allocator &allocator) {
                     ch = *s;
                     break;
                 }
-                if (ZJSON_UNLIKELY(*s++ != endchars[top]))
+                if (ZJSON_UNLIKELY(*s++ != stack[top].endchar))
                     return ERROR_MISMATCH_BRACKET;
             }
         }
 
-        if (endchars[top] == ']') { // JSON_ARRAY
+        if (stack[top].endchar == ']') { // JSON_ARRAY
             if (ZJSON_UNLIKELY((node = (Node *)allocator.allocate(sizeof(Node) - sizeof(char *))) == nullptr))
                 return ERROR_OUT_OF_MEMORY;
-            tails[top] = insertAfter(tails[top], node);
+            stack[top].tail = insertAfter(stack[top].tail, node);
         }
         else { // JSON_OBJECT
-            if (ZJSON_UNLIKELY((node = (Node *)allocator.allocate(sizeof(Node))) == nullptr))
+            Allocator &nodeAllocator = Shaped ? shapes->scratch() : allocator;
+            if (ZJSON_UNLIKELY((node = (Node *)nodeAllocator.allocate(sizeof(Node))) == nullptr))
                 return ERROR_OUT_OF_MEMORY;
-            tails[top] = insertAfter(tails[top], node);
+            stack[top].tail = insertAfter(stack[top].tail, node);
 
             // parse a key
             if (ZJSON_UNLIKELY(ch != '"')) return ERROR_UNEXPECTED_CHARACTER;
-            tails[top]->name = ++s;
+            stack[top].tail->name = ++s;
             if (ZJSON_UNLIKELY(!parseStringInternal(s))) return ERROR_BAD_STRING;
 
             ZJSON_SKIP_WHITESPACE;
@@ -214,22 +232,24 @@ int jsonParse(char *s, Value *value, Allocator &allocator) {
         case '{':
         case '[': { // start a JSON object or a JSON array
             ++s;
-            if (ZJSON_UNLIKELY(++top == ZJSON_STACK_SIZE))
-                return ERROR_STACK_OVERFLOW;
-            tails[top] = nullptr;
-            endchars[top] = ch + 2;
+            if (ZJSON_UNLIKELY(!stack.reserve(++top)))
+                return ERROR_OUT_OF_MEMORY;
+            stack[top].tail = nullptr;
+            stack[top].endchar = ch + 2;
+            if (Shaped) stack[top].mark = shapes->scratch().mark();
+            if (Spans) stack[top].begin = s - 1;
             break;
         }
         case '"': { // JSON string
             ++s;
-            tails[top]->value = Value(JSON_STRING, s);
+            stack[top].tail->value = Value(JSON_STRING, s);
             if (ZJSON_UNLIKELY(!parseStringInternal(s))) return ERROR_BAD_STRING;
             break;
         }
         case 'n': { // JSON null
             if (ZJSON_LIKELY(s[1] == 'u' && s[2] == 'l' && s[3] == 'l')) {
                 s += 4;
-                tails[top]->value = Value(JSON_NULL);
+                stack[top].tail->value = Value(JSON_NULL);
             }
             else return ERROR_BAD_IDENTIFIER;
             break;
@@ -237,7 +257,7 @@ int jsonParse(char *s, Value *value, Allocator &allocator) {
         case 't': { // JSON true
             if (ZJSON_LIKELY(s[1] == 'r' && s[2] == 'u' && s[3] == 'e')) {
                 s += 4;
-                tails[top]->value = Value(JSON_TRUE);
+                stack[top].tail->value = Value(JSON_TRUE);
             }
             else return ERROR_BAD_IDENTIFIER;
             break;
@@ -245,7 +265,7 @@ int jsonParse(char *s, Value *value, Allocator &allocator) {
         case 'f': { // JSON false
             if (ZJSON_LIKELY(s[1] == 'a' && s[2] == 'l' && s[3] == 's' && s[4] == 'e')) {
                 s += 5;
-                tails[top]->value = Value(JSON_FALSE);
+                stack[top].tail->value = Value(JSON_FALSE);
             }
             else return ERROR_BAD_IDENTIFIER;
             break;
@@ -282,7 +302,7 @@ int jsonParse(char *s, Value *value, Allocator &allocator) {
 
             if (!matchFlag(ch, FLAG_NUMBER)) {
                 if (negative) n32 = -n32;
-                tails[top]->value = Value(n32);
+                stack[top].tail->value = Value(n32);
             }
             else {
                 double d = static_cast<double>(n32);
@@ -331,7 +351,7 @@ int jsonParse(char *s, Value *value, Allocator &allocator) {
                 exponent += (negativeE ? -exp : exp);
                 if (exponent) d *= pow10(exponent);
                 if (negative) d = -d;
-                tails[top]->value = Value(d);
+                stack[top].tail->value = Value(d);
             }
             break;
         }
@@ -343,4 +363,15 @@ int jsonParse(char *s, Value *value, Allocator &allocator) {
     return ERROR_BREAKING_BAD;
 }
 
+// parse in-situ, objects are shaped if a shape table is given, and the span of each
+// container is recorded if source spans are given
+int jsonParse(char *s, Value *value, Allocator &allocator, ShapeTable *shapes = nullptr, SourceSpans *spans = nullptr) {
+    if (spans) {
+        if (shapes) return jsonParseInternal<true, true>(s, value, allocator, shapes, spans);
+        return jsonParseInternal<false, true>(s, value, allocator, nullptr, spans);
+    }
+    if (shapes) return jsonParseInternal<true, false>(s, value, allocator, shapes, nullptr);
+    return jsonParseInternal<false, false>(s, value, allocator, nullptr, nullptr);
+}
+
 } // namespace zjson
@@ -0,0 +1,148 @@
+#include <atomic>
+
+namespace zjson {
+
+#define ZJSON_POOL_MIN_SHIFT    12          // the smallest pooled block is 4KB
+#define ZJSON_POOL_CLASSES      9           // power of two size classes, 4KB ~ 1MB
+#define ZJSON_POOL_CACHE_SIZE   8           // blocks of each size class in a thread cache
+#define ZJSON_POOL_STATS_BATCH  256         // thread counters are published in batches
+#define ZJSON_POOL_TAG_SHIFT    48          // bits of a pointer in a tagged list head
+
+// A process-wide pool of allocator blocks. Each thread keeps a small cache, and the
+// overflow goes to lock-free global free lists, so documents on any thread reuse the
+// blocks of each other instead of hitting malloc. Blocks larger than the biggest size
+// class are not pooled. Use it as the upstream of documents:
+//     zjson::Document doc(nullptr, 0, &zjson::BlockPool::instance());
+class BlockPool final : public MemoryResource {
+public:
+    struct Stats {
+        uint64_t cacheHits;     // served by the thread cache
+        uint64_t globalHits;    // served by the global free lists
+        uint64_t misses;        // served by malloc
+    };
+    static BlockPool &instance() {
+        static BlockPool s_pool;
+        return s_pool;
+    }
+    void *allocate(size_t size) override {
+        int c = sizeClass(size);
+        ThreadCache &cache = threadCache();
+        if (c < 0) {
+            cache.count(cache.misses);
+            return malloc(size);
+        }
+        if (cache.counts[c]) {
+            cache.count(cache.cacheHits);
+            return cache.blocks[c][--cache.counts[c]];
+        }
+        if (void *block = pop(c)) {
+            cache.count(cache.globalHits);
+            return block;
+        }
+        cache.count(cache.misses);
+        return malloc(classSize(c));
+    }
+    void deallocate(void *ptr, size_t size) override {
+        int c = sizeClass(size);
+        if (c < 0) {
+            free(ptr);
+            return;
+        }
+        ThreadCache &cache = threadCache();
+        if (cache.counts[c] < ZJSON_POOL_CACHE_SIZE)
+            cache.blocks[c][cache.counts[c]++] = ptr;
+        else
+            push(c, ptr);
+    }
+    // allocators hand blocks back on reset, so idle documents hold no memory
+    bool retainsFreeBlocks() const override { return false; }
+    // approximate, thread counters are published every ZJSON_POOL_STATS_BATCH operations
+    Stats getStats() const {
+        return Stats { _cacheHits.load(std::memory_order_relaxed), _globalHits.load(std::memory_order_relaxed),
+            _misses.load(std::memory_order_relaxed) };
+    }
+    // free the blocks of global lists, only when no other thread is using the pool
+    void release() {
+        for (int c = 0; c < ZJSON_POOL_CLASSES; c++) {
+            while (void *block = pop(c)) free(block);
+        }
+    }
+private:
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+    struct ThreadCache {
+        void *blocks[ZJSON_POOL_CLASSES][ZJSON_POOL_CACHE_SIZE];
+        uint8_t counts[ZJSON_POOL_CLASSES];
+        uint32_t cacheHits, globalHits, misses, pending;
+        ThreadCache() : cacheHits(0), globalHits(0), misses(0), pending(0) {
+            memset(counts, 0, sizeof(counts));
+        }
+        ~ThreadCache() { // the thread exits, give its blocks to other threads
+            BlockPool &pool = instance();
+            for (int c = 0; c < ZJSON_POOL_CLASSES; c++) {
+                while (counts[c]) pool.push(c, blocks[c][--counts[c]]);
+            }
+            publish();
+        }
+        inline void count(uint32_t &counter) {
+            counter++;
+            if (++pending == ZJSON_POOL_STATS_BATCH) publish();
+        }
+        void publish() {
+            BlockPool &pool = instance();
+            pool._cacheHits.fetch_add(cacheHits, std::memory_order_relaxed);
+            pool._globalHits.fetch_add(globalHits, std::memory_order_relaxed);
+            pool._misses.fetch_add(misses, std::memory_order_relaxed);
+            cacheHits = globalHits = misses = pending = 0;
+        }
+    };
+    // heads are tagged pointers, the upper 16 bits count updates against ABA
+    std::atomic<uint64_t> _heads[ZJSON_POOL_CLASSES];
+    std::atomic<uint64_t> _cacheHits, _globalHits, _misses;
+
+    BlockPool() : _cacheHits(0), _globalHits(0), _misses(0) {
+        for (int c = 0; c < ZJSON_POOL_CLASSES; c++) _heads[c].store(0);
+    }
+    ~BlockPool() {
+        release();
+    }
+    static inline ThreadCache &threadCache() {
+        static thread_local ThreadCache s_cache;
+        return s_cache;
+    }
+    static inline int sizeClass(size_t size) {
+        int c = 0;
+        while (((size_t)1 << (c + ZJSON_POOL_MIN_SHIFT)) < size) c++;
+        return c < ZJSON_POOL_CLASSES ? c : -1;
+    }
+    static inline size_t classSize(int c) {
+        return (size_t)1 << (c + ZJSON_POOL_MIN_SHIFT);
+    }
+    static inline FreeBlock *untag(uint64_t head) {
+        return (FreeBlock *)(uintptr_t)(head & ((1ULL << ZJSON_POOL_TAG_SHIFT) - 1));
+    }
+    static inline uint64_t tag(FreeBlock *block, uint64_t head) {
+        return (uintptr_t)block | (((head >> ZJSON_POOL_TAG_SHIFT) + 1) << ZJSON_POOL_TAG_SHIFT);
+    }
+    void push(int c, void *ptr) {
+        FreeBlock *block = (FreeBlock *)ptr;
+        uint64_t head = _heads[c].load(std::memory_order_relaxed);
+        do {
+            block->next = untag(head);
+        } while (!_heads[c].compare_exchange_weak(head, tag(block, head),
+            std::memory_order_release, std::memory_order_relaxed));
+    }
+    void *pop(int c) {
+        uint64_t head = _heads[c].load(std::memory_order_acquire);
+        FreeBlock *block;
+        do {
+            block = untag(head);
+            if (!block) return nullptr;
+        } while (!_heads[c].compare_exchange_weak(head, tag(block->next, head),
+            std::memory_order_acquire, std::memory_order_acquire));
+        return block;
+    }
+};
+
+} // namespace zjson
@@ -1,21 +1,86 @@
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
+
 namespace zjson {
 
+#define ZJSON_WRITER_CAPACITY           256     // initial capacity of the string of a StringWriter
+#define ZJSON_STREAM_BUFFER_SIZE        65536   // buffer of a StreamWriter
+#define ZJSON_INDENT_BUFFER_SIZE        256     // tabs or spaces written at once
+#define ZJSON_CANONICAL_SCRATCH_SIZE    2048    // stack memory of a canonical dump, before the heap
+#define ZJSON_SHAPE_ORDER_CACHE_SIZE    64      // sorted shapes cached in a canonical dump
+#define ZJSON_PARALLEL_BATCHES          8       // per thread, a thread done early takes more of them
+
+enum NumberMode {
+    NUMBER_SHORTEST,    // the shortest digits that read back to the same double
+    NUMBER_FIXED,       // rounded to a number of decimal places
+    NUMBER_PRECISION,   // at most a number of significant digits
+    NUMBER_FLOAT32,     // the shortest digits that read back to the same float
+    NUMBER_ECMASCRIPT   // the shortest digits as ECMAScript writes them, 1e+21
+};
+// How a dump writes doubles, integers are always written in full
+struct NumberFormat {
+    NumberMode mode;
+    int digits;         // decimal places for NUMBER_FIXED, significant digits for NUMBER_PRECISION
+    NumberFormat(NumberMode mode = NUMBER_SHORTEST, int digits = 0) : mode(mode), digits(digits) {}
+};
+
+// Writers keep their state in the instance only, threads could dump at the same time
 template <typename T>
 class Writer : public T {
 public:
+    inline Writer() : T(), _error(ERROR_NO_ERROR) {}
     template <typename I>
-    inline Writer(I& init) : T(init) {}
+    inline Writer(I& init) : T(init), _error(ERROR_NO_ERROR) {}
     template <typename I, typename J>
-    inline Writer(I& init1, J& init2) : T(init1, init2) {}
+    inline Writer(I& init1, J& init2) : T(init1, init2), _error(ERROR_NO_ERROR) {}
+    inline void setNumberFormat(const NumberFormat& format) { _numbers = format; }
+    inline const NumberFormat& getNumberFormat() const { return _numbers; }
+    // a dump that couldn't go on records why and stops, the output is incomplete then.
+    // ERROR_OUT_OF_MEMORY if a deep document needed more memory, or an error of T.
+    inline void fail(int error) {
+        if (_error == ERROR_NO_ERROR) _error = error;
+    }
+    inline int getError() const { return _error != ERROR_NO_ERROR ? _error : T::getError(); }
+    // a hint of the bytes to be written next
+    inline void reserve(size_t l) { T::reserve(l); }
     inline void puts(const char* pStr, size_t l) { T::puts(pStr, l); }
     inline void putc(char c) { T::putc(c); }
     inline void writeNumber(double d) {
-        static char buffer[25];
+        if (ZJSON_UNLIKELY(_numbers.mode != NUMBER_SHORTEST)) {
+            char buffer[32];
+            int length;
+            switch (_numbers.mode) {
+            case NUMBER_FIXED: length = dtoa_fixed(d, _numbers.digits, buffer); break;
+            case NUMBER_PRECISION: length = dtoa_precision(d, _numbers.digits, buffer); break;
+            case NUMBER_ECMASCRIPT: length = dtoa_ecmascript(d, buffer); break;
+            default: length = dtoa_float32(d, buffer); break;
+            }
+            puts(buffer, length);
+            return;
+        }
+#ifdef ZJSON_USE_DTOA_MILO
+        char buffer[32];
         dtoa_milo(d, buffer);
         puts(buffer, strlen(buffer));
+#else
+        char buffer[32];
+        puts(buffer, dtoa_schubfach(d, buffer));
+#endif
     }
     inline void writeInt(int32_t n) {
-        static char buffer[10];
+        char buffer[12];
         char* end = i32toa(n, buffer);
         puts(buffer, end - buffer);
     }
@@ -23,30 +88,70 @@ public:
         static const char* s_to_hex = "0123456789abcdef";
         const char* s = str;
         putc('"');
-        while (*s) {
+        for (;;) {
+            const char* run = s;
+            s = skipUnescaped(s);
+            if (s != run) puts(run, s - run); // the clean run in one copy
             uint8_t c = *s++;
-            if (c >= ' ' && c != '"' && c != '\\')
-                putc(c);
+            if (!c) break;
+            char escape = escapeTable()[c];
+            if (escape != 'u') {
+                char buffer[2] = { '\\', escape };
+                puts(buffer, 2);
+            }
             else {
-                putc('\\');
-                switch (c) {
-                case '\b': putc('b'); break;
-                case '\r': putc('r'); break;
-                case '\t': putc('t'); break;
-                case '\f': putc('f'); break;
-                case '\n': putc('n'); break;
-                case '\\': putc('\\'); break;
-                case '\"': putc('\"'); break;
-                default:
-                    puts("u00", 3);
-                    putc(s_to_hex[c >> 4]);
-                    putc(s_to_hex[c & 0xF]);
-                    break;
-                }
+                char buffer[6] = { '\\', 'u', '0', '0', s_to_hex[c >> 4], s_to_hex[c & 0xF] };
+                puts(buffer, 6);
             }
         }
         putc('"');
     }
+private:
+    NumberFormat _numbers;
+    int _error;
+
+    // the character after a backslash to escape a byte, 'u' for \u00XX, 0 if not escaped
+    static const char* escapeTable() {
+        static const char s_escapes[256] = {
+            'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+            'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+            0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,
+        };
+        return s_escapes;
+    }
+    // the first byte to escape or the terminating zero
+    ZJSON_NO_SANITIZE_ADDRESS static inline const char* skipUnescaped(const char* s) {
+        const char* escapes = escapeTable();
+#ifdef ZJSON_SSE2
+        for (; (uintptr_t)s & 15; s++) {
+            if (escapes[(uint8_t)*s]) return s;
+        }
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        const __m128i control = _mm_set1_epi8(0x1F);
+        for (;; s += 16) {
+            __m128i x = _mm_load_si128((const __m128i*)s);
+            __m128i m = _mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, backslash));
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_max_epu8(x, control), control)); // x <= 0x1F, zero included
+            int mask = _mm_movemask_epi8(m);
+            if (mask) {
+#ifdef _MSC_VER
+                unsigned long offset;
+                _BitScanForward(&offset, mask);
+                return s + offset;
+#else
+                return s + __builtin_ctz(mask);
+#endif
+            }
+        }
+#else
+        while (!escapes[(uint8_t)*s]) s++;
+        return s;
+#endif
+    }
 };
 
 class BufferWriter {
@@ -56,7 +161,9 @@ public:
     {
     }
     inline size_t size() const { return _dst - _head; }
+    inline int getError() const { return ERROR_NO_ERROR; } // a short buffer is told by size()
     inline void reset() { _dst = _head; }
+    inline void reserve(size_t) {}
     inline void puts(const char* str, size_t l) {
         if (_dst + l <= _end)
             memcpy(_dst, str, l);
@@ -66,18 +173,47 @@ public:
         if (_dst < _end) *_dst = c;
         _dst++;
     }
-    inline void writeTabs(size_t n) {
-        if (_dst + n <= _end)
-            memset(_dst, '\t', n);
-        _dst += n;
-    }
 private:
     char* _dst;
     char* _head;
     char* _end;
 };
 
-#define ZJSON_WRITER_CAPACITY  256
+// Counts the bytes only, to measure the output
+class CountingWriter {
+public:
+    inline CountingWriter() : _size(0) {}
+    inline size_t size() const { return _size; }
+    inline int getError() const { return ERROR_NO_ERROR; }
+    inline void reset() { _size = 0; }
+    inline void reserve(size_t) {}
+    inline void puts(const char*, size_t l) { _size += l; }
+    inline void putc(char) { _size++; }
+private:
+    size_t _size;
+};
+
+// Counts the bytes of everything but doubles, which count as the most they could take.
+// An upper bound of the output without formatting a single double.
+class BoundingWriter : public CountingWriter {};
+
+// the most bytes a double could be written in, from its binary exponent alone. between
+// 1 and 1e21 it's the integer digits or 17 digits and a point, 25 bytes at most otherwise:
+// a sign, 17 digits, "0." and 5 zeros, or a point and an exponent of "e-" and 3 digits.
+inline int numberBound(double d, const NumberFormat& format) {
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    int e2 = (int)((bits >> 52) & 0x7FF) - 1023;
+    int integers = e2 < 0 ? 1 : schubfachLog10Pow2(e2 + 1) + 1; // |d| < 2^(e2 + 1) < 10^integers
+    if (format.mode == NUMBER_FIXED && integers + format.digits <= 15) // not in the shortest form
+        return 2 + integers + (format.digits > 0 ? format.digits : 0);
+    if (e2 >= 0 && integers <= 21) return 1 + (integers > 18 ? integers : 18);
+    return 25;
+}
+
+template <>
+inline void Writer<BoundingWriter>::writeNumber(double d) { puts(nullptr, numberBound(d, _numbers)); }
+
 class StringWriter {
 public:
     inline StringWriter(std::string& buffer)
@@ -88,86 +224,672 @@ public:
         _buffer.clear();
     }
     inline size_t size() const { return _buffer.size(); }
+    inline int getError() const { return ERROR_NO_ERROR; }
     inline void reset() { _buffer.clear(); }
+    inline void reserve(size_t l) { _buffer.reserve(_buffer.size() + l); }
     inline void puts(const char* str, size_t l) { _buffer.insert(_buffer.end(), str, str + l); }
     inline void putc(char c) { _buffer.push_back(c); }
-    inline void writeTabs(size_t n) { _buffer.insert(_buffer.end(), n, '\t'); }
 private:
     std::string& _buffer;
 };
 
+// Where a StreamWriter flushes to, a file descriptor, a FILE* or a callback which
+// returns false on failure.
+struct Sink {
+    typedef bool (*Callback)(void* context, const char* data, size_t size);
+    static Sink fromFd(int fd) {
+        return Sink { KIND_FD, fd, nullptr, nullptr, nullptr };
+    }
+    static Sink fromFile(FILE* file) {
+        return Sink { KIND_FILE, -1, file, nullptr, nullptr };
+    }
+    static Sink fromCallback(Callback callback, void* context = nullptr) {
+        return Sink { KIND_CALLBACK, -1, nullptr, callback, context };
+    }
+    enum Kind { KIND_FD, KIND_FILE, KIND_CALLBACK } kind;
+    int fd;
+    FILE* file;
+    Callback callback;
+    void* context;
+};
+
+// Writes through a fixed buffer to a sink, the memory used doesn't depend on the size
+// of the output. After an I/O error nothing is written anymore, see getError().
+class StreamWriter {
+public:
+    inline StreamWriter(const Sink& sink)
+        : _sink(sink), _pos(_buffer), _written(0), _error(ERROR_NO_ERROR), _errno(0) {}
+    inline size_t size() const { return _written + (_pos - _buffer); }
+    inline void reserve(size_t) {}
+    inline void puts(const char* str, size_t l) {
+        if (ZJSON_LIKELY(l <= (size_t)(_buffer + ZJSON_STREAM_BUFFER_SIZE - _pos))) {
+            memcpy(_pos, str, l);
+            _pos += l;
+        }
+        else if (l < ZJSON_STREAM_BUFFER_SIZE / 2) {
+            flush();
+            memcpy(_pos, str, l);
+            _pos += l;
+        }
+        else { // a long string goes out together with the buffer
+            write(str, l);
+        }
+    }
+    inline void putc(char c) {
+        if (ZJSON_UNLIKELY(_pos == _buffer + ZJSON_STREAM_BUFFER_SIZE)) flush();
+        *_pos++ = c;
+    }
+    // write out the buffer, returns ERROR_NO_ERROR or ERROR_IO
+    int flush() {
+        write(nullptr, 0);
+        if (_error == ERROR_NO_ERROR && _sink.kind == Sink::KIND_FILE && fflush(_sink.file) != 0)
+            fail();
+        return _error;
+    }
+    inline int getError() const { return _error; }
+    // errno of the failed call, 0 if a callback failed
+    inline int getErrno() const { return _errno; }
+private:
+    Sink _sink;
+    char* _pos;
+    size_t _written;
+    int _error, _errno;
+    char _buffer[ZJSON_STREAM_BUFFER_SIZE];
+
+    // write the buffer and then data, the buffer is empty afterwards
+    void write(const char* data, size_t size) {
+        size_t buffered = _pos - _buffer;
+        _pos = _buffer;
+        if (_error != ERROR_NO_ERROR || (!buffered && !size)) return;
+        _written += buffered + size;
+        switch (_sink.kind) {
+        case Sink::KIND_FD:
+#if defined(_WIN32)
+            if (!writeFd(_buffer, buffered) || !writeFd(data, size)) fail();
+#else
+            {
+                struct iovec iov[2] = { { _buffer, buffered }, { (void*)data, size } };
+                int count = 2, first = buffered ? 0 : 1;
+                while (first < count) {
+                    ssize_t n = ::writev(_sink.fd, iov + first, count - first);
+                    if (n < 0) {
+                        if (errno == EINTR) continue;
+                        fail();
+                        return;
+                    }
+                    while (first < count && (size_t)n >= iov[first].iov_len) n -= iov[first++].iov_len;
+                    if (first < count) {
+                        iov[first].iov_base = (char*)iov[first].iov_base + n;
+                        iov[first].iov_len -= n;
+                    }
+                }
+            }
+#endif
+            break;
+        case Sink::KIND_FILE:
+            if ((buffered && fwrite(_buffer, 1, buffered, _sink.file) != buffered) ||
+                (size && fwrite(data, 1, size, _sink.file) != size))
+                fail();
+            break;
+        case Sink::KIND_CALLBACK:
+            if ((buffered && !_sink.callback(_sink.context, _buffer, buffered)) ||
+                (size && !_sink.callback(_sink.context, data, size))) {
+                errno = 0;
+                fail();
+            }
+            break;
+        }
+    }
+#if defined(_WIN32)
+    bool writeFd(const char* data, size_t size) {
+        while (size) {
+            int n = _write(_sink.fd, data, size > 0x40000000 ? 0x40000000 : (unsigned)size);
+            if (n < 0) return false;
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+#endif
+    void fail() {
+        _error = ERROR_IO;
+        _errno = errno;
+    }
+};
+
+// The layout of a dump, compact, indented with tabs (formatted = true) or with spaces
+struct DumpStyle {
+    bool formatted;
+    int spaces;         // 0 for tabs
+    bool canonical;     // RFC 8785, compact with sorted names and ECMAScript numbers
+    bool verbatim;      // compact, unmodified containers copied from the input
+    DumpStyle(bool formatted = true) : formatted(formatted), spaces(0), canonical(false), verbatim(false) {}
+    static DumpStyle indent(int spaces) {
+        DumpStyle style(spaces > 0);
+        style.spaces = spaces;
+        return style;
+    }
+    // byte-stable output for hashing and comparing documents
+    static DumpStyle rfc8785() {
+        DumpStyle style(false);
+        style.canonical = true;
+        return style;
+    }
+    // for a document parsed with PARSE_KEEP_SOURCE, only what was modified is written anew,
+    // the rest keeps its original text and whitespace. other values are dumped compact.
+    static DumpStyle roundTrip() {
+        DumpStyle style(false);
+        style.verbatim = true;
+        return style;
+    }
+};
+
+// an open container while dumping, the next member or element to write
+struct DumpFrame {
+    const Node* node;
+    const Value* values;        // of a shaped or sorted object
+    char* const* names;
+    uint32_t remaining;
+    bool isObject;
+    Allocator::Marker mark;     // of the scratch memory of a sorted object
+};
+
+// a member or element of an object or array, in the order it is written
+struct DumpChild {
+    char* name;
+    const Value* value;
+};
+
+// Layout policies of Value::dumpWith, the compact one has no formatting branches at all
+struct CompactFormat {
+    template <typename T> inline bool copy(T&, const Value&) const { return false; }
+    inline bool sort(DumpFrame&, const Value&) const { return true; }
+    inline void release(const DumpFrame&) const {}
+    template <typename T> inline void newline(T&) const {}
+    template <typename T> inline void indent(T&, int) const {}
+    template <typename T> inline void comma(T& out) const { out.putc(','); }
+    template <typename T> inline void colon(T& out) const { out.putc(':'); }
+    template <typename T> inline void empty(T& out, char open, char close) const {
+        char buffer[2] = { open, close };
+        out.puts(buffer, 2);
+    }
+};
+
+// Indents with runs of a precomputed buffer of tabs or spaces
+class PrettyFormat {
+public:
+    static PrettyFormat tabs() { return PrettyFormat(indentBuffers().tabs, 1); }
+    static PrettyFormat spaces(int width) { return PrettyFormat(indentBuffers().spaces, width); }
+    template <typename T> inline bool copy(T&, const Value&) const { return false; }
+    inline bool sort(DumpFrame&, const Value&) const { return true; }
+    inline void release(const DumpFrame&) const {}
+    template <typename T> inline void newline(T& out) const { out.putc('\n'); }
+    template <typename T> inline void indent(T& out, int depth) const {
+        size_t n = (size_t)depth * _width;
+        for (; n > ZJSON_INDENT_BUFFER_SIZE; n -= ZJSON_INDENT_BUFFER_SIZE)
+            out.puts(_buffer, ZJSON_INDENT_BUFFER_SIZE);
+        out.puts(_buffer, n);
+    }
+    template <typename T> inline void comma(T& out) const { out.puts(", ", 2); }
+    template <typename T> inline void colon(T& out) const { out.puts(" : ", 3); }
+    template <typename T> inline void empty(T& out, char open, char close) const {
+        char buffer[3] = { open, ' ', close };
+        out.puts(buffer, 3);
+    }
+private:
+    struct IndentBuffers {
+        char tabs[ZJSON_INDENT_BUFFER_SIZE];
+        char spaces[ZJSON_INDENT_BUFFER_SIZE];
+        IndentBuffers() {
+            memset(tabs, '\t', sizeof(tabs));
+            memset(spaces, ' ', sizeof(spaces));
+        }
+    };
+    static const IndentBuffers& indentBuffers() {
+        static const IndentBuffers s_buffers;
+        return s_buffers;
+    }
+    PrettyFormat(const char* buffer, int width) : _buffer(buffer), _width(width) {}
+
+    const char* _buffer;
+    size_t _width;
+};
+
+// <0, 0 or >0 as the names compare in UTF-16 code units. UTF-8 bytes are in the order of
+// code points, which differs only between U+E000-U+FFFF (lead bytes EE-EF) and the
+// supplementary characters (lead bytes F0-F4), surrogate pairs in UTF-16.
+inline int compareUtf16(const char* a, const char* b) {
+    const uint8_t* x = (const uint8_t*)a;
+    const uint8_t* y = (const uint8_t*)b;
+    while (*x == *y && *x) {
+        x++;
+        y++;
+    }
+    if (*x >= 0xEE && *y >= 0xEE && (*x >= 0xF0) != (*y >= 0xF0))
+        return *x >= 0xF0 ? -1 : 1;
+    return (int)*x - (int)*y;
+}
+
+// RFC 8785: compact, the members of an object sorted by their names. An object is dumped
+// from sorted copies of its names and values in a scratch allocator, released when it is
+// closed, the DOM is not modified. The order of a shape is computed once per dump.
+class CanonicalFormat : public CompactFormat {
+public:
+    // the memory of a canonical dump, the first blocks are on the stack
+    class Scratch {
+    public:
+        Scratch()
+            : _members(defaultBlockPolicy(), defaultResource(), _membersBuffer, sizeof(_membersBuffer)),
+            _orders(defaultBlockPolicy(), defaultResource(), _ordersBuffer, sizeof(_ordersBuffer))
+        {
+            memset(_cache, 0, sizeof(_cache));
+        }
+    private:
+        friend class CanonicalFormat;
+        struct ShapeOrder {
+            const Shape* shape;
+            char** names;       // sorted
+            uint32_t* indices;  // of the values in the order of the names
+            bool ordered;       // the names of the shape are in order already
+        };
+        Allocator _members;     // per object
+        Allocator _orders;      // per shape, for the whole dump
+        ShapeOrder _cache[ZJSON_SHAPE_ORDER_CACHE_SIZE];
+        char _membersBuffer[ZJSON_CANONICAL_SCRATCH_SIZE];
+        char _ordersBuffer[ZJSON_CANONICAL_SCRATCH_SIZE];
+    };
+    explicit CanonicalFormat(Scratch& scratch) : _scratch(&scratch) {}
+
+    // false if out of memory
+    inline bool sort(DumpFrame& frame, const Value& object) const {
+        Allocator& members = _scratch->_members;
+        frame.mark = members.mark();
+        // an object already in order is written as it is
+        if (object.isShaped()) {
+            ShapedObject* shaped = object.toShaped();
+            const Value* source = shaped->values();
+            const Scratch::ShapeOrder* order = shapeOrder(shaped->shape, source);
+            if (ZJSON_UNLIKELY(!order)) return false;
+            if (order->ordered) return true;
+            Value* values = allocate<Value>(members, shaped->shape->length);
+            if (ZJSON_UNLIKELY(!values)) return false;
+            for (uint32_t i = 0; i < shaped->shape->length; i++) values[i] = source[order->indices[i]];
+            frame.names = order->names;
+            frame.values = values;
+            return true;
+        }
+        uint32_t length = 1;
+        bool ordered = true;
+        for (const Node* node = frame.node; node->next; node = node->next, length++) {
+            if (ordered && compareUtf16(node->name, node->next->name) > 0) ordered = false;
+        }
+        if (ordered) return true;
+        DumpChild* sorted = allocate<DumpChild>(members, length);
+        char** names = allocate<char*>(members, length);
+        Value* values = allocate<Value>(members, length);
+        if (ZJSON_UNLIKELY(!sorted || !names || !values)) return false;
+        DumpChild* m = sorted;
+        for (const Node* node = frame.node; node; node = node->next, m++) {
+            m->name = node->name;
+            m->value = &node->value;
+        }
+        std::sort(sorted, sorted + length, less);
+        for (uint32_t i = 0; i < length; i++) {
+            names[i] = sorted[i].name;
+            values[i] = *sorted[i].value;
+        }
+        frame.node = nullptr;
+        frame.names = names;
+        frame.values = values;
+        frame.remaining = length;
+        return true;
+    }
+    inline void release(const DumpFrame& frame) const {
+        if (frame.isObject) _scratch->_members.rewind(frame.mark);
+    }
+    static bool less(const DumpChild& a, const DumpChild& b) {
+        return compareUtf16(a.name, b.name) < 0;
+    }
+private:
+    template <typename U>
+    static U* allocate(Allocator& allocator, size_t count) {
+        return (U*)allocator.allocate((count ? count : 1) * sizeof(U));
+    }
+    // cached by the address of the shape, a slot taken by another shape is not replaced so
+    // the memory stays bounded by the number of shapes. nullptr if out of memory.
+    const Scratch::ShapeOrder* shapeOrder(const Shape* shape, const Value* values) const {
+        Scratch::ShapeOrder& slot = _scratch->_cache[((uintptr_t)shape >> 3) & (ZJSON_SHAPE_ORDER_CACHE_SIZE - 1)];
+        if (ZJSON_LIKELY(slot.shape == shape)) return &slot;
+        bool cached = !slot.shape;
+        Allocator& allocator = cached ? _scratch->_orders : _scratch->_members;
+        uint32_t length = shape->length;
+        DumpChild* sorted = allocate<DumpChild>(_scratch->_members, length);
+        Scratch::ShapeOrder order = { shape, allocate<char*>(allocator, length), allocate<uint32_t>(allocator, length), true };
+        if (ZJSON_UNLIKELY(!sorted || !order.names || !order.indices)) return nullptr;
+        for (uint32_t i = 0; i < length; i++) {
+            sorted[i].name = shape->names()[i];
+            sorted[i].value = values + i;
+        }
+        std::sort(sorted, sorted + length, less);
+        for (uint32_t i = 0; i < length; i++) {
+            order.names[i] = sorted[i].name;
+            order.indices[i] = (uint32_t)(sorted[i].value - values);
+            if (order.indices[i] != i) order.ordered = false;
+        }
+        if (cached) {
+            slot = order;
+            return &slot;
+        }
+        _miss = order;
+        return &_miss;
+    }
+
+    Scratch* _scratch;
+    mutable Scratch::ShapeOrder _miss;
+};
+
+// Compact, a container not modified since it was parsed is copied from the input
+class SourceFormat : public CompactFormat {
+public:
+    explicit SourceFormat(const SourceSpans& sources) : _sources(&sources) {}
+    template <typename T> inline bool copy(T& out, const Value& container) const {
+        size_t length;
+        const char* text = _sources->find(container, &length);
+        if (!text) return false;
+        out.puts(text, length);
+        return true;
+    }
+private:
+    const SourceSpans* _sources;
+};
+
+// Calls run with the layout policy of a style, sources are the spans of a document
+// parsed with PARSE_KEEP_SOURCE
+template <typename R>
+inline void withDumpFormat(const DumpStyle& style, R& run, const SourceSpans* sources = nullptr)
+{
+    if (style.verbatim && sources)
+        run(SourceFormat(*sources));
+    else if (style.canonical) {
+        CanonicalFormat::Scratch scratch;
+        run(CanonicalFormat(scratch));
+    }
+    else if (!style.formatted)
+        run(CompactFormat());
+    else if (style.spaces)
+        run(PrettyFormat::spaces(style.spaces));
+    else
+        run(PrettyFormat::tabs());
+}
+
+template <typename T>
+struct DumpValue {
+    T& out;
+    const Value* value;
+    template <typename F> void operator()(const F& format) const { value->dumpWith(out, format); }
+};
+
+template <typename T>
+void Value::dump(T& out, const DumpStyle& style, const SourceSpans* sources) const
+{
+    if (style.canonical) out.setNumberFormat(NumberFormat(NUMBER_ECMASCRIPT));
+    DumpValue<T> run = { out, this };
+    withDumpFormat(style, run, sources);
+}
+
+// A run of the children of the root in a parallel dump, written to a chunk of its own
+struct DumpBatch {
+    Writer<StringWriter>& out;
+    const DumpChild* begin;
+    const DumpChild* end;
+    bool isObject;
+    template <typename F> void operator()(const F& format) const {
+        for (const DumpChild* child = begin; child != end; child++) {
+            if (child != begin) {
+                format.comma(out);
+                format.newline(out);
+            }
+            format.indent(out, 1);
+            if (isObject) {
+                out.writeEscaped(child->name);
+                format.colon(out);
+            }
+            child->value->dumpWith(out, format, 1);
+        }
+    }
+};
+
+// The brackets of the root and what goes between its chunks, as the layout writes them
+struct DumpJoin {
+    Writer<StringWriter>& open;
+    Writer<StringWriter>& separator;
+    Writer<StringWriter>& close;
+    bool isObject;
+    template <typename F> void operator()(const F& format) const {
+        open.putc(isObject ? '{' : '[');
+        format.newline(open);
+        format.comma(separator);
+        format.newline(separator);
+        format.newline(close);
+        close.putc(isObject ? '}' : ']');
+    }
+};
+
+// The members or elements of the root are dumped in batches on threads, each into a chunk.
+// The thread that completes the next chunk in order writes it out with the completed ones
+// after it, and frees them, so only the chunks ahead of a slower one are held. out is
+// written from the dumping threads, one at a time. Other values and roots with less than
+// two children are dumped on the calling thread.
 template <typename T>
-void Value::dump(T& out, bool formatted, int indent) const
+void Value::dumpParallel(T& out, const DumpStyle& style, unsigned threads, const SourceSpans* sources) const
+{
+    if (!threads) threads = std::thread::hardware_concurrency();
+    Type type = getType();
+    std::vector<DumpChild> children;
+    size_t length;
+    if (style.verbatim && sources && sources->find(*this, &length))
+        threads = 1; // a single copy
+    if (threads > 1 && (type == JSON_ARRAY || type == JSON_OBJECT)) {
+        if (isShaped()) {
+            ShapedObject* object = toShaped();
+            children.resize(object->shape->length);
+            for (uint32_t i = 0; i < object->shape->length; i++) {
+                children[i].name = object->shape->names()[i];
+                children[i].value = &object->values()[i];
+            }
+        }
+        else {
+            for (const Node* node = toNode(); node; node = node->next) {
+                DumpChild child = { node->name, &node->value };
+                children.push_back(child);
+            }
+        }
+    }
+    if (children.size() < 2) {
+        dump(out, style, sources);
+        return;
+    }
+    bool isObject = type == JSON_OBJECT;
+    if (style.canonical) {
+        out.setNumberFormat(NumberFormat(NUMBER_ECMASCRIPT));
+        if (isObject) std::sort(children.begin(), children.end(), CanonicalFormat::less);
+    }
+
+    std::string open, separator, close;
+    Writer<StringWriter> openWriter(open), separatorWriter(separator), closeWriter(close);
+    DumpJoin join = { openWriter, separatorWriter, closeWriter, isObject };
+    withDumpFormat(style, join, sources);
+    out.puts(open.data(), open.size());
+
+    size_t count = children.size();
+    size_t batches = (std::min)(count, (size_t)threads * ZJSON_PARALLEL_BATCHES);
+    std::vector<std::string> chunks(batches);
+    std::vector<char> done(batches, 0);
+    size_t written = 0; // chunks written to out, guarded by the lock with done
+    std::mutex lock;
+    std::atomic<size_t> next(0);
+    std::atomic<int> failure(ERROR_NO_ERROR);
+    NumberFormat numbers = out.getNumberFormat();
+    auto dumpBatches = [&]() {
+        for (size_t b = next++; b < batches; b = next++) {
+            Writer<StringWriter> writer(chunks[b]);
+            writer.setNumberFormat(numbers);
+            DumpBatch run = { writer, &children[count * b / batches], &children[0] + count * (b + 1) / batches, isObject };
+            withDumpFormat(style, run, sources);
+            if (ZJSON_UNLIKELY(writer.getError() != ERROR_NO_ERROR)) {
+                failure = writer.getError();
+                next = batches; // the chunks after it are not written
+                return;
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            done[b] = 1;
+            for (; written < batches && done[written]; written++) {
+                if (written) out.puts(separator.data(), separator.size());
+                out.puts(chunks[written].data(), chunks[written].size());
+                std::string().swap(chunks[written]);
+            }
+        }
+    };
+#ifdef ZJSON_HAS_EXCEPTIONS
+    std::vector<std::exception_ptr> errors(threads);
+    auto work = [&](unsigned worker) {
+        try {
+            dumpBatches();
+        }
+        catch (...) {
+            errors[worker] = std::current_exception();
+            next = batches;
+        }
+    };
+    std::vector<std::thread> workers;
+    try {
+        for (unsigned i = 1; i < threads; i++) workers.push_back(std::thread(work, i));
+    }
+    catch (const std::system_error&) {
+        // fewer threads, the calling one takes the rest
+    }
+    work(0);
+    for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+    for (size_t i = 0; i < errors.size(); i++) {
+        if (errors[i]) std::rethrow_exception(errors[i]);
+    }
+#else
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; i++) workers.push_back(std::thread(dumpBatches));
+    dumpBatches();
+    for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+#endif
+    if (ZJSON_UNLIKELY(failure != ERROR_NO_ERROR)) {
+        out.fail(failure);
+        return;
+    }
+    out.puts(close.data(), close.size());
+}
+
+// Iterative, the open containers are on an explicit stack. depth is the indentation of
+// the value, for the children of a parallel dump.
+template <typename T, typename F>
+void Value::dumpWith(T& out, const F& format, int depth) const
 {
-    switch (getType()) {
-    case JSON_NUMBER:
-        out.writeNumber(toNumber());
-        break;
-    case JSON_INT:
-        out.writeInt(toInt());
-        break;
-    case JSON_STRING:
-        out.writeEscaped(toString());
-        break;
-    case JSON_ARRAY:
-        if (!toNode()) {
-            static const char* s_empty_array[4] = { "[]", "[ ]" };
-            out.puts(s_empty_array[formatted], 2 + formatted);
+    DepthStack<DumpFrame> stack;
+    int top = -1;
+    const Value* value = this;
+    for (;;) {
+        Type type = value->getType();
+        switch (type) {
+        case JSON_NUMBER:
+            out.writeNumber(value->toNumber());
+            break;
+        case JSON_INT:
+            out.writeInt(value->toInt());
+            break;
+        case JSON_STRING:
+            out.writeEscaped(value->toString());
             break;
+        case JSON_ARRAY:
+        case JSON_OBJECT: {
+            bool isObject = type == JSON_OBJECT;
+            if (format.copy(out, *value)) break;
+            if (!value->isShaped() && !value->toNode()) {
+                if (isObject) format.empty(out, '{', '}');
+                else format.empty(out, '[', ']');
+                break;
+            }
+            if (ZJSON_UNLIKELY(!stack.reserve(++top))) {
+                out.fail(ERROR_OUT_OF_MEMORY);
+                return;
+            }
+            DumpFrame& frame = stack[top];
+            if (value->isShaped()) {
+                ShapedObject* object = value->toShaped();
+                frame.node = nullptr;
+                frame.values = object->values();
+                frame.names = object->shape->names();
+                frame.remaining = object->shape->length;
+            }
+            else {
+                frame.node = value->toNode();
+                frame.values = nullptr;
+            }
+            frame.isObject = isObject;
+            if (isObject && ZJSON_UNLIKELY(!format.sort(frame, *value))) {
+                out.fail(ERROR_OUT_OF_MEMORY);
+                return;
+            }
+            out.putc(isObject ? '{' : '[');
+            format.newline(out);
+            value = dumpNext(out, format, frame, depth + top + 1);
+            continue;
         }
-        out.putc('[');
-        if (formatted) out.putc('\n');
-        indent++;
-        for (Node* n = toNode(); n; n = n->next) {
-            if (formatted) out.writeTabs(indent);
-            n->value.dump(out, formatted, indent);
-            if (n->next) {
-                out.putc(',');
-                if (formatted) out.putc(' ');
-            }
-            if (formatted) out.putc('\n');
-        }
-        indent--;
-        if (formatted) out.writeTabs(indent);
-        out.putc(']');
-        break;
-    case JSON_OBJECT:
-        if (!toNode()) {
-            static const char* s_empty_array[4] = { "{}", "{ }" };
-            out.puts(s_empty_array[formatted], 2 + formatted);
+        case JSON_TRUE:
+            out.puts("true", 4);
+            break;
+        case JSON_FALSE:
+            out.puts("false", 5);
+            break;
+        case JSON_NULL:
+            out.puts("null", 4);
             break;
         }
-        out.putc('{');
-        if (formatted) out.putc('\n');
-        indent++;
-        for (Node* n = toNode(); n; n = n->next) {
-            if (formatted) out.writeTabs(indent);
-            out.writeEscaped(n->name);
-            if (formatted)
-                out.puts(" : ", 3);
-            else
-                out.putc(':');
-            n->value.dump(out, formatted, indent);
-            if (n->next) {
-                out.putc(',');
-                if (formatted) out.putc(' ');
-            }
-            if (formatted) out.putc('\n');
-        }
-        indent--;
-        if (formatted) out.writeTabs(indent);
-        out.putc('}');
-        break;
-    case JSON_TRUE:
-        out.puts("true", 4);
-        break;
-    case JSON_FALSE:
-        out.puts("false", 5);
-        break;
-    case JSON_NULL:
-        out.puts("null", 4);
-        break;
+        // the value is written, go on with the next one or close the containers
+        for (;;) {
+            if (top == -1) return;
+            DumpFrame& frame = stack[top];
+            if (frame.values ? frame.remaining != 0 : frame.node != nullptr) {
+                format.comma(out);
+                format.newline(out);
+                value = dumpNext(out, format, frame, depth + top + 1);
+                break;
+            }
+            format.newline(out);
+            format.indent(out, depth + top);
+            out.putc(frame.isObject ? '}' : ']');
+            format.release(frame);
+            top--;
+        }
+    }
+}
+
+// write the indentation and name of the next member or element and return it
+template <typename T, typename F>
+const Value* Value::dumpNext(T& out, const F& format, DumpFrame& frame, int indent)
+{
+    format.indent(out, indent);
+    const Value* value;
+    if (frame.values) {
+        out.writeEscaped(*frame.names++);
+        format.colon(out);
+        value = frame.values++;
+        frame.remaining--;
+        return value;
+    }
+    if (frame.isObject) {
+        out.writeEscaped(frame.node->name);
+        format.colon(out);
     }
+    value = &frame.node->value;
+    frame.node = frame.node->next;
+    return value;
 }
 
 } // namespace zjson
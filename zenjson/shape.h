@@ -0,0 +1,179 @@
+#include <atomic>
+
+namespace zjson {
+
+#define ZJSON_SHAPE_MAX_LENGTH  64  // larger objects are kept as node lists
+#define ZJSON_SHAPE_TABLE_SIZE  64  // initial buckets of a shape table
+#define ZJSON_SHAPE_SCRATCH_MIN 256 // smallest first block of the scratch allocator
+
+inline uint32_t hashString(const char *s) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    while (*s) hash = (hash ^ (uint8_t)*s++) * 16777619u;
+    return hash;
+}
+
+// A shape describes the member names of all objects with the same key sequence.
+// It's followed by the names, their hashes and a name-to-slot table.
+struct Shape {
+    Shape *next;        // next shape in the same bucket
+    uint64_t id;        // unique in the process, tells reallocated shapes apart
+    uint32_t hash;      // hash of the key sequence
+    uint32_t length;    // number of members
+    uint32_t slotMask;  // size of the name-to-slot table - 1
+    inline char **names() const { return (char **)(this + 1); }
+    inline uint32_t *hashes() const { return (uint32_t *)(names() + length); }
+    inline uint8_t *slots() const { return (uint8_t *)(hashes() + length); }
+    static inline size_t sizeOf(uint32_t length, uint32_t slotMask) {
+        return sizeof(Shape) + length * (sizeof(char *) + sizeof(uint32_t)) + slotMask + 1;
+    }
+    // returns the slot of the first member with the name, or -1
+    inline int find(const char *name, uint32_t hash) const {
+        const uint8_t *table = slots();
+        for (uint32_t i = hash & slotMask; table[i]; i = (i + 1) & slotMask) {
+            int slot = table[i] - 1;
+            if (hashes()[slot] == hash && strcmp(names()[slot], name) == 0) return slot;
+        }
+        return -1;
+    }
+};
+
+// An object in shape representation, only a packed array of values follows the shape.
+struct ShapedObject {
+    Shape *shape;
+    inline Value *values() { return (Value *)(this + 1); }
+    inline int find(const char *name) const { return shape->find(name, hashString(name)); }
+};
+
+// Blocks carved from another allocator, they go away with its reset
+class ArenaResource final : public MemoryResource {
+public:
+    ArenaResource() : _arena(nullptr) {}
+    inline void setArena(Allocator *arena) { _arena = arena; }
+    void *allocate(size_t size) override { return _arena ? _arena->allocate(size) : nullptr; }
+    void deallocate(void *, size_t) override {}
+private:
+    Allocator *_arena;
+};
+
+// Interns the shapes of parsed objects. The members of an open object are parsed into
+// the scratch allocator as usual, and replaced by a shaped object when it's closed.
+// The scratch blocks come from the document allocator too, so a document without
+// upstream doesn't touch the heap. The first one takes a quarter of the room the
+// document allocator has at most, a small caller buffer holds the DOM as well.
+class ShapeTable {
+public:
+    ShapeTable() : _buckets(nullptr), _mask(0), _count(0), _scratch(defaultBlockPolicy(), &_resource) {}
+    ShapeTable(const ShapeTable &) = delete;
+    ShapeTable &operator=(const ShapeTable &) = delete;
+    ~ShapeTable() {
+        _scratch.abandonBlocks();
+    }
+    // shapes live in the document allocator, reset them together
+    inline void reset(Allocator *arena = nullptr) {
+        _buckets = nullptr;
+        _mask = _count = 0;
+        BlockPolicy policy = defaultBlockPolicy();
+        size_t room = arena ? arena->room() / 4 & ~(size_t)7 : 0;
+        if (room && room < policy.initialSize) policy.initialSize = room > ZJSON_SHAPE_SCRATCH_MIN ? room : ZJSON_SHAPE_SCRATCH_MIN;
+        _scratch.setBlockPolicy(policy);
+        _scratch.abandonBlocks();
+        _resource.setArena(arena);
+    }
+    inline Allocator &scratch() { return _scratch; }
+    // convert a closed object from the scratch allocator, returns false if out of memory
+    bool shapeObject(Value *value, Allocator &allocator) {
+        Node *head = value->toNode();
+        if (!head) return true;
+        uint32_t hashes[ZJSON_SHAPE_MAX_LENGTH];
+        uint32_t length = 0, hash = 2166136261u;
+        for (Node *n = head; n; n = n->next) {
+            if (length == ZJSON_SHAPE_MAX_LENGTH) return copyObject(value, allocator);
+            hashes[length] = hashString(n->name);
+            hash = (hash ^ hashes[length++]) * 16777619u;
+        }
+        Shape *shape = intern(head, hashes, length, hash, allocator);
+        ShapedObject *object = (ShapedObject *)allocator.allocate(sizeof(ShapedObject) + length * sizeof(Value));
+        if (ZJSON_UNLIKELY(!shape || !object)) return false;
+        object->shape = shape;
+        Value *values = object->values();
+        for (Node *n = head; n; n = n->next) *values++ = n->value;
+        *value = Value(object);
+        return true;
+    }
+private:
+    Shape **_buckets;
+    uint32_t _mask;
+    uint32_t _count;
+    ArenaResource _resource;
+    Allocator _scratch;
+
+    // objects too large to share a shape are copied as node lists
+    bool copyObject(Value *value, Allocator &allocator) {
+        Node *n, *tail = nullptr;
+        for (Node *node = value->toNode(); node; node = node->next) {
+            if (ZJSON_UNLIKELY((n = (Node *)allocator.allocate(sizeof(Node))) == nullptr)) return false;
+            n->name = node->name;
+            n->value = node->value;
+            tail = insertAfter(tail, n);
+        }
+        *value = listToValue(JSON_OBJECT, tail);
+        return true;
+    }
+    Shape *intern(Node *head, const uint32_t *hashes, uint32_t length, uint32_t hash, Allocator &allocator) {
+        if (_buckets) {
+            for (Shape *shape = _buckets[hash & _mask]; shape; shape = shape->next) {
+                if (shape->hash != hash || shape->length != length) continue;
+                Node *n = head;
+                uint32_t i = 0;
+                while (i < length && shape->hashes()[i] == hashes[i] && strcmp(shape->names()[i], n->name) == 0) {
+                    i++;
+                    n = n->next;
+                }
+                if (i == length) return shape;
+            }
+        }
+        if (_count >= _mask && !grow(allocator)) return nullptr;
+        uint32_t slotMask = 1;
+        while (slotMask + 1 < length * 2) slotMask = slotMask * 2 + 1;
+        Shape *shape = (Shape *)allocator.allocate(Shape::sizeOf(length, slotMask));
+        if (ZJSON_UNLIKELY(!shape)) return nullptr;
+        static std::atomic<uint64_t> s_shapeIds(1);
+        shape->hash = hash;
+        shape->id = s_shapeIds.fetch_add(1, std::memory_order_relaxed);
+        shape->length = length;
+        shape->slotMask = slotMask;
+        uint8_t *table = shape->slots();
+        memset(table, 0, slotMask + 1);
+        Node *n = head;
+        for (uint32_t i = 0; i < length; i++, n = n->next) {
+            shape->names()[i] = n->name;
+            shape->hashes()[i] = hashes[i];
+            if (shape->find(n->name, hashes[i]) >= 0) continue; // duplicated key, the first one wins
+            uint32_t j = hashes[i] & slotMask;
+            while (table[j]) j = (j + 1) & slotMask;
+            table[j] = (uint8_t)(i + 1);
+        }
+        shape->next = _buckets[hash & _mask];
+        _buckets[hash & _mask] = shape;
+        _count++;
+        return shape;
+    }
+    bool grow(Allocator &allocator) {
+        uint32_t mask = _mask ? _mask * 2 + 1 : ZJSON_SHAPE_TABLE_SIZE - 1;
+        Shape **buckets = (Shape **)allocator.allocate((mask + 1) * sizeof(Shape *));
+        if (ZJSON_UNLIKELY(!buckets)) return false;
+        memset(buckets, 0, (mask + 1) * sizeof(Shape *));
+        for (uint32_t i = 0; _buckets && i <= _mask; i++) {
+            for (Shape *shape = _buckets[i], *next; shape; shape = next) {
+                next = shape->next;
+                shape->next = buckets[shape->hash & mask];
+                buckets[shape->hash & mask] = shape;
+            }
+        }
+        _buckets = buckets;
+        _mask = mask;
+        return true;
+    }
+};
+
+} // namespace zjson
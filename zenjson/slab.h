@@ -0,0 +1,217 @@
+#ifndef ZJSON_NO_SLAB
+#include <mutex>
+#endif
+
+namespace zjson {
+
+#ifndef ZJSON_NO_SLAB
+
+#define ZJSON_SLAB_MAX_SIZE     256         // larger chunks go to malloc
+#define ZJSON_SLAB_SIZE         (64 << 10)  // chunks are carved from slabs of this size
+#define ZJSON_SLAB_BATCH        256         // chunks moved between a thread cache and the global lists at once
+
+// Size-class slabs for the nodes and strings of Json values without allocator. Every
+// thread allocates and frees in its own cache without locking, whole batches of chunks
+// go through the global lists when a cache runs empty or too full. Slabs are kept for
+// the lifetime of the process. Define ZJSON_NO_SLAB to use malloc instead.
+class SlabHeap {
+public:
+    static inline void *allocate(size_t size) {
+        if (size > ZJSON_SLAB_MAX_SIZE) return malloc(size);
+        size_t c = sizeClass(size);
+        ThreadCache &cache = threadCache();
+        Chunk *chunk = cache.lists[c];
+        if (ZJSON_LIKELY(chunk)) {
+            cache.lists[c] = chunk->next;
+            cache.counts[c]--;
+            return chunk;
+        }
+        return refill(cache, c);
+    }
+    // size must be the one allocated
+    static inline void deallocate(void *ptr, size_t size) {
+        if (size > ZJSON_SLAB_MAX_SIZE) {
+            free(ptr);
+            return;
+        }
+        size_t c = sizeClass(size);
+        ThreadCache &cache = threadCache();
+        Chunk *chunk = (Chunk *)ptr;
+        if (ZJSON_UNLIKELY(cache.exited)) { // freed in a thread_local destructor after the cache is gone
+            heap().pushBatch(c, chunk, chunk);
+            return;
+        }
+        chunk->next = cache.lists[c];
+        cache.lists[c] = chunk;
+        if (ZJSON_UNLIKELY(++cache.counts[c] > 2 * ZJSON_SLAB_BATCH)) overflow(cache, c);
+    }
+    class Batch;
+private:
+    static const size_t kClasses = ZJSON_SLAB_MAX_SIZE / 8;
+    struct Chunk {
+        Chunk *next;
+    };
+    // plain data, so it is still accessible while other thread_local objects are destroyed
+    struct ThreadCache {
+        Chunk *lists[kClasses];
+        uint32_t counts[kClasses];
+        char *slabCursor, *slabEnd;
+        bool registered, exited;
+    };
+    struct CacheFlusher {
+        ThreadCache *cache;
+        ~CacheFlusher() { // the thread exits, give its chunks to other threads
+            for (size_t c = 0; c < kClasses; c++) {
+                Chunk *head = cache->lists[c];
+                if (!head) continue;
+                Chunk *tail = head;
+                while (tail->next) tail = tail->next;
+                heap().pushBatch(c, head, tail);
+                cache->lists[c] = nullptr;
+                cache->counts[c] = 0;
+            }
+            cache->exited = true;
+        }
+    };
+    std::mutex _mutex;
+    Chunk *_lists[kClasses];
+
+    SlabHeap() {
+        memset(_lists, 0, sizeof(_lists));
+    }
+    static inline SlabHeap &heap() { // never destroyed, chunks could be freed during static destruction
+        static SlabHeap *s_heap = new SlabHeap();
+        return *s_heap;
+    }
+    static inline ThreadCache &threadCache() {
+        static thread_local ThreadCache s_cache;
+        if (ZJSON_UNLIKELY(!s_cache.registered)) {
+            static thread_local CacheFlusher s_flusher;
+            s_flusher.cache = &s_cache;
+            s_cache.registered = true;
+        }
+        return s_cache;
+    }
+    static inline size_t sizeClass(size_t size) {
+        return size ? (size - 1) >> 3 : 0;
+    }
+    static void *refill(ThreadCache &cache, size_t c) {
+        size_t size = (c + 1) << 3;
+        if (cache.exited) return malloc(size); // any memory of the size could be freed to the lists
+        if (size_t count = heap().popBatch(c, &cache.lists[c])) {
+            Chunk *chunk = cache.lists[c];
+            cache.lists[c] = chunk->next;
+            cache.counts[c] = (uint32_t)count - 1;
+            return chunk;
+        }
+        if ((size_t)(cache.slabEnd - cache.slabCursor) < size) { // the rest of the current slab is left
+            char *slab = (char *)malloc(ZJSON_SLAB_SIZE);
+            if (!slab) return nullptr;
+            cache.slabCursor = slab;
+            cache.slabEnd = slab + ZJSON_SLAB_SIZE;
+        }
+        void *p = cache.slabCursor;
+        cache.slabCursor += size;
+        return p;
+    }
+    static void overflow(ThreadCache &cache, size_t c) {
+        Chunk *head = cache.lists[c], *tail = head;
+        for (size_t i = 1; i < ZJSON_SLAB_BATCH; i++) tail = tail->next;
+        cache.lists[c] = tail->next;
+        cache.counts[c] -= ZJSON_SLAB_BATCH;
+        tail->next = nullptr;
+        heap().pushBatch(c, head, tail);
+    }
+    // give back a list of chunks of a class at once
+    static void deallocateList(size_t c, Chunk *head, Chunk *tail, uint32_t count) {
+        ThreadCache &cache = threadCache();
+        if (ZJSON_UNLIKELY(cache.exited)) {
+            heap().pushBatch(c, head, tail);
+            return;
+        }
+        tail->next = cache.lists[c];
+        cache.lists[c] = head;
+        cache.counts[c] += count;
+        while (ZJSON_UNLIKELY(cache.counts[c] > 2 * ZJSON_SLAB_BATCH)) overflow(cache, c);
+    }
+    void pushBatch(size_t c, Chunk *head, Chunk *tail) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        tail->next = _lists[c];
+        _lists[c] = head;
+    }
+    // take up to a batch of chunks, returns the number of them
+    size_t popBatch(size_t c, Chunk **list) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        Chunk *head = _lists[c];
+        if (!head) return 0;
+        Chunk *tail = head;
+        size_t count = 1;
+        while (count < ZJSON_SLAB_BATCH && tail->next) {
+            tail = tail->next;
+            count++;
+        }
+        _lists[c] = tail->next;
+        tail->next = nullptr;
+        *list = head;
+        return count;
+    }
+};
+
+// Chunks freed together, e.g. the nodes and strings of a subtree. They are collected in
+// a list per size class, which goes to the thread cache with one splice when it holds a
+// batch of chunks, or on release().
+class SlabHeap::Batch {
+public:
+    Batch() : _mask(0) {}
+    Batch(const Batch &) = delete;
+    Batch &operator=(const Batch &) = delete;
+    ~Batch() {
+        release();
+    }
+    inline void deallocate(void *ptr, size_t size) {
+        if (size > ZJSON_SLAB_MAX_SIZE) {
+            free(ptr);
+            return;
+        }
+        size_t c = sizeClass(size);
+        Chunk *chunk = (Chunk *)ptr;
+        if (!(_mask & (1u << c))) {
+            _mask |= 1u << c;
+            _tails[c] = chunk;
+            _heads[c] = nullptr;
+            _counts[c] = 0;
+        }
+        chunk->next = _heads[c];
+        _heads[c] = chunk;
+        if (ZJSON_UNLIKELY(++_counts[c] == ZJSON_SLAB_BATCH)) { // while the chunks are still in cache
+            deallocateList(c, _heads[c], _tails[c], _counts[c]);
+            _mask &= ~(1u << c);
+        }
+    }
+    void release() {
+        for (size_t c = 0; _mask; c++) {
+            if (!(_mask & (1u << c))) continue;
+            deallocateList(c, _heads[c], _tails[c], _counts[c]);
+            _mask &= ~(1u << c);
+        }
+    }
+private:
+    static_assert(kClasses <= 32, "a size class per bit of the mask");
+    uint32_t _mask; // bit c is set if the list of class c is not empty
+    Chunk *_heads[kClasses], *_tails[kClasses];
+    uint32_t _counts[kClasses];
+};
+
+typedef SlabHeap::Batch SlabBatch;
+inline void *slabAllocate(size_t size) { return SlabHeap::allocate(size); }
+inline void slabFree(void *ptr, size_t size) { SlabHeap::deallocate(ptr, size); }
+#else
+class SlabBatch {
+public:
+    inline void deallocate(void *ptr, size_t) { free(ptr); }
+};
+inline void *slabAllocate(size_t size) { return malloc(size); }
+inline void slabFree(void *ptr, size_t) { free(ptr); }
+#endif
+
+} // namespace zjson
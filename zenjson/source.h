@@ -0,0 +1,99 @@
+namespace zjson {
+
+#define ZJSON_SPAN_TABLE_SIZE  256  // initial slots of a span table
+
+// Where an array or object was in the input, found by the address of its node list or
+// shaped object. Containers modified since are dirty.
+struct SourceSpan {
+    uint64_t key;       // payload of the container, 0 for a free slot
+    size_t begin;       // offset of the bracket in the input
+    uint32_t length;    // bytes up to the closing bracket
+    uint32_t dirty;
+};
+
+// The input of a document parsed with PARSE_KEEP_SOURCE and the spans of its containers.
+// The parser terminates strings in-situ, so the input is copied once before. Everything
+// lives in the document allocator, reset them together.
+class SourceSpans {
+public:
+    SourceSpans() : _source(nullptr), _slots(nullptr), _mask(0), _count(0) {}
+    SourceSpans(const SourceSpans &) = delete;
+    SourceSpans &operator=(const SourceSpans &) = delete;
+    inline void reset() {
+        _source = nullptr;
+        _slots = nullptr;
+        _mask = _count = 0;
+    }
+    // copy the input, returns false if out of memory
+    bool keep(const char *content, size_t length, Allocator &allocator) {
+        char *source = (char *)allocator.allocate(length + 1);
+        if (ZJSON_UNLIKELY(!source)) return false;
+        memcpy(source, content, length);
+        source[length] = '\0';
+        _source = source;
+        return true;
+    }
+    // add a closed container, returns false if out of memory
+    bool add(const Value &container, size_t begin, size_t end, Allocator &allocator) {
+        uint64_t key = container.getPayload();
+        if (!key || end - begin > UINT32_MAX) return true; // empty or too long, dumped as usual
+        if (_count >= (_mask + 1) / 2 && !grow(allocator)) return false;
+        SourceSpan *span = &_slots[hashKey(key) & _mask];
+        while (span->key) span = next(span);
+        span->key = key;
+        span->begin = begin;
+        span->length = (uint32_t)(end - begin);
+        span->dirty = 0;
+        _count++;
+        return true;
+    }
+    // the original text of a container, nullptr if it's modified or wasn't parsed
+    inline const char *find(const Value &container, size_t *length) const {
+        const SourceSpan *span = lookup(container);
+        if (!span || span->dirty) return nullptr;
+        *length = span->length;
+        return _source + span->begin;
+    }
+    inline void markDirty(const Value &container) {
+        SourceSpan *span = lookup(container);
+        if (span) span->dirty = 1;
+    }
+private:
+    const char *_source;
+    SourceSpan *_slots;
+    uint32_t _mask;
+    uint32_t _count;
+
+    static inline uint32_t hashKey(uint64_t key) {
+        return (uint32_t)(((key >> 3) * 0x9E3779B97F4A7C15ULL) >> 32);
+    }
+    inline SourceSpan *next(SourceSpan *span) const {
+        return &_slots[(span - _slots + 1) & _mask];
+    }
+    SourceSpan *lookup(const Value &container) const {
+        Type type = container.getType();
+        if (!_slots || (type != JSON_ARRAY && type != JSON_OBJECT)) return nullptr;
+        uint64_t key = container.getPayload();
+        if (!key) return nullptr;
+        for (SourceSpan *span = &_slots[hashKey(key) & _mask]; span->key; span = next(span))
+            if (span->key == key) return span;
+        return nullptr;
+    }
+    bool grow(Allocator &allocator) {
+        uint32_t mask = _mask ? _mask * 2 + 1 : ZJSON_SPAN_TABLE_SIZE - 1;
+        SourceSpan *slots = (SourceSpan *)allocator.allocate((mask + 1) * sizeof(SourceSpan));
+        if (ZJSON_UNLIKELY(!slots)) return false;
+        memset(slots, 0, (mask + 1) * sizeof(SourceSpan));
+        for (uint32_t i = 0; _slots && i <= _mask; i++) {
+            if (!_slots[i].key) continue;
+            uint32_t j = hashKey(_slots[i].key) & mask;
+            while (slots[j].key) j = (j + 1) & mask;
+            slots[j] = _slots[i];
+        }
+        _slots = slots;
+        _mask = mask;
+        return true;
+    }
+};
+
+} // namespace zjson
@@ -1,3 +1,8 @@
+#ifdef ZJSON_COPY_ON_WRITE
+#include <atomic>
+#include <new>
+#endif
+
 namespace zjson {
 
 #define JSON_VALUE_PAYLOAD_MASK 0x00007FFFFFFFFFFFULL
@@ -6,8 +11,16 @@ namespace zjson {
 #define JSON_VALUE_TAG_SHIFT 47
 
 struct Node;
+struct ShapedObject;
+struct DumpStyle;
+class SourceSpans;
+struct DumpFrame;
+struct DumpBatch;
+template <typename T> struct DumpValue;
 struct Value {
     friend class Json;
+    friend struct DumpBatch;
+    template <typename T> friend struct DumpValue;
     inline Value(double x) : fval(x) {
     }
     explicit inline Value(Type type, void *payload = nullptr) {
@@ -23,6 +36,11 @@ struct Value {
     explicit inline Value(bool x) {
         ival = JSON_VALUE_NAN_MASK | ((uint64_t)(x ? JSON_TRUE : JSON_FALSE) << JSON_VALUE_TAG_SHIFT);
     }
+    // an object in shape representation, see shape.h
+    explicit inline Value(ShapedObject *object) {
+        assert((uintptr_t)object <= JSON_VALUE_PAYLOAD_MASK && !((uintptr_t)object & 1));
+        ival = JSON_VALUE_NAN_MASK | ((uint64_t)JSON_OBJECT << JSON_VALUE_TAG_SHIFT) | (uintptr_t)object | 1;
+    }
     inline Type getType() const {
         return isDouble() ? JSON_NUMBER : Type((ival >> JSON_VALUE_TAG_SHIFT) & JSON_VALUE_TAG_MASK);
     }
@@ -43,9 +61,16 @@ struct Value {
         return (char *)getPayload();
     }
     inline Node *toNode() const {
-        assert(getType() == JSON_ARRAY || getType() == JSON_OBJECT);
+        assert((getType() == JSON_ARRAY || getType() == JSON_OBJECT) && !isShaped());
         return (Node *)getPayload();
     }
+    inline bool isShaped() const {
+        return !isDouble() && ((ival >> JSON_VALUE_TAG_SHIFT) & JSON_VALUE_TAG_MASK) == JSON_OBJECT && (ival & 1);
+    }
+    inline ShapedObject *toShaped() const {
+        assert(isShaped());
+        return (ShapedObject *)(getPayload() & ~1ULL);
+    }
 private:
     union {
         uint64_t ival;
@@ -56,7 +81,13 @@ private:
     }
     // serialization
     template <typename T>
-    void dump(T& out, bool formatted, int indent = 0) const;
+    void dump(T& out, const DumpStyle& style, const SourceSpans* sources = nullptr) const;
+    template <typename T>
+    void dumpParallel(T& out, const DumpStyle& style, unsigned threads, const SourceSpans* sources = nullptr) const;
+    template <typename T, typename F>
+    void dumpWith(T& out, const F& format, int depth = 0) const;
+    template <typename T, typename F>
+    static const Value* dumpNext(T& out, const F& format, DumpFrame& frame, int indent);
 };
 
 struct Node {
@@ -95,21 +126,112 @@ inline Value listToValue(Type type, Node *tail) {
     return Value(type, nullptr);
 }
 
-// free as a crt-allocated value
+#ifdef ZJSON_COPY_ON_WRITE
+// In copy-on-write mode, every crt-allocated node and string carries a reference count
+// in front of it. Copies of a value share its subtrees, the count of a list is the head's.
+struct CrtHeader {
+    std::atomic<uint32_t> refs;
+    uint32_t size; // of the allocation, 0 if it doesn't fit
+};
+inline void *crtAllocate(size_t size) {
+    CrtHeader* header = (CrtHeader*)slabAllocate(sizeof(CrtHeader) + size);
+    if (!header) return nullptr;
+    new (&header->refs) std::atomic<uint32_t>(1);
+    header->size = size <= UINT32_MAX ? (uint32_t)size : 0;
+    return header + 1;
+}
+inline void crtFree(void *ptr, size_t size) {
+    slabFree((CrtHeader*)ptr - 1, sizeof(CrtHeader) + size);
+}
+inline void crtFree(SlabBatch &batch, void *ptr, size_t size) {
+    batch.deallocate((CrtHeader*)ptr - 1, sizeof(CrtHeader) + size);
+}
+// the size a string was allocated with, the header records it
+inline size_t crtStringSize(const char *str) {
+    uint32_t size = ((const CrtHeader*)str - 1)->size;
+    return size ? size : strlen(str) + 1;
+}
+inline uint32_t crtRefCount(const void *ptr) {
+    return ((const CrtHeader*)ptr - 1)->refs.load(std::memory_order_acquire);
+}
+inline void *crtRetain(void *ptr) {
+    ((CrtHeader*)ptr - 1)->refs.fetch_add(1, std::memory_order_relaxed);
+    return ptr;
+}
+// returns true if the last reference is released
+inline bool crtRelease(void *ptr) {
+    return ((CrtHeader*)ptr - 1)->refs.fetch_sub(1, std::memory_order_acq_rel) == 1;
+}
+#else
+inline void *crtAllocate(size_t size) { return slabAllocate(size); }
+inline void crtFree(void *ptr, size_t size) { slabFree(ptr, size); }
+inline void crtFree(SlabBatch &batch, void *ptr, size_t size) { batch.deallocate(ptr, size); }
+inline size_t crtStringSize(const char *str) { return strlen(str) + 1; }
+inline uint32_t crtRefCount(const void *) { return 1; }
+inline void *crtRetain(void *ptr) { return ptr; }
+inline bool crtRelease(void *) { return true; }
+#endif
+
+// bytes taken by a crt allocation of the size
+inline size_t crtFootprint(size_t size) {
+#ifdef ZJSON_COPY_ON_WRITE
+    size += sizeof(CrtHeader);
+#endif
+    return (size + 7) & ~(size_t)7;
+}
+
+// share a crt-allocated value, only meaningful in copy-on-write mode
+inline Value retainCrtAllocatedValue(Value value) {
+    Type type = value.getType();
+    if (type == JSON_STRING)
+        crtRetain(value.toString());
+    else if ((type == JSON_ARRAY || type == JSON_OBJECT) && value.toNode())
+        crtRetain(value.toNode());
+    return value;
+}
+
+// free as a crt-allocated value. Iterative without a stack: the node whose list is being
+// freed keeps the rest of its own list in next, and its value holds the type of that list
+// and the node to go back to after it. The chunks of the subtree go back to the slabs in
+// one batch per size class.
 void freeCrtAllocatedValue(Value value) {
     Type type = value.getType();
     if (type == JSON_STRING) {
-        free(value.toString());
+        if (crtRelease(value.toString())) crtFree(value.toString(), crtStringSize(value.toString()));
+        return;
     }
-    else if (type == JSON_ARRAY || type == JSON_OBJECT) {
-        Node* node = value.toNode();
+    if (type != JSON_ARRAY && type != JSON_OBJECT) return;
+    Node* node = value.toNode();
+    if (!node || !crtRelease(node)) return; // still shared
+    SlabBatch batch;
+    Node* parent = nullptr;
+    for (;;) {
         while (node) {
-            if (type == JSON_OBJECT) free(node->name); // free key
-            freeCrtAllocatedValue(node->value); // free value
-            void* ptr = node;
-            node = node->next;
-            free(ptr); // free node
+            if (type == JSON_OBJECT && crtRelease(node->name)) crtFree(batch, node->name, crtStringSize(node->name)); // free key
+            Value v = node->value;
+            Type t = v.getType();
+            if (t == JSON_STRING) {
+                if (crtRelease(v.toString())) crtFree(batch, v.toString(), crtStringSize(v.toString()));
+            }
+            else if ((t == JSON_ARRAY || t == JSON_OBJECT) && v.toNode() && crtRelease(v.toNode())) {
+                // free the child list first, then come back
+                node->value = Value(type, parent);
+                parent = node;
+                node = v.toNode();
+                type = t;
+                continue;
+            }
+            Node* next = node->next;
+            crtFree(batch, node, type == JSON_OBJECT ? sizeof(Node) : sizeof(Node) - sizeof(char*)); // free node
+            node = next;
         }
+        if (!parent) break;
+        node = parent;
+        type = node->value.getType();
+        parent = node->value.toNode();
+        Node* next = node->next;
+        crtFree(batch, node, type == JSON_OBJECT ? sizeof(Node) : sizeof(Node) - sizeof(char*));
+        node = next;
     }
 }
 
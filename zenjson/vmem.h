@@ -0,0 +1,123 @@
+#if defined(_WIN32)
+// no min/max macros, and no ERROR_STACK_OVERFLOW of winerror.h over zjson's own unless
+// windows.h was included before
+#ifndef NOMINMAX
+#define NOMINMAX
+#define ZJSON_DEFINED_NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#define ZJSON_DEFINED_WIN32_LEAN_AND_MEAN
+#endif
+#ifdef ERROR_STACK_OVERFLOW
+#include <windows.h>
+#else
+#include <windows.h>
+#undef ERROR_STACK_OVERFLOW
+#endif
+#ifdef ZJSON_DEFINED_NOMINMAX
+#undef NOMINMAX
+#undef ZJSON_DEFINED_NOMINMAX
+#endif
+#ifdef ZJSON_DEFINED_WIN32_LEAN_AND_MEAN
+#undef WIN32_LEAN_AND_MEAN
+#undef ZJSON_DEFINED_WIN32_LEAN_AND_MEAN
+#endif
+#define ZJSON_HAS_VIRTUAL_MEMORY
+#elif defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define ZJSON_HAS_VIRTUAL_MEMORY
+#endif
+
+#ifdef ZJSON_HAS_VIRTUAL_MEMORY
+namespace zjson {
+
+#define ZJSON_VM_RESERVE_SIZE   (64ULL << 30)   // address space reserved by default
+#define ZJSON_VM_COMMIT_SIZE    (2 << 20)       // commit granularity, a huge page
+#define ZJSON_VM_PAGE_SIZE      4096            // pages of a deallocated block are given back
+
+// Blocks from one reserved range of virtual memory, committed as it is used. On Linux
+// the range asks for transparent huge pages, so multi-GB documents take far fewer TLB
+// misses and page faults. A deallocated block gives its pages back to the system, but
+// its address space is only reused if it's the last one, so trim() and a RetentionPolicy
+// cut the memory of a document and not its reservation. Everything is released at once
+// by release() or the destructor, after the documents using it are gone:
+//     zjson::VirtualMemoryResource vm;
+//     zjson::Document doc(nullptr, 0, &vm);
+class VirtualMemoryResource final : public MemoryResource {
+public:
+    explicit VirtualMemoryResource(size_t reserveSize = ZJSON_VM_RESERVE_SIZE)
+        : _base(nullptr), _reserved(0), _begin(nullptr), _used(0), _committed(0), _capacity(0)
+    {
+        reserveSize = (reserveSize + ZJSON_VM_COMMIT_SIZE - 1) & ~(size_t)(ZJSON_VM_COMMIT_SIZE - 1);
+        size_t size = reserveSize + ZJSON_VM_COMMIT_SIZE; // room to align the beginning to a huge page
+#if defined(_WIN32)
+        _base = (char *)VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+        _base = (char *)mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (_base == (char *)MAP_FAILED) _base = nullptr;
+#endif
+        if (!_base) return;
+        _reserved = size;
+        _begin = (char *)(((uintptr_t)_base + ZJSON_VM_COMMIT_SIZE - 1) & ~(uintptr_t)(ZJSON_VM_COMMIT_SIZE - 1));
+        _capacity = reserveSize;
+#ifdef MADV_HUGEPAGE
+        madvise(_begin, _capacity, MADV_HUGEPAGE);
+#endif
+    }
+    VirtualMemoryResource(const VirtualMemoryResource &) = delete;
+    VirtualMemoryResource &operator=(const VirtualMemoryResource &) = delete;
+    ~VirtualMemoryResource() {
+        release();
+    }
+    void *allocate(size_t size) override {
+        size = (size + 15) & ~(size_t)15;
+        if (size > _capacity - _used) return nullptr;
+        if (_used + size > _committed) {
+            size_t commit = (_used + size - _committed + ZJSON_VM_COMMIT_SIZE - 1) & ~(size_t)(ZJSON_VM_COMMIT_SIZE - 1);
+            if (commit > _capacity - _committed) commit = _capacity - _committed;
+#if defined(_WIN32)
+            if (!VirtualAlloc(_begin + _committed, commit, MEM_COMMIT, PAGE_READWRITE)) return nullptr;
+#else
+            if (mprotect(_begin + _committed, commit, PROT_READ | PROT_WRITE) != 0) return nullptr;
+#endif
+            _committed += commit;
+        }
+        void *p = _begin + _used;
+        _used += size;
+        return p;
+    }
+    void deallocate(void *ptr, size_t size) override {
+        size = (size + 15) & ~(size_t)15;
+        uintptr_t begin = ((uintptr_t)ptr + ZJSON_VM_PAGE_SIZE - 1) & ~(uintptr_t)(ZJSON_VM_PAGE_SIZE - 1);
+        uintptr_t end = ((uintptr_t)ptr + size) & ~(uintptr_t)(ZJSON_VM_PAGE_SIZE - 1);
+        if (end > begin) { // the pages stay committed, they read as zeros or garbage when used again
+#if defined(_WIN32)
+            VirtualAlloc((void *)begin, end - begin, MEM_RESET, PAGE_READWRITE);
+#else
+            madvise((void *)begin, end - begin, MADV_DONTNEED);
+#endif
+        }
+        if ((char *)ptr + size == _begin + _used) _used -= size;
+    }
+    // unmap the whole range with a single call
+    void release() {
+        if (!_base) return;
+#if defined(_WIN32)
+        VirtualFree(_base, 0, MEM_RELEASE);
+#else
+        munmap(_base, _reserved);
+#endif
+        _base = _begin = nullptr;
+        _reserved = _used = _committed = _capacity = 0;
+    }
+    size_t getCommitted() const { return _committed; }
+private:
+    char *_base;
+    size_t _reserved;
+    char *_begin;
+    size_t _used, _committed, _capacity;
+};
+
+} // namespace zjson
+#endif
@@ -1,42 +1,108 @@
+#include <atomic>
 #include <initializer_list>
+#include <memory>
 #include <type_traits>
 
 namespace zjson {
 
+class Json;
+
+// An element of a JSON literal (initializer list). It only records what to build,
+// the outermost Json allocates the whole tree in one pass with its own allocator.
+class JsonLiteral {
+public:
+    friend class Json;
+    JsonLiteral(Value value)
+        : _kind(KIND_VALUE), _value(value), _key(value.getType() == JSON_STRING ? value.toString() : nullptr) {}
+    JsonLiteral(bool value) : _kind(KIND_VALUE), _value(value), _key(nullptr) {}
+    JsonLiteral(nullptr_t) : _kind(KIND_VALUE), _value(JSON_NULL), _key(nullptr) {}
+    JsonLiteral(double value) : _kind(KIND_VALUE), _value(value), _key(nullptr) {}
+    JsonLiteral(int32_t value) : _kind(KIND_VALUE), _value(value), _key(nullptr) {}
+    JsonLiteral(const char* str) : _kind(KIND_STRING), _value(JSON_NULL), _key(str) {}
+    inline JsonLiteral(const Json& json);
+    // a temporary Json is moved into the literal tree instead of being copied
+    inline JsonLiteral(Json&& json);
+    JsonLiteral(std::initializer_list<JsonLiteral> list)
+        : _kind(KIND_LIST), _value(JSON_NULL), _key(nullptr), _list(list), _isObject(isObject(list)) {}
+private:
+    enum Kind {
+        KIND_VALUE,
+        KIND_STRING,
+        KIND_JSON,
+        KIND_MOVABLE_JSON,
+        KIND_LIST
+    } _kind;
+    Value _value;
+    const char* _key; // not null if the literal is a string, so it could be a member name
+    const Json* _json = nullptr;
+    std::initializer_list<JsonLiteral> _list;
+    bool _isObject = false;
+    // a list of [string, value] pairs makes an object, checked once per nested literal
+    static bool isObject(std::initializer_list<JsonLiteral> list) {
+        for (auto& literal : list) {
+            if (literal._kind != KIND_LIST || literal._list.size() != 2 || !literal._list.begin()->_key)
+                return false;
+        }
+        return true;
+    }
+};
+
+// A precompiled member name with a lookup cache. It remembers the shape and slot where
+// it was found last, so reading the same members from same-shaped objects costs a single
+// compare. The cache is one atomic word, a Key could be shared by threads. Only shaped
+// objects (PARSE_SHAPED_OBJECTS) are sped up, a node list is scanned as for a name.
+class Key {
+public:
+    friend class Json;
+    static constexpr uint64_t ID_MASK = (1ull << 57) - 1;  // bits of the shape id in the cache
+    static constexpr uint64_t SLOT_MASK = 127;              // and of the slot + 1
+    static_assert(ZJSON_SHAPE_MAX_LENGTH < SLOT_MASK, "slots of a shape must fit in the cache");
+    explicit Key(const char* name) : _name(name), _hash(hashString(name)), _cache(0) {}
+    Key(const Key& o) : _name(o._name), _hash(o._hash), _cache(o._cache.load(std::memory_order_relaxed)) {}
+    inline const char* getName() const { return _name; }
+    inline uint32_t getHash() const { return _hash; }
+private:
+    const char* _name;
+    uint32_t _hash;
+    mutable std::atomic<uint64_t> _cache; // the id of the last found shape and the slot + 1, 0 for none
+};
+
 // A wrapper class holds a Value or a Value view, with or without allocator.
 class Json {
 public:
     friend struct Value;
+    friend NodeIterator begin(Json& json);
     explicit Json(Value* value, Allocator* allocator = nullptr)
         : _value(value), _allocator(allocator)
     {
         _isValueView = _value != nullptr;
         if (!_isValueView) _value = new Value(JSON_NULL);
     }
-    // copy constructor
-    Json(const Json& o) : _allocator(o._allocator), _isValueView(o._isValueView)
+    // copy constructor, the root of a document is copied like an owned value
+    Json(const Json& o)
+        : _allocator(o._allocator), _isValueView(o._isValueView && !o._isDocument), _inCrtTree(o._inCrtTree)
     {
         if (_isValueView)
             _value = o._value;
-        else {
-            if (_allocator) { // has allocator
-                _value = new Value(o.toValue());
-            }
-            else { // no allocator + not a view, deep copy
-                _value = new Value(clone(o.toValue()));
-            }
-        }
+        else
+            _value = new Value(copy(o));
     }
-    // move constructor
+    // move constructor, the root of a document stays in it
     Json(Json&& o) noexcept
-        : _value(o._value), _allocator(o._allocator), _isValueView(o._isValueView)
+        : _value(o._value), _allocator(o._allocator), _isValueView(o._isValueView), _inCrtTree(o._inCrtTree)
     {
+        if (o._isDocument) {
+            _isValueView = false;
+            _value = new Value(copy(o));
+            return;
+        }
         o._value = nullptr;
         o._isValueView = false;
     }
     // constructors
+    // with a recycling allocator the value is copied, so it's recycled with this Json
     Json(Value value, Allocator* allocator = nullptr) : _allocator(allocator), _isValueView(false) {
-        _value = new Value(value);
+        _value = new Value(allocator && allocator->isRecycling() ? clone(value) : value);
     }
     Json(bool value, Allocator* allocator = nullptr) : _allocator(allocator), _isValueView(false) {
         _value = new Value(value);
@@ -55,38 +121,10 @@ public:
     {
         _value = new Value(JSON_STRING, clone(str));
     }
-    Json(std::initializer_list<Json> init, Allocator* allocator = nullptr)
+    Json(std::initializer_list<JsonLiteral> init, Allocator* allocator = nullptr)
         : _allocator(allocator), _isValueView(false)
     {
-        bool isMatchObject = true;
-        for (auto& json : init) {
-            if (json.getType() != JSON_ARRAY || json.getLength() != 2 ||
-                json.getElement(0)->value.getType() != JSON_STRING) {
-                isMatchObject = false;
-                break;
-            }
-        }
-        if (isMatchObject) {
-            Node *node, *tail = nullptr;
-            for (auto& json : init) {
-                node = (Node*)allocate(sizeof(Node));
-                char* name = json.getElement(0)->value.toString();
-                node->name = clone(name);
-                node->value = clone(json.getElement(1)->value);
-                tail = insertAfter(tail, node);
-            }
-            _value = new Value(listToValue(JSON_OBJECT, tail));
-        }
-        else {
-            Node *node, *tail = nullptr;
-            bool first = true;
-            for (auto& json : init) {
-                node = (Node*)allocate(sizeof(Node) - sizeof(char*));
-                node->value = clone(json.toValue());
-                tail = insertAfter(tail, node);
-            }
-            _value = new Value(listToValue(JSON_ARRAY, tail));
-        }
+        _value = new Value(build(init, JsonLiteral::isObject(init)));
     }
     // destructor
     virtual ~Json() {
@@ -152,22 +190,19 @@ public:
 
     // setters
     inline void set(Value value) {
-        destruct();
-        *_value = clone(value);
+        replace(clone(value));
     }
     inline void set(const char* value) {
         assert(value);
-        destruct();
-        *_value = Value(JSON_STRING, clone(value));
+        replace(Value(JSON_STRING, clone(value)));
     }
     inline Json& operator=(const Json& json) {
-        if (_allocator && _allocator == json._allocator) {
+        if (_allocator && _allocator == json._allocator && !_allocator->isRecycling()) {
             *_value = json.toValue();
         }
         else {
-            destruct();
-            *_value = clone(json.toValue());
-        }        
+            replace(share(json));
+        }
         return *this;
     }
     template<typename T = char>
@@ -179,6 +214,7 @@ public:
     // Array/Object generic functions
     inline uint32_t getLength() const {
         assert(getType() == JSON_ARRAY || getType() == JSON_OBJECT);
+        if (_value->isShaped()) return _value->toShaped()->shape->length;
         Node* n = _value->toNode();
         uint32_t l = 0;
         while (n) {
@@ -190,8 +226,22 @@ public:
     inline bool remove(Node* node) {
         assert(getType() == JSON_ARRAY || getType() == JSON_OBJECT);
         assert(node);
+        unshape();
         Node* n = _value->toNode();
+        uint32_t index = 0;
+        while (n && n != node) {
+            index++;
+            n = n->next;
+        }
+        if (!n) return false;
+        makeUnique(); // the node may move to a copied list
+        n = _value->toNode();
         Node* prev = nullptr;
+        for (uint32_t i = 0; i < index; i++) {
+            prev = n;
+            n = n->next;
+        }
+        node = n;
         while (n) {
             if (n == node) {
                 if (prev)
@@ -202,6 +252,10 @@ public:
                     node->next = nullptr;
                     freeCrtAllocatedValue(Value(getType(), node));
                 }
+                else if (_allocator->isRecycling()) {
+                    node->next = nullptr;
+                    recycle(Value(getType(), node));
+                }
                 return true;
             }
             prev = n;
@@ -210,18 +264,15 @@ public:
         return false;
     }
     // Array functions
+    // the node could be modified, so a document parsed with PARSE_KEEP_SOURCE marks the array
     inline Node* getElement(uint32_t index) const {
         assert(getType() == JSON_ARRAY);
-        Node* n = _value->toNode();
-        uint32_t i = 0;
-        while (n) {
-            if (index == i++) break;
-            n = n->next;
-        }
-        return n;
+        touchSource(*_value);
+        return elementAt(index);
     }
     inline Node* pushBack(Value val) {
         assert(getType() == JSON_ARRAY || (getType() == JSON_OBJECT && getLength() == 0));
+        makeUnique();
         Node* n = (Node*)allocate(sizeof(Node) - sizeof(char*));
         n->value = clone(val);
         Node* tail = _value->toNode();
@@ -238,6 +289,7 @@ public:
     inline Node* insertAt(uint32_t index, Value val) {
         assert(getType() == JSON_ARRAY || (getType() == JSON_OBJECT && getLength() == 0 && index == 0));
         assert(index <= getLength());
+        makeUnique();
         Node* n = (Node*)allocate(sizeof(Node) - sizeof(char*));
         n->value = clone(val);
         Node* tail = _value->toNode();
@@ -259,19 +311,37 @@ public:
             n->next = nullptr;
             *_value = Value(JSON_ARRAY, n);
         }
+        return n;
     }
     // Object functions
-    inline Node* findMember(const char* name) const {
+    // the first member with the name, a shaped object is converted to a node list
+    inline Node* findMember(const char* name) {
         assert(getType() == JSON_OBJECT);
-        Node* n = _value->toNode();
-        while (n) {
-            if (strcmp(n->name, name) == 0) break;
-            n = n->next;
-        }
-        return n;
+        touchSource(*_value); // the node could be modified
+        unshape(); // nodes are needed
+        return findNode(name);
+    }
+    // the value of the first member with the name, shaped objects are kept. the value could
+    // be modified, so a document parsed with PARSE_KEEP_SOURCE marks the object, the const
+    // overloads only read.
+    inline Value* findValue(const char* name) {
+        touchSource(*_value);
+        return lookupValue(name);
+    }
+    inline const Value* findValue(const char* name) const {
+        return lookupValue(name);
+    }
+    inline Value* findValue(const Key& key) {
+        touchSource(*_value);
+        return lookupValue(key);
+    }
+    inline const Value* findValue(const Key& key) const {
+        return lookupValue(key);
     }
     inline Node* addMember(const char* name, Value val) {
         assert(getType() == JSON_OBJECT);
+        unshape();
+        makeUnique();
         Node* n = (Node*)allocate(sizeof(Node));
         n->name = clone(name);
         n->value = clone(val);
@@ -286,122 +356,886 @@ public:
         }
         return n;
     }
-    // subscript
+    // subscript, a missing member or element is added. the containers on the way are taken
+    // as modified, a document parsed with PARSE_KEEP_SOURCE writes them anew. to read only,
+    // subscript a const Json.
     inline Json operator[](uint32_t index) {
+        makeUnique();
         if (getType() == JSON_ARRAY) {
             uint32_t length = getLength();
             if (index < length) {
-                Node* n = getElement(index);
-                return Json(&n->value, _allocator);
+                Node* n = elementAt(index);
+                return view(&n->value);
             }
             else if (index == length) { // if index == length, push back
                 Node* n = pushBack(Value(JSON_NULL));
-                return Json(&n->value, _allocator);
+                return view(&n->value);
             }
         }
         else if (index == 0 && getType() == JSON_OBJECT && getLength() == 0) {
             Node* n = pushBack(Value(JSON_NULL));
-            return Json(&n->value, _allocator);
+            return view(&n->value);
         }
         return Json(nullptr);
     }
     template<typename T = char> // to prevent zero's ambiguous
     inline Json operator[](const T* name) {
         if (getType() == JSON_OBJECT) {
-            Node* n = findMember(name);
-            if (!n) {
-                n = addMember(name, Value(JSON_NULL));
+            makeUnique();
+            Value* v = lookupValue(name);
+            if (!v) {
+                v = &addMember(name, Value(JSON_NULL))->value;
             }
-            return Json(&n->value, _allocator); // RVO
+            return view(v);
         }
         return Json(nullptr);
     }
-    // dump
-    bool dump(char* buffer, size_t bufferSize, size_t* pSize = nullptr, bool formatted = true) {
+    inline Json operator[](const Key& key) {
+        if (getType() == JSON_OBJECT) {
+            makeUnique();
+            Value* v = lookupValue(key);
+            if (!v) {
+                v = &addMember(key._name, Value(JSON_NULL))->value;
+            }
+            return view(v);
+        }
+        return Json(nullptr);
+    }
+    // read-only subscripts, a missing member or element reads as null. nothing is added or
+    // copied, and a document parsed with PARSE_KEEP_SOURCE keeps the text of what is read.
+    inline const Json operator[](uint32_t index) const {
+        Node* n = getType() == JSON_ARRAY ? elementAt(index) : nullptr;
+        return n ? view(&n->value) : Json(nullptr);
+    }
+    template<typename T = char>
+    inline const Json operator[](const T* name) const {
+        Value* v = getType() == JSON_OBJECT ? lookupValue(name) : nullptr;
+        return v ? view(v) : Json(nullptr);
+    }
+    inline const Json operator[](const Key& key) const {
+        Value* v = getType() == JSON_OBJECT ? lookupValue(key) : nullptr;
+        return v ? view(v) : Json(nullptr);
+    }
+    // convert a shaped object to a node list, for the node based interface
+    inline void unshape() {
+        if (!_value->isShaped()) return;
+        assert(_allocator); // shaped objects only live in a document
+        touchSource(*_value);
+        ShapedObject* object = _value->toShaped();
+        bool recycling = _allocator->isRecycling();
+        Node *n, *tail = nullptr;
+        for (uint32_t i = 0; i < object->shape->length; i++) {
+            n = (Node*)allocate(sizeof(Node));
+            n->name = recycling ? clone(object->shape->names()[i]) : object->shape->names()[i]; // names belong to the shape
+            n->value = object->values()[i];
+            tail = insertAfter(tail, n);
+        }
+        *_value = listToValue(JSON_OBJECT, tail);
+        if (recycling) _allocator->recycle(object, sizeof(ShapedObject) + object->shape->length * sizeof(Value));
+    }
+    // bytes allocated for this value and its subtree. strings in the input of a parsed
+    // document are not counted, shared subtrees are counted in full.
+    size_t footprint() const {
+        return footprint(*_value);
+    }
+    // dump, style sets the layout and numbers how doubles are written. a document too deep
+    // for the memory left fails, false or an empty string.
+    bool dump(char* buffer, size_t bufferSize, size_t* pSize = nullptr, const DumpStyle& style = true,
+        const NumberFormat& numbers = NumberFormat()) {
         Writer<BufferWriter> writer(buffer, bufferSize);
-        _value->dump(writer, formatted);
+        writer.setNumberFormat(numbers);
+        _value->dump(writer, style, sources());
         writer.putc('\0');
         if (pSize) *pSize = writer.size();
-        return writer.size() <= bufferSize;
+        return writer.size() <= bufferSize && writer.getError() == ERROR_NO_ERROR;
     }
-    std::string dump(bool formatted = true) {
+    std::string dump(const DumpStyle& style = true, const NumberFormat& numbers = NumberFormat()) {
         std::string buffer;
         Writer<StringWriter> writer(buffer);
-        _value->dump(writer, formatted);
+        writer.setNumberFormat(numbers);
+        _value->dump(writer, style, sources());
+        if (ZJSON_UNLIKELY(writer.getError() != ERROR_NO_ERROR)) buffer.clear();
         return buffer;
     }
+    // dump with at most one allocation. a first pass counts everything but the doubles,
+    // which take the most their exponent allows (numberBound), and out is sized to that.
+    // the bound is a few bytes a double over the dump, and out keeps it as its capacity.
+    // resize fills the bytes with zeros, a memset of the bound, still cheaper than growing
+    // the string. returns ERROR_NO_ERROR or ERROR_OUT_OF_MEMORY, out is empty then.
+    int dump(std::string& out, const DumpStyle& style = true, const NumberFormat& numbers = NumberFormat()) {
+        Writer<BoundingWriter> bound;
+        bound.setNumberFormat(numbers);
+        _value->dump(bound, style, sources());
+        if (ZJSON_UNLIKELY(bound.getError() != ERROR_NO_ERROR)) {
+            out.clear();
+            return bound.getError();
+        }
+        size_t size = bound.size();
+        out.resize(size);
+        char* buffer = &out[0];
+        Writer<BufferWriter> writer(buffer, size);
+        writer.setNumberFormat(numbers);
+        _value->dump(writer, style, sources());
+        out.resize(writer.getError() == ERROR_NO_ERROR ? writer.size() : 0);
+        return writer.getError();
+    }
+    // the exact size of the dump, without a terminating zero, 0 if out of memory. it is no
+    // cheap pre-pass: every double is formatted to count it, about the cost of the dump.
+    size_t measure(const DumpStyle& style = true, const NumberFormat& numbers = NumberFormat()) const {
+        Writer<CountingWriter> counter;
+        counter.setNumberFormat(numbers);
+        _value->dump(counter, style, sources());
+        return counter.getError() == ERROR_NO_ERROR ? counter.size() : 0;
+    }
+    // stream to a file descriptor, FILE* or callback through a fixed buffer,
+    // returns ERROR_NO_ERROR, ERROR_IO or ERROR_OUT_OF_MEMORY
+    int dump(const Sink& sink, const DumpStyle& style = true, const NumberFormat& numbers = NumberFormat()) {
+        std::unique_ptr<Writer<StreamWriter>> writer(new Writer<StreamWriter>(sink));
+        writer->setNumberFormat(numbers);
+        _value->dump(*writer, style, sources());
+        writer->flush();
+        return writer->getError();
+    }
+    // dump the members or elements of the root on threads, 0 for one per core, it pays off
+    // for documents of tens of MB. a root with less than two children is dumped on this thread.
+    // returns the error of the dump, out is empty after ERROR_OUT_OF_MEMORY.
+    int dumpParallel(std::string& out, unsigned threads = 0, const DumpStyle& style = true,
+        const NumberFormat& numbers = NumberFormat()) {
+        Writer<StringWriter> writer(out);
+        writer.setNumberFormat(numbers);
+        _value->dumpParallel(writer, style, threads, sources());
+        if (ZJSON_UNLIKELY(writer.getError() != ERROR_NO_ERROR)) out.clear();
+        return writer.getError();
+    }
+    int dumpParallel(const Sink& sink, unsigned threads = 0, const DumpStyle& style = true,
+        const NumberFormat& numbers = NumberFormat()) {
+        std::unique_ptr<Writer<StreamWriter>> writer(new Writer<StreamWriter>(sink));
+        writer->setNumberFormat(numbers);
+        _value->dumpParallel(*writer, style, threads, sources());
+        writer->flush();
+        return writer->getError();
+    }
 protected:
+    inline Node* findNode(const char* name) const {
+        Node* n = _value->toNode();
+        while (n) {
+            if (strcmp(n->name, name) == 0) break;
+            n = n->next;
+        }
+        return n;
+    }
+    inline Node* elementAt(uint32_t index) const {
+        Node* n = _value->toNode();
+        uint32_t i = 0;
+        while (n) {
+            if (index == i++) break;
+            n = n->next;
+        }
+        return n;
+    }
+    inline Value* lookupValue(const char* name) const {
+        assert(getType() == JSON_OBJECT);
+        if (_value->isShaped()) {
+            ShapedObject* object = _value->toShaped();
+            int slot = object->find(name);
+            return slot >= 0 ? &object->values()[slot] : nullptr;
+        }
+        Node* n = findNode(name);
+        return n ? &n->value : nullptr;
+    }
+    inline Value* lookupValue(const Key& key) const {
+        assert(getType() == JSON_OBJECT);
+        if (_value->isShaped()) {
+            ShapedObject* object = _value->toShaped();
+            const Shape* shape = object->shape;
+            // ids are unique in the process, a shape reallocated at the same address has a new
+            // one. the id takes 57 bits of the cache and the slot + 1 the other 7, the slot is
+            // checked against the shape still, in case the id ever wrapped.
+            uint64_t cache = key._cache.load(std::memory_order_relaxed);
+            uint32_t cached = (uint32_t)(cache & Key::SLOT_MASK) - 1;
+            if ((cache >> 7) == (shape->id & Key::ID_MASK) && cached < shape->length && shape->hashes()[cached] == key._hash)
+                return &object->values()[cached];
+            int slot = shape->find(key._name, key._hash);
+            if (slot < 0) return nullptr;
+            key._cache.store((shape->id & Key::ID_MASK) << 7 | (uint64_t)(slot + 1), std::memory_order_relaxed);
+            return &object->values()[slot];
+        }
+        // a node list is scanned, a cached position could skip an earlier duplicated name
+        Node* n = findNode(key._name);
+        return n ? &n->value : nullptr;
+    }
     // allocate with or without allocator
     inline void *allocate(size_t size) {
         if (_allocator) return _allocator->allocate(size);
-        return malloc(size);
+        return crtAllocate(size);
+    }
+    inline void *allocateString(size_t size) {
+        if (_allocator) return _allocator->allocateString(size);
+        return crtAllocate(size);
+    }
+    // the value of an owning copy
+    inline Value copy(const Json& o) {
+        if (_allocator) // has allocator, recycled values can't be shared
+            return _allocator->isRecycling() ? clone(o.toValue()) : o.toValue();
+        return share(o); // no allocator, deep copy or share in copy-on-write mode
+    }
+    // copy the value of another Json, without allocators both share it in copy-on-write mode
+    inline Value share(const Json& json) {
+#ifdef ZJSON_COPY_ON_WRITE
+        if (!_allocator && !json._allocator)
+            return retainCrtAllocatedValue(json.toValue());
+#endif
+        return clone(json.toValue());
+    }
+    // the input text of a parsed container no longer matches it, see PARSE_KEEP_SOURCE.
+    // like copy-on-write, a container is marked when it's navigated for a mutation.
+    inline void touchSource(const Value& value) const {
+        if (ZJSON_UNLIKELY(_allocator && _allocator->getSources())) _allocator->getSources()->markDirty(value);
+    }
+    inline const SourceSpans* sources() const {
+        return _allocator ? _allocator->getSources() : nullptr;
+    }
+    // the values are crt-allocated: an owning Json without allocator, or a view into one.
+    // a view made from a Value* of the caller is not known to be.
+    inline bool isCrtTree() const {
+        return !_allocator && (!_isValueView || _inCrtTree);
+    }
+    inline Json view(Value* value) const {
+        Json json(value, _allocator);
+        json._inCrtTree = isCrtTree();
+        return json;
+    }
+    // copy the node list if it is shared, so a mutation only copies the path to it
+    inline void makeUnique() {
+        touchSource(*_value);
+#ifdef ZJSON_COPY_ON_WRITE
+        Type type = getType();
+        if (!isCrtTree() || (type != JSON_ARRAY && type != JSON_OBJECT)) return;
+        Node* head = _value->toNode();
+        if (!head || crtRefCount(head) == 1) return;
+        Node *n, *tail = nullptr;
+        for (Node* node = head; node; node = node->next) {
+            if (type == JSON_OBJECT) {
+                n = (Node*)allocate(sizeof(Node));
+                n->name = (char*)crtRetain(node->name);
+            }
+            else { // JSON_ARRAY
+                n = (Node*)allocate(sizeof(Node) - sizeof(char*));
+            }
+            n->value = retainCrtAllocatedValue(node->value);
+            tail = insertAfter(tail, n);
+        }
+        *_value = listToValue(type, tail);
+        freeCrtAllocatedValue(Value(type, head)); // drop a reference of the shared list
+#endif
     }
     // deep copying
     inline char* clone(const char* str) {
         size_t l = strlen(str) + 1;
-        char* rstr = (char*)allocate(l);
+        char* rstr = (char*)allocateString(l);
+        if (ZJSON_UNLIKELY(!rstr)) return nullptr;
         memcpy(rstr, str, l);
         return rstr;
     }
-    Node* clone(const Node* node, Type nodeType) {
-        assert(node);
-        Node* n;
-        if (nodeType == JSON_OBJECT) {
-            n = (Node*)allocate(sizeof(Node));
-            n->name = clone(node->name);
+    // an open container while cloning, the next source member or element and the copied list
+    struct CloneFrame {
+        const Node* node;
+        const Value* values;    // of a shaped object
+        char* const* names;
+        uint32_t remaining;
+        Type type;
+        Node* tail;
+    };
+    // iterative, the open containers are on an explicit stack. out of memory, what was
+    // copied is freed and null is returned.
+    Value clone(const Value value) {
+        Type type = value.getType();
+        if (type == JSON_STRING) {
+            char* str = clone(value.toString());
+            return str ? Value(JSON_STRING, str) : Value(JSON_NULL);
         }
-        else { // JSON_ARRAY
-            n = (Node*)allocate(sizeof(Node) - sizeof(char*));
+        if ((type != JSON_ARRAY && type != JSON_OBJECT) || (!value.isShaped() && !value.toNode()))
+            return value;
+        DepthStack<CloneFrame> stack;
+        int top = 0;
+        cloneEnter(stack[0], value);
+        for (;;) {
+            CloneFrame& frame = stack[top];
+            const char* name = nullptr;
+            const Value* source = nullptr;
+            if (frame.values) {
+                if (frame.remaining) {
+                    name = *frame.names++;
+                    source = frame.values++;
+                    frame.remaining--;
+                }
+            }
+            else if (frame.node) {
+                if (frame.type == JSON_OBJECT) name = frame.node->name;
+                source = &frame.node->value;
+                frame.node = frame.node->next;
+            }
+            if (!source) { // the container is complete
+                Value list = listToValue(frame.type, frame.tail);
+                if (top == 0) return list;
+                stack[--top].tail->value = list;
+                continue;
+            }
+            Node* n;
+            if (frame.type == JSON_OBJECT) {
+                char* copied = clone(name);
+                n = copied ? (Node*)allocate(sizeof(Node)) : nullptr;
+                if (ZJSON_UNLIKELY(!n)) {
+                    if (copied) drop(Value(JSON_STRING, copied));
+                    return cloneFailed(stack, top);
+                }
+                n->name = copied;
+            }
+            else { // JSON_ARRAY
+                n = (Node*)allocate(sizeof(Node) - sizeof(char*));
+                if (ZJSON_UNLIKELY(!n)) return cloneFailed(stack, top);
+            }
+            n->value = Value(JSON_NULL);
+            frame.tail = insertAfter(frame.tail, n);
+            Type t = source->getType();
+            if ((t == JSON_ARRAY || t == JSON_OBJECT) && (source->isShaped() || source->toNode())) {
+                if (ZJSON_UNLIKELY(!stack.reserve(top + 1))) return cloneFailed(stack, top);
+                cloneEnter(stack[++top], *source);
+            }
+            else if (t == JSON_STRING) {
+                char* str = clone(source->toString());
+                if (ZJSON_UNLIKELY(!str)) return cloneFailed(stack, top);
+                n->value = Value(JSON_STRING, str);
+            }
+            else {
+                n->value = *source;
+            }
         }
-        n->value = clone(node->value);
-        return n;
     }
-    Value clone(const Value value) {
+    // close the open containers of a failed clone and free them
+    Value cloneFailed(DepthStack<CloneFrame>& stack, int top) {
+        for (; top > 0; top--) stack[top - 1].tail->value = listToValue(stack[top].type, stack[top].tail);
+        drop(listToValue(stack[0].type, stack[0].tail));
+        return Value(JSON_NULL);
+    }
+    static void cloneEnter(CloneFrame& frame, const Value& value) {
+        if (value.isShaped()) {
+            ShapedObject* object = value.toShaped();
+            frame.node = nullptr;
+            frame.values = object->values();
+            frame.names = object->shape->names();
+            frame.remaining = object->shape->length;
+        }
+        else {
+            frame.node = value.toNode();
+            frame.values = nullptr;
+        }
+        frame.type = value.getType();
+        frame.tail = nullptr;
+    }
+    // build a literal directly, every node and string is allocated once
+    Value build(const JsonLiteral& literal) {
+        switch (literal._kind) {
+        case JsonLiteral::KIND_STRING:
+            return Value(JSON_STRING, clone(literal._key));
+        case JsonLiteral::KIND_JSON:
+        case JsonLiteral::KIND_MOVABLE_JSON: {
+            Json& json = const_cast<Json&>(*literal._json);
+            if (_allocator && _allocator == json._allocator && !_allocator->isRecycling()) // shares the same allocator
+                return json.toValue();
+            if (literal._kind == JsonLiteral::KIND_MOVABLE_JSON && !_allocator &&
+                !json._allocator && !json._isValueView && json._value) { // steals the temporary
+                Value value = *json._value;
+                *json._value = Value(JSON_NULL);
+                return value;
+            }
+            return share(json);
+        }
+        case JsonLiteral::KIND_LIST:
+            return build(literal._list, literal._isObject);
+        default:
+            return clone(literal._value);
+        }
+    }
+    Value build(std::initializer_list<JsonLiteral> init, bool isObject) {
+        Node *node, *tail = nullptr;
+        for (auto& literal : init) {
+            if (isObject) {
+                node = (Node*)allocate(sizeof(Node));
+                node->name = clone(literal._list.begin()->_key);
+                node->value = build(literal._list.begin()[1]);
+            }
+            else {
+                node = (Node*)allocate(sizeof(Node) - sizeof(char*));
+                node->value = build(literal);
+            }
+            tail = insertAfter(tail, node);
+        }
+        return listToValue(isObject ? JSON_OBJECT : JSON_ARRAY, tail);
+    }
+    // memory accounting
+    inline size_t chunkFootprint(size_t size) const {
+        return _allocator ? (size + 7) & ~(size_t)7 : crtFootprint(size);
+    }
+    size_t footprint(const Value& value) const {
+        size_t size = 0;
+        walk(value, [&](const Value& v) { size += ownFootprint(v); }, [](const Value&) {});
+        return size;
+    }
+    // the chunks of a value itself, those of a container without its children
+    size_t ownFootprint(const Value& value) const {
         Type type = value.getType();
         if (type == JSON_STRING) {
-            return Value(JSON_STRING, clone(value.toString()));
+            const char* str = value.toString();
+            return !_allocator || _allocator->ownsString(str) ? chunkFootprint(strlen(str) + 1) : 0;
+        }
+        else if (value.isShaped()) { // the names belong to the shape
+            ShapedObject* object = value.toShaped();
+            return chunkFootprint(sizeof(ShapedObject) + object->shape->length * sizeof(Value));
         }
         else if (type == JSON_ARRAY || type == JSON_OBJECT) {
-            Node *n, *tail = nullptr;
-            for (Node *node = value.toNode(); node; node = node->next) {
-                n = clone(node, type);
-                tail = insertAfter(tail, n);
+            size_t size = 0;
+            for (Node* node = value.toNode(); node; node = node->next) {
+                if (type == JSON_OBJECT) {
+                    size += chunkFootprint(sizeof(Node)) + ownFootprint(Value(JSON_STRING, node->name));
+                }
+                else {
+                    size += chunkFootprint(sizeof(Node) - sizeof(char*));
+                }
+            }
+            return size;
+        }
+        return 0;
+    }
+    // an open container of a walk, the next member or element
+    struct WalkFrame {
+        const Value* container;
+        const Node* node;
+        const Value* values;    // of a shaped object
+        uint32_t remaining;
+    };
+    // visit a value and all below it without recursion, enter(value) for each value before
+    // the children of a container and leave(container) after them. a container deeper than
+    // the stack could grow to is left without its children, false then.
+    template <typename Enter, typename Leave>
+    static bool walk(const Value& root, Enter enter, Leave leave) {
+        DepthStack<WalkFrame> stack;
+        int top = -1;
+        bool complete = true;
+        const Value* value = &root;
+        for (;;) {
+            enter(*value);
+            Type type = value->getType();
+            if (type == JSON_ARRAY || type == JSON_OBJECT) {
+                if (ZJSON_LIKELY(stack.reserve(++top))) {
+                    WalkFrame& frame = stack[top];
+                    frame.container = value;
+                    frame.node = value->isShaped() ? nullptr : value->toNode();
+                    frame.values = value->isShaped() ? value->toShaped()->values() : nullptr;
+                    frame.remaining = value->isShaped() ? value->toShaped()->shape->length : 0;
+                }
+                else {
+                    top--;
+                    complete = false;
+                    leave(*value);
+                }
+            }
+            // the next value, the node is passed before its value could be left
+            for (;;) {
+                if (top == -1) return complete;
+                WalkFrame& frame = stack[top];
+                if (frame.values && frame.remaining) {
+                    value = frame.values++;
+                    frame.remaining--;
+                    break;
+                }
+                if (frame.node) {
+                    value = &frame.node->value;
+                    frame.node = frame.node->next;
+                    break;
+                }
+                leave(*frame.container);
+                top--;
             }
-            return listToValue(type, tail);
         }
-        return value;
     }
     // destruction
     void destruct() {
-        if (_value && !_isValueView && !_allocator) {
-            freeCrtAllocatedValue(*_value);
+        if (_value && !_isValueView) {
+            if (!_allocator)
+                freeCrtAllocatedValue(*_value);
+            else if (_allocator->isRecycling())
+                recycle(*_value);
         }
     }
+    // free a value allocated by this Json and referenced nowhere else
+    void drop(Value value) {
+        if (!_allocator)
+            freeCrtAllocatedValue(value);
+        else if (_allocator->isRecycling())
+            recycle(value);
+    }
+    // give the chunks of a dropped value back to the allocator, a container's after its
+    // children. out of memory for the walk, the chunks below stay until the allocator is reset.
+    void recycle(Value value) {
+        walk(value, [&](const Value& v) {
+            touchSource(v); // its chunks may hold another container later
+            if (v.getType() == JSON_STRING)
+                _allocator->recycleString(v.toString(), strlen(v.toString()) + 1);
+        }, [&](const Value& container) {
+            if (container.isShaped()) {
+                ShapedObject* object = container.toShaped();
+                _allocator->recycle(object, sizeof(ShapedObject) + object->shape->length * sizeof(Value));
+                return;
+            }
+            Type type = container.getType();
+            Node* node = container.toNode();
+            while (node) {
+                Node* next = node->next;
+                if (type == JSON_OBJECT) {
+                    _allocator->recycleString(node->name, strlen(node->name) + 1);
+                    _allocator->recycle(node, sizeof(Node));
+                }
+                else {
+                    _allocator->recycle(node, sizeof(Node) - sizeof(char*));
+                }
+                node = next;
+            }
+        });
+    }
+    inline void replace(Value value) {
+        Value old = *_value;
+        *_value = value;
+#ifdef ZJSON_COPY_ON_WRITE
+        if (isCrtTree()) // a view of a shared tree releases the overwritten value too
+            freeCrtAllocatedValue(old);
+#else
+        if (!_isValueView && !_allocator)
+            freeCrtAllocatedValue(old);
+#endif
+        if (_allocator && _allocator->isRecycling())
+            recycle(old);
+    }
 protected:
 	Value* _value;
 	Allocator* _allocator;
 	bool _isValueView;
+	bool _inCrtTree = false; // a view returned by operator[] of a crt-allocated tree
+	bool _isDocument = false; // the root of a Document, a view of it but copied as a value
 };
 
+inline JsonLiteral::JsonLiteral(const Json& json)
+    : _kind(KIND_JSON), _value(JSON_NULL), _key(json.getString()), _json(&json) {}
+inline JsonLiteral::JsonLiteral(Json&& json)
+    : _kind(KIND_MOVABLE_JSON), _value(JSON_NULL), _key(json.getString()), _json(&json) {}
+
 inline NodeIterator begin(Json& json) {
+    json.touchSource(json.toValue()); // the nodes could be modified
+    if (json.isObject()) json.unshape();
     return NodeIterator { json.toValue().toNode() };
 }
 inline NodeIterator end(Json&) {
     return NodeIterator { nullptr };
 }
 
+// Iterates a const Json without converting a shaped object, its members are read into
+// a node held by the iterator
+struct ConstNodeIterator {
+    const Node* p;
+    const Value* values;    // of a shaped object
+    char* const* names;
+    uint32_t remaining;
+    Node member;
+    void load() {
+        if (!remaining) return;
+        member.value = *values;
+        member.name = *names;
+    }
+    void operator++() {
+        if (values) {
+            values++;
+            names++;
+            remaining--;
+            load();
+        }
+        else {
+            p = p->next;
+        }
+    }
+    bool operator!=(const ConstNodeIterator &x) const { return p != x.p || remaining != x.remaining; }
+    const Node *operator*() const { return values ? &member : p; }
+    const Node *operator->() const { return **this; }
+};
+inline ConstNodeIterator begin(const Json& json) {
+    Value value = json.toValue();
+    if (value.isShaped()) {
+        ShapedObject* object = value.toShaped();
+        ConstNodeIterator it = { nullptr, object->values(), object->shape->names(), object->shape->length,
+            { Value(JSON_NULL), nullptr, nullptr } };
+        it.load();
+        return it;
+    }
+    return ConstNodeIterator { value.toNode(), nullptr, nullptr, 0, { Value(JSON_NULL), nullptr, nullptr } };
+}
+inline ConstNodeIterator end(const Json&) {
+    return ConstNodeIterator { nullptr, nullptr, nullptr, 0, { Value(JSON_NULL), nullptr, nullptr } };
+}
+
 // A document for parsing JSON text as DOM.
-class Document final : public Json {
+class Document : public Json {
 public:
-    Document() : Json(nullptr) {
-        _allocator = new Allocator();
+    friend class Builder;
+    explicit Document(const BlockPolicy& policy = defaultBlockPolicy())
+        : Json(&_root, &_arena), _root(JSON_NULL), _arena(policy), _strings(policy)
+    {
+        _isDocument = true;
     }
-    ~Document() {
-        delete _allocator;
+    // parse into a caller-owned buffer first, then blocks from upstream.
+    // with a null upstream, parse returns ERROR_OUT_OF_MEMORY when the buffer runs out.
+    Document(void* buffer, size_t bufferSize, MemoryResource* upstream = defaultResource(),
+        const BlockPolicy& policy = defaultBlockPolicy())
+        : Json(&_root, &_arena), _root(JSON_NULL), _arena(policy, upstream, buffer, bufferSize),
+        _strings(policy, upstream)
+    {
+        _isDocument = true;
+    }
+    Document(const Document&) = delete;
+    Document& operator=(const Document&) = delete;
+    // the length is measured for the size hint, a scan much cheaper than the parse
+    int parse(char* content, ParseFlags flags = PARSE_DEFAULT) {
+        return parse(content, strlen(content), flags);
     }
-    int parse(char* content) {
+    // the DOM size is roughly proportional to the input, so the length of content
+    // sizes the first block of allocator
+    // with PARSE_KEEP_SOURCE, the input is copied before the in-situ parse, and a dump
+    // with DumpStyle::roundTrip() copies the arrays and objects not modified through Json
+    // from it as they were.
+    int parse(char* content, size_t length, ParseFlags flags = PARSE_DEFAULT) {
         _allocator->reset();
-        return jsonParse(content, _value, *_allocator);
+        *_value = Value(JSON_NULL); // the old tree went with the reset, a failed parse leaves null
+        if (length) _allocator->reserve(length * ZJSON_DOM_SIZE_RATIO);
+        if (flags & PARSE_SHAPED_OBJECTS) _shapes.reset(_allocator);
+        SourceSpans* sources = nullptr;
+        if (flags & PARSE_KEEP_SOURCE) {
+            _sources.reset();
+            if (!_sources.keep(content, length ? length : strlen(content), *_allocator))
+                return ERROR_OUT_OF_MEMORY;
+            sources = &_sources;
+        }
+        int error = jsonParse(content, _value, *_allocator, flags & PARSE_SHAPED_OBJECTS ? &_shapes : nullptr, sources);
+        if (error == ERROR_NO_ERROR) _allocator->setSources(sources);
+        return error;
+    }
+    // how much memory is kept for the next parse, see RetentionPolicy
+    void setRetention(const RetentionPolicy& retention) {
+        _arena.setRetention(retention);
+        _strings.setRetention(retention);
+    }
+    // return unused blocks to upstream, keeping at most keepSize bytes of them
+    void trim(size_t keepSize = 0) {
+        _arena.trim(keepSize);
+        _strings.trim(keepSize);
+    }
+    // keep copied strings and keys in an arena of their own, apart from the nodes, so
+    // traversals don't pull string bytes into cache. strings of a parsed document stay
+    // in its input either way.
+    void setSplitArenas(bool enabled) {
+        _arena.setStringAllocator(enabled ? &_strings : nullptr);
+    }
+    // reuse the memory of removed and overwritten values for later modifications, so a
+    // long-lived document doesn't grow. values are copied instead of shared then, enable
+    // it before parsing.
+    void setRecycling(bool enabled) {
+        _arena.setRecycling(enabled);
+        _strings.setRecycling(enabled);
+    }
+    // memory used by the document, and its values counted by type
+    MemoryStats memoryStats() const {
+        MemoryStats stats;
+        memset(&stats, 0, sizeof(stats));
+        _arena.addStats(stats);
+        _strings.addStats(stats);
+        countValues(_root, stats);
+        return stats;
+    }
+    // copy the live tree into fresh blocks and release the old ones, shaped objects
+    // become node lists. Json views into the document are invalidated. if the copy
+    // runs out of memory, the document is kept as it was and ERROR_OUT_OF_MEMORY returned.
+    int compact() {
+        void* blocks = _arena.detachBlocks();
+        void* stringBlocks = _strings.detachBlocks();
+        Value root = clone(_root);
+        if (ZJSON_UNLIKELY(root.getType() == JSON_NULL && _root.getType() != JSON_NULL)) {
+            _arena.restoreBlocks(blocks);
+            _strings.restoreBlocks(stringBlocks);
+            return ERROR_OUT_OF_MEMORY;
+        }
+        _shapes.reset();
+        _sources.reset();
+        _arena.setSources(nullptr);
+        _arena.releaseBlocks(blocks);
+        _strings.releaseBlocks(stringBlocks);
+        _root = root;
+        return ERROR_NO_ERROR;
+    }
+private:
+    static void countValues(const Value& value, MemoryStats& stats) {
+        walk(value, [&](const Value& v) { stats.values[v.getType()]++; }, [](const Value&) {});
+    }
+    // the root value and the allocator are held inline, no heap allocation until parsing
+    Value _root;
+    Allocator _arena;
+    Allocator _strings; // used when the arenas are split
+    ShapeTable _shapes;
+    SourceSpans _sources;
+};
+
+template <size_t Size>
+struct InlineStorage {
+    alignas(8) char _storage[Size];
+};
+
+// A document with an inline first block of InlineSize bytes, so small documents
+// are constructed, parsed and destroyed without any heap operation.
+template <size_t InlineSize>
+class InlineDocument final : private InlineStorage<InlineSize>, public Document {
+public:
+    explicit InlineDocument(MemoryResource* upstream = defaultResource(),
+        const BlockPolicy& policy = defaultBlockPolicy())
+        : Document(this->_storage, InlineSize, upstream, policy) {}
+};
+
+// A builder writes a DOM straight into a document's allocator.
+// Every append is O(1), it keeps the tail of each open container on a stack.
+class Builder {
+public:
+    explicit Builder(Document& document)
+        : _root(document._value), _allocator(*document._allocator), _stack(&_allocator), _top(-1),
+        _hasKey(false), _hasRoot(false), _error(ERROR_NO_ERROR)
+    {
+        _allocator.reset();
+        *_root = Value(JSON_NULL);
+    }
+    Builder(const Builder&) = delete;
+    Builder& operator=(const Builder&) = delete;
+
+    int getError() const { return _error; }
+    // true when the root value is completely built
+    bool isComplete() const { return _hasRoot && _top == -1; }
+
+    bool beginObject() { return begin(true); }
+    bool beginArray() { return begin(false); }
+    bool endObject() { return end(true); }
+    bool endArray() { return end(false); }
+    // if copy is false, name must be null-terminated at name[length] and outlive the document
+    bool key(const char* name, size_t length, bool copy = true) {
+        if (ZJSON_UNLIKELY(_top == -1 || !_stack[_top].isObject || _hasKey))
+            return fail(ERROR_UNEXPECTED_CHARACTER);
+        Node* node = (Node*)_allocator.allocate(sizeof(Node));
+        char* str = copy ? clone(name, length) : const_cast<char*>(name);
+        if (ZJSON_UNLIKELY(!node || !str))
+            return fail(ERROR_OUT_OF_MEMORY);
+        assert(str[length] == '\0');
+        node->name = str;
+        node->value = Value(JSON_NULL);
+        _stack[_top].tail = insertAfter(_stack[_top].tail, node);
+        _hasKey = true;
+        return true;
+    }
+    bool key(const char* name) { return key(name, strlen(name)); }
+    bool value(Value v) {
+        assert(v.getType() != JSON_ARRAY && v.getType() != JSON_OBJECT);
+        Value* slot = nextSlot();
+        if (ZJSON_UNLIKELY(!slot)) return false;
+        *slot = v;
+        return true;
+    }
+    bool value(double d) { return value(Value(d)); }
+    bool value(int32_t n) { return value(Value(n)); }
+    bool value(bool b) { return value(Value(b)); }
+    bool value(nullptr_t) { return value(Value(JSON_NULL)); }
+    // if copy is false, str must be null-terminated at str[length] and outlive the document
+    bool value(const char* str, size_t length, bool copy = true) {
+        char* s = copy ? clone(str, length) : const_cast<char*>(str);
+        if (ZJSON_UNLIKELY(!s)) return fail(ERROR_OUT_OF_MEMORY);
+        assert(s[length] == '\0');
+        return value(Value(JSON_STRING, s));
+    }
+    bool value(const char* str) { return value(str, strlen(str)); }
+private:
+    Value* _root;
+    Allocator& _allocator;
+    struct Frame {
+        Node* tail;
+        Value* slot;
+        bool isObject;
+    };
+    DepthStack<Frame> _stack; // grows in the document for deep trees
+    int _top;
+    bool _hasKey;
+    bool _hasRoot;
+    int _error;
+
+    inline bool fail(int error) {
+        if (!_error) _error = error;
+        return false;
+    }
+    inline char* clone(const char* str, size_t length) {
+        char* s = (char*)_allocator.allocateString(length + 1);
+        if (s) {
+            memcpy(s, str, length);
+            s[length] = '\0';
+        }
+        return s;
+    }
+    // where the next value goes: the root, the pending member or a new element
+    inline Value* nextSlot() {
+        if (ZJSON_UNLIKELY(_error)) return nullptr;
+        if (_top == -1) {
+            if (ZJSON_UNLIKELY(_hasRoot)) {
+                fail(ERROR_BAD_ROOT);
+                return nullptr;
+            }
+            _hasRoot = true;
+            return _root;
+        }
+        if (_stack[_top].isObject) {
+            if (ZJSON_UNLIKELY(!_hasKey)) {
+                fail(ERROR_UNEXPECTED_CHARACTER);
+                return nullptr;
+            }
+            _hasKey = false;
+            return &_stack[_top].tail->value;
+        }
+        Node* node = (Node*)_allocator.allocate(sizeof(Node) - sizeof(char*));
+        if (ZJSON_UNLIKELY(!node)) {
+            fail(ERROR_OUT_OF_MEMORY);
+            return nullptr;
+        }
+        node->value = Value(JSON_NULL);
+        _stack[_top].tail = insertAfter(_stack[_top].tail, node);
+        return &node->value;
+    }
+    bool begin(bool isObject) {
+        Value* slot = nextSlot();
+        if (ZJSON_UNLIKELY(!slot)) return false;
+        if (ZJSON_UNLIKELY(!_stack.reserve(_top + 1)))
+            return fail(ERROR_OUT_OF_MEMORY);
+        ++_top;
+        _stack[_top].tail = nullptr;
+        _stack[_top].slot = slot;
+        _stack[_top].isObject = isObject;
+        return true;
+    }
+    bool end(bool isObject) {
+        if (ZJSON_UNLIKELY(_error)) return false;
+        if (ZJSON_UNLIKELY(_top == -1))
+            return fail(ERROR_STACK_UNDERFLOW);
+        if (ZJSON_UNLIKELY(_stack[_top].isObject != isObject || _hasKey))
+            return fail(ERROR_MISMATCH_BRACKET);
+        *_stack[_top].slot = listToValue(isObject ? JSON_OBJECT : JSON_ARRAY, _stack[_top].tail);
+        --_top;
+        return true;
     }
 };
 
@@ -17,8 +17,14 @@
 
 #include "base.h"
 #include "allocator.h"
+#include "pool.h"
+#include "vmem.h"
+#include "slab.h"
 #include "value.h"
+#include "shape.h"
+#include "source.h"
 #include "deserialize.h"
 #include "dtoa_milo.h"
+#include "dtoa_schubfach.h"
 #include "serialize.h"
 #include "wrapper.h"
\ No newline at end of file